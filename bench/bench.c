@@ -0,0 +1,275 @@
+// QR Code Generator -- stage benchmark
+// Times each generation stage for every version, error correction level and data mode (see "make bench").
+// The library is compiled into this program so that its internal stages can be timed directly.
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Count any heap allocations made by the library (it is not expected to make any)
+static uint64_t benchAllocations = 0;
+#define malloc(_size) (benchAllocations++, malloc(_size))
+#define calloc(_count, _size) (benchAllocations++, calloc(_count, _size))
+#define realloc(_memory, _size) (benchAllocations++, realloc(_memory, _size))
+#include "../qrcode.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+static uint64_t BenchNow(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// One benchmark case: a code of a version and level, filled to capacity with one mode of data
+typedef struct
+{
+    int version;
+    qrcode_error_correction_level_t errorCorrectionLevel;
+    qrcode_mode_indicator_t mode;
+    char text[8192];
+    size_t charCount;
+    qrcode_t qrcode;
+    qrcode_segment_t segment;
+    qrcode_blocks_t blocks;
+    const qrcode_layout_t *layout;
+    size_t bitPosition;         // After the segments
+    qrcode_board_t board;
+    int maskPattern;            // Mask applied next
+    uint8_t buffer[QRCODE_BUFFER_SIZE(QRCODE_VERSION_MAX)];
+    uint8_t scratchBuffer[QRCODE_SCRATCH_BUFFER_SIZE(QRCODE_VERSION_MAX)];
+    int sink;
+} bench_case_t;
+
+static void BenchSegments(bench_case_t *c) { c->bitPosition = QrCodeWriteSegments(&c->qrcode); }
+static void BenchPadding(bench_case_t *c) { QrCodeWritePadding(&c->qrcode, c->bitPosition); }
+static void BenchEcc(bench_case_t *c) { QrCodeWriteEcc(&c->qrcode, &c->blocks); }
+static void BenchFunctionPatterns(bench_case_t *c) { qrcode_board_t board; QrCodeDrawFunctionPatterns(&board, c->version); c->sink += (int)board.rows[0]; }
+static void BenchPlacement(bench_case_t *c) { QrCodePlaceCodewords(&c->qrcode, &c->blocks, c->layout, &c->board); }
+static void BenchApplyMask(bench_case_t *c) { QrCodeApplyMask(&c->board, c->layout->contentBoard, (qrcode_mask_pattern_t)c->maskPattern); c->maskPattern = (c->maskPattern + 1) & 7; }
+static void BenchPenalty(bench_case_t *c) { c->sink += QrCodeBoardEvaluatePenalty(&c->board, c->layout, -1, false); }
+
+static void BenchGenerate(bench_case_t *c)
+{
+    qrcode_t qrcode;
+    qrcode_segment_t segment;
+    QrCodeInit(&qrcode, c->version, c->errorCorrectionLevel);
+    qrcode.optimizeEcc = false;
+    QrCodeSegmentAppend(&qrcode, &segment, c->mode, c->text, c->charCount, false);
+    c->sink += QrCodeGenerate(&qrcode, c->buffer, c->scratchBuffer);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*function)(bench_case_t *c);
+} bench_stage_t;
+
+static const bench_stage_t benchStages[] = {
+    { "segments", BenchSegments },                  // QrCodeSegmentWrite() of the data
+    { "padding", BenchPadding },                    // Terminator and pad codewords
+    { "rs_remainder", BenchEcc },                   // QrCodeRSRemainder() of every block
+    { "function_patterns", BenchFunctionPatterns }, // Finders, timing and alignment patterns
+    { "placement", BenchPlacement },                // Interleaved codewords onto the board
+    { "apply_mask", BenchApplyMask },               // QrCodeApplyMask() of one pattern
+    { "evaluate_penalty", BenchPenalty },           // Penalty of one mask candidate (as scored eight times by the automatic mask)
+    { "generate", BenchGenerate },                  // End-to-end QrCodeGenerate() (with segment setup and automatic mask)
+};
+#define BENCH_STAGES (sizeof(benchStages) / sizeof(benchStages[0]))
+
+typedef struct
+{
+    double nsPerOp;
+    double opsPerSec;
+    double allocsPerOp;
+} bench_result_t;
+
+// Run a stage for at least minTime nanoseconds (doubling the iterations to calibrate)
+static void BenchStage(const bench_stage_t *stage, bench_case_t *c, uint64_t minTime, bench_result_t *result)
+{
+    for (uint64_t iterations = 1; ; iterations *= 2)
+    {
+        uint64_t allocations = benchAllocations;
+        uint64_t start = BenchNow();
+        for (uint64_t i = 0; i < iterations; i++) stage->function(c);
+        uint64_t elapsed = BenchNow() - start;
+        if (elapsed >= minTime || iterations >= ((uint64_t)1 << 40))
+        {
+            result->nsPerOp = (double)elapsed / (double)iterations;
+            result->opsPerSec = elapsed > 0 ? 1000000000.0 * (double)iterations / (double)elapsed : 0;
+            result->allocsPerOp = (double)(benchAllocations - allocations) / (double)iterations;
+            return;
+        }
+    }
+}
+
+// Fill the case with the most characters of its mode that fit the version (deterministic pseudo-random data)
+static bool BenchSetup(bench_case_t *c)
+{
+    static const char alphanumeric[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+    uint32_t seed = (uint32_t)(c->version * 131 + c->errorCorrectionLevel * 7 + c->mode);
+    for (size_t i = 0; i < sizeof(c->text); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 16;
+        if (c->mode == QRCODE_MODE_INDICATOR_NUMERIC) c->text[i] = (char)('0' + r % 10);
+        else if (c->mode == QRCODE_MODE_INDICATOR_ALPHANUMERIC) c->text[i] = alphanumeric[r % 45];
+        else c->text[i] = (char)(r & 0xff);
+    }
+
+    size_t capacity = QrCodeDataCapacity(c->version, c->errorCorrectionLevel);
+    for (c->charCount = sizeof(c->text); c->charCount > 0; c->charCount--)
+    {
+        qrcode_segment_t segment;
+        segment.mode = c->mode;
+        segment.charCount = c->charCount;
+        segment.text = c->text;
+        segment.next = NULL;
+        if (QrCodeSegmentSize(&segment, c->version) <= capacity) break;
+    }
+
+    // Prepared code and board for the individual stages
+    QrCodeInit(&c->qrcode, c->version, c->errorCorrectionLevel);
+    c->qrcode.version = c->version;
+    c->qrcode.optimizeEcc = false;
+    QrCodeSegmentAppend(&c->qrcode, &c->segment, c->mode, c->text, c->charCount, false);
+    if (c->charCount == 0 || !QrCodePrepare(&c->qrcode)) return false;
+    c->qrcode.scratchBuffer = c->scratchBuffer;
+    c->bitPosition = QrCodeWriteSegments(&c->qrcode);
+    QrCodeWritePadding(&c->qrcode, c->bitPosition);
+    QrCodeBlocks(&c->qrcode, &c->blocks);
+    QrCodeWriteEcc(&c->qrcode, &c->blocks);
+    c->layout = QrCodeLayout(c->version);
+    QrCodePlaceCodewords(&c->qrcode, &c->blocks, c->layout, &c->board);
+    c->maskPattern = 0;
+    return true;
+}
+
+static const char *BenchEclName(qrcode_error_correction_level_t ecl)
+{
+    switch (ecl)
+    {
+        case QRCODE_ECL_L: return "L";
+        case QRCODE_ECL_M: return "M";
+        case QRCODE_ECL_Q: return "Q";
+        case QRCODE_ECL_H: return "H";
+        default: return "?";
+    }
+}
+
+static const char *BenchModeName(qrcode_mode_indicator_t mode)
+{
+    switch (mode)
+    {
+        case QRCODE_MODE_INDICATOR_NUMERIC: return "numeric";
+        case QRCODE_MODE_INDICATOR_ALPHANUMERIC: return "alphanumeric";
+        case QRCODE_MODE_INDICATOR_8_BIT: return "byte";
+        default: return "?";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const qrcode_error_correction_level_t levels[] = { QRCODE_ECL_L, QRCODE_ECL_M, QRCODE_ECL_Q, QRCODE_ECL_H };
+    static const qrcode_mode_indicator_t modes[] = { QRCODE_MODE_INDICATOR_NUMERIC, QRCODE_MODE_INDICATOR_ALPHANUMERIC, QRCODE_MODE_INDICATOR_8_BIT };
+    bool json = false;
+    double minTimeMs = 2.0;
+    int versionMin = QRCODE_VERSION_MIN, versionMax = QRCODE_VERSION_MAX;
+    const char *eclFilter = NULL;
+    const char *modeFilter = NULL;
+    const char *stageFilter = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json")) { json = true; }
+        else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) { minTimeMs = atof(argv[++i]); }
+        else if (!strcmp(argv[i], "--version") && i + 1 < argc) { versionMin = versionMax = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--versions") && i + 1 < argc) { if (sscanf(argv[++i], "%d-%d", &versionMin, &versionMax) != 2) versionMax = versionMin; }
+        else if (!strcmp(argv[i], "--ecl") && i + 1 < argc) { eclFilter = argv[++i]; }
+        else if (!strcmp(argv[i], "--mode") && i + 1 < argc) { modeFilter = argv[++i]; }
+        else if (!strcmp(argv[i], "--stage") && i + 1 < argc) { stageFilter = argv[++i]; }
+        else
+        {
+            fprintf(stderr, "Usage:  qrcode-bench [--json] [--min-time 2.0] [--version 1 | --versions 1-40] [--ecl L|M|Q|H] [--mode numeric|alphanumeric|byte] [--stage name]\n");
+            fprintf(stderr, "Stages:");
+            for (size_t s = 0; s < BENCH_STAGES; s++) fprintf(stderr, " %s", benchStages[s].name);
+            fprintf(stderr, "\n");
+            return -1;
+        }
+    }
+    if (versionMin < QRCODE_VERSION_MIN) versionMin = QRCODE_VERSION_MIN;
+    if (versionMax > QRCODE_VERSION_MAX) versionMax = QRCODE_VERSION_MAX;
+    uint64_t minTime = (uint64_t)(minTimeMs * 1000000.0);
+
+    // Build the shared tables outside of the timings
+    for (int v = QRCODE_VERSION_MIN; v <= QRCODE_VERSION_MAX; v++) QrCodeLayout(v);
+    QrCodeRSGeneratorLog(1);
+
+    if (!json)
+    {
+        printf("%-3s %-3s %-12s %5s", "ver", "ecl", "mode", "chars");
+        for (size_t s = 0; s < BENCH_STAGES; s++) if (stageFilter == NULL || !strcmp(stageFilter, benchStages[s].name)) printf(" %17s", benchStages[s].name);
+        printf(" %12s %7s\n", "codes/sec", "allocs");
+    }
+
+    static bench_case_t c;
+    for (int version = versionMin; version <= versionMax; version++)
+    {
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        {
+            if (eclFilter != NULL && toupper((unsigned char)eclFilter[0]) != BenchEclName(levels[l])[0]) continue;
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            {
+                if (modeFilter != NULL && strcmp(modeFilter, BenchModeName(modes[m]))) continue;
+                c.version = version;
+                c.errorCorrectionLevel = levels[l];
+                c.mode = modes[m];
+                if (!BenchSetup(&c)) continue;
+
+                bench_result_t results[BENCH_STAGES];
+                double allocations = 0;
+                double codesPerSec = 0;
+                bool first = true;
+                if (json) printf("{\"version\":%d,\"ecl\":\"%s\",\"mode\":\"%s\",\"chars\":%u,\"stages\":{", version, BenchEclName(levels[l]), BenchModeName(modes[m]), (unsigned int)c.charCount);
+                else printf("%-3d %-3s %-12s %5u", version, BenchEclName(levels[l]), BenchModeName(modes[m]), (unsigned int)c.charCount);
+                for (size_t s = 0; s < BENCH_STAGES; s++)
+                {
+                    if (stageFilter != NULL && strcmp(stageFilter, benchStages[s].name)) continue;
+                    BenchStage(&benchStages[s], &c, minTime, &results[s]);
+                    allocations += results[s].allocsPerOp;
+                    if (benchStages[s].function == BenchGenerate) codesPerSec = results[s].opsPerSec;
+                    if (json) printf("%s\"%s\":{\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f,\"allocs_per_op\":%g}", first ? "" : ",", benchStages[s].name, results[s].nsPerOp, results[s].opsPerSec, results[s].allocsPerOp);
+                    else printf(" %14.1f ns", results[s].nsPerOp);
+                    first = false;
+                }
+                if (json) printf("},\"codes_per_sec\":%.1f,\"allocs_per_op\":%g}\n", codesPerSec, allocations);
+                else printf(" %12.1f %7g\n", codesPerSec, allocations);
+                fflush(stdout);
+            }
+        }
+    }
+    if (c.sink == 0x7fffffff) printf("\n");  // (keep the results live)
+    return 0;
+}
@@ -1,6 +1,10 @@
 // Generates a QR Code
 // Dan Jackson, 2020
 
+#ifdef __linux__
+#define _GNU_SOURCE     // open_memstream(), accept4()
+#endif
+
 #ifdef _WIN32
 #pragma setlocale(".65001") // pseudo-locale doesn't really work? Save with UTF-8 BOM
 #pragma execution_character_set("utf-8")
@@ -18,9 +22,27 @@
 
 #include "qrcode.h"
 
+#ifdef __linux__
+#define SERVE_SUPPORTED
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
 typedef enum {
     OUTPUT_TEXT,
     OUTPUT_BITMAP,
+    OUTPUT_PNG,
     OUTPUT_SVG,
     OUTPUT_SIXEL,
     OUTPUT_TGP,
@@ -130,22 +152,30 @@ text_render_t textRenderDots6 =
 };
 
 
-static void OutputQrCodeText(qrcode_t *qrcode, FILE *fp, int dimension, const text_render_t *t, int quiet, bool invert)
+// Module of a packed row (QrCodeRowPack()), x from the start of the quiet margin
+static inline int RowModule(const uint8_t *row, int x) { return (row[x >> 3] >> (7 - (x & 7))) & 1; }
+
+static bool OutputQrCodeText(qrcode_t *qrcode, FILE *fp, int dimension, const text_render_t *t, int quiet, bool invert)
 {
+    int width = dimension + 2 * quiet;
+    size_t rowBytes = QRCODE_ROW_BYTES(dimension, quiet);
+    uint8_t *rows = (uint8_t *)malloc(rowBytes * t->cellH);
+    if (rows == NULL) return false;
     for (int y = -quiet; y < dimension + quiet; y += t->cellH)
     {
-        for (int x = -quiet; x < dimension + quiet; x += t->cellW)
+        // Packed rows of this line of cells
+        for (int yy = 0; yy < t->cellH; yy++) QrCodeRowPack(qrcode, y + yy, quiet, rows + yy * rowBytes);
+        for (int x = 0; x < width; x += t->cellW)
         {
             int value = 0;
-            value |= (QrCodeModuleGet(qrcode, x, y) & 1) ? 0x01 : 0x00;
             for (int yy = 0; yy < t->cellH; yy++)
             {
                 for (int xx = 0; xx < t->cellW; xx++)
                 {
                     int isSet = invert ? 1 : 0;
-                    if (x + xx < dimension + quiet && y + yy < dimension + quiet)
+                    if (x + xx < width && y + yy < dimension + quiet)
                     {
-                        isSet = QrCodeModuleGet(qrcode, x + xx, y + yy) & 1;
+                        isSet = RowModule(rows + yy * rowBytes, x + xx);
                     }
                     if (isSet) value |= (1 << (yy * t->cellW + xx));
                 }
@@ -158,64 +188,669 @@ static void OutputQrCodeText(qrcode_t *qrcode, FILE *fp, int dimension, const te
         }
         fprintf(fp, "\n");
     }
+    free(rows);
+    return true;
 }
 
 
-// Endian-independent short/long read/write
-static void fputshort(uint16_t v, FILE *fp) { fputc((uint8_t)((v >> 0) & 0xff), fp); fputc((uint8_t)((v >> 8) & 0xff), fp); }
-static void fputlong(uint32_t v, FILE *fp) { fputc((uint8_t)((v >> 0) & 0xff), fp); fputc((uint8_t)((v >> 8) & 0xff), fp); fputc((uint8_t)((v >> 16) & 0xff), fp); fputc((uint8_t)((v >> 24) & 0xff), fp); }
-static void OutputQrCodeImageBitmap(qrcode_t* qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert)
+// Endian-independent short/long write
+static uint8_t *putshort(uint8_t *p, uint16_t v) { p[0] = (uint8_t)(v >> 0); p[1] = (uint8_t)(v >> 8); return p + 2; }
+static uint8_t *putlong(uint8_t *p, uint32_t v) { p[0] = (uint8_t)(v >> 0); p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24); return p + 4; }
+
+// Expand a packed module row (QrCodeRowPack()) of 'width' modules to 'scale' pixels per module, packed most-significant bit first (each bit inverted if 'flip'), zero padded to a whole byte
+static void ExpandRow(const uint8_t *row, int width, int scale, bool flip, uint8_t *line)
 {
-    const int BMP_HEADERSIZE = 54;
-    const int BMP_PAL_SIZE = 2 * 4;
+    uint32_t bits = 0;
+    int count = 0;
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t value = (RowModule(row, x) ^ flip) ? 0xffffffff : 0;
+        for (int remaining = scale; remaining > 0; )
+        {
+            int n = remaining < 24 ? remaining : 24;
+            bits = (bits << n) | (value >> (32 - n));
+            count += n;
+            remaining -= n;
+            while (count >= 8) { count -= 8; *line++ = (uint8_t)(bits >> count); }
+        }
+    }
+    if (count > 0) *line = (uint8_t)(bits << (8 - count));
+}
+
+#define BMP_HEADER_SIZE (54 + 2 * 4)    // File and info headers, and the two-entry palette
 
+// Bytes per scanline, and the total file size, of the 1-bit bitmap of a code
+static size_t BitmapSpan(int dimension, int quiet, int scale) { return (size_t)(((2 * quiet + dimension) * scale + 31) / 32) * 4; }
+static size_t BitmapSize(int dimension, int quiet, int scale) { return BMP_HEADER_SIZE + BitmapSpan(dimension, quiet, scale) * (size_t)((2 * quiet + dimension) * scale); }
+
+static void BitmapHeader(uint8_t *header, int dimension, int quiet, int scale, bool invert)
+{
     int width = (2 * quiet + dimension) * scale;
     int height = (2 * quiet + dimension) * scale;
-    int span = ((width + 31) / 32) * 4;
-    int bufferSize = span * height;
-
-    fputc('B', fp); fputc('M', fp); // bfType
-    fputlong(bufferSize + BMP_HEADERSIZE + BMP_PAL_SIZE, fp); // bfSize
-    fputshort(0, fp);              // bfReserved1
-    fputshort(0, fp);              // bfReserved2
-    fputlong(BMP_HEADERSIZE + BMP_PAL_SIZE, fp); // bfOffBits
-    fputlong(40, fp);              // biSize
-    fputlong(width, fp);           // biWidth
-    fputlong(-height, fp);         // biHeight (negative for top-down)
-    fputshort(1, fp);              // biPlanes
-    fputshort(1, fp);              // biBitCount
-    fputlong(0, fp);               // biCompression
-    fputlong(bufferSize, fp);      // biSizeImage
-    fputlong(0, fp);               // biXPelsPerMeter 3780
-    fputlong(0, fp);               // biYPelsPerMeter 3780
-    fputlong(0, fp);               // biClrUsed
-    fputlong(0, fp);               // biClrImportant
+    uint32_t bufferSize = (uint32_t)(BitmapSpan(dimension, quiet, scale) * height);
+    uint8_t *p = header;
+
+    *p++ = 'B'; *p++ = 'M';             // bfType
+    p = putlong(p, bufferSize + BMP_HEADER_SIZE); // bfSize
+    p = putshort(p, 0);                 // bfReserved1
+    p = putshort(p, 0);                 // bfReserved2
+    p = putlong(p, BMP_HEADER_SIZE);    // bfOffBits
+    p = putlong(p, 40);                 // biSize
+    p = putlong(p, width);              // biWidth
+    p = putlong(p, -height);            // biHeight (negative for top-down)
+    p = putshort(p, 1);                 // biPlanes
+    p = putshort(p, 1);                 // biBitCount
+    p = putlong(p, 0);                  // biCompression
+    p = putlong(p, bufferSize);         // biSizeImage
+    p = putlong(p, 0);                  // biXPelsPerMeter 3780
+    p = putlong(p, 0);                  // biYPelsPerMeter 3780
+    p = putlong(p, 0);                  // biClrUsed
+    p = putlong(p, 0);                  // biClrImportant
 
     // Invert will invert the bit values in the file, but the palette will be swapped so will be invisible in most uses
     // Palette Entry 0 - white (unless inverted)
-    fputc(invert ? 0x00 : 0xff, fp); fputc(invert ? 0x00 : 0xff, fp); fputc(invert ? 0x00 : 0xff, fp); fputc(0x00, fp);
+    *p++ = invert ? 0x00 : 0xff; *p++ = invert ? 0x00 : 0xff; *p++ = invert ? 0x00 : 0xff; *p++ = 0x00;
     // Palette Entry 1 - black (unless inverted)
-    fputc(invert ? 0xff : 0x00, fp); fputc(invert ? 0xff : 0x00, fp); fputc(invert ? 0xff : 0x00, fp); fputc(0x00, fp);
-    
-    // Bitmap data
+    *p++ = invert ? 0xff : 0x00; *p++ = invert ? 0xff : 0x00; *p++ = invert ? 0xff : 0x00; *p++ = 0x00;
+}
+
+// The 'scale' scanlines of module row y: one packed scanline, replicated (scale * BitmapSpan() bytes)
+static void BitmapModuleRow(qrcode_t *qrcode, int y, int dimension, int quiet, int scale, bool invert, uint8_t *row, uint8_t *out)
+{
+    size_t span = BitmapSpan(dimension, quiet, scale);
+    QrCodeRowPack(qrcode, y, quiet, row);
+    memset(out, 0, span);
+    ExpandRow(row, 2 * quiet + dimension, scale, invert, out);
+    for (int i = 1; i < scale; i++) memcpy(out + i * span, out, span);
+}
+
+// Render the 1-bit bitmap file into memory (BitmapSize() bytes)
+static bool RenderQrCodeBitmap(qrcode_t *qrcode, uint8_t *out, int dimension, int quiet, int scale, bool invert)
+{
+    size_t block = BitmapSpan(dimension, quiet, scale) * scale;
+    uint8_t *row = (uint8_t *)malloc(QRCODE_ROW_BYTES(dimension, quiet));
+    if (row == NULL) return false;
+    BitmapHeader(out, dimension, quiet, scale, invert);
+    out += BMP_HEADER_SIZE;
+    for (int y = -quiet; y < dimension + quiet; y++, out += block)
+    {
+        BitmapModuleRow(qrcode, y, dimension, quiet, scale, invert, row, out);
+    }
+    free(row);
+    return true;
+}
+
+static bool OutputQrCodeImageBitmap(qrcode_t* qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert)
+{
+    size_t block = BitmapSpan(dimension, quiet, scale) * scale;
+    uint8_t *row = (uint8_t *)malloc(QRCODE_ROW_BYTES(dimension, quiet));
+    uint8_t *out = (uint8_t *)malloc(block);
+    if (row == NULL || out == NULL) { free(out); free(row); return false; }
+
+    uint8_t header[BMP_HEADER_SIZE];
+    BitmapHeader(header, dimension, quiet, scale, invert);
+    fwrite(header, 1, sizeof(header), fp);
+
+    // Bitmap data, written a module row at a time
+    for (int y = -quiet; y < dimension + quiet; y++)
+    {
+        BitmapModuleRow(qrcode, y, dimension, quiet, scale, invert, row, out);
+        fwrite(out, 1, block, fp);
+    }
+    free(out);
+    free(row);
+    return true;
+}
+
+
+// Deflate (RFC 1951) in a zlib stream (RFC 1950): greedy LZ77 over a sliding window with hash chains, each block sent stored, fixed or dynamic Huffman coded, whichever is smallest
+#define DEFLATE_WINDOW 32768            // Maximum match distance (the window buffer holds twice this)
+#define DEFLATE_HASH_SIZE 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_BLOCK_TOKENS 16384
+#define DEFLATE_OUTPUT_SIZE 16384
+
+typedef struct
+{
+    int level;                          // 0=stored, 1-9=longer searches for matches
+    void (*output)(void *context, const uint8_t *data, size_t length);
+    void *context;
+    uint8_t window[2 * DEFLATE_WINDOW];
+    int windowLength;                   // Bytes in the window
+    int position;                       // Next byte to encode
+    int blockStart;                     // Position of the first byte of the current block
+    int32_t head[DEFLATE_HASH_SIZE];    // Most recent position of each hash (-1=none)
+    int32_t prev[DEFLATE_WINDOW];       // Previous position with the same hash
+    uint32_t tokens[DEFLATE_BLOCK_TOKENS];  // Literal byte, or match (length << 16 | distance)
+    int tokenCount;
+    uint32_t adlerA, adlerB;
+    uint64_t bits;                      // Pending output bits (least-significant first)
+    int bitCount;
+    uint8_t out[DEFLATE_OUTPUT_SIZE];
+    size_t outLength;
+} deflate_t;
+
+static const uint16_t deflateLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t deflateLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t deflateDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t deflateDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t deflateCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+static const uint16_t deflateChainLength[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+
+static int DeflateLengthCode(int length) { int c = 0; while (c < 28 && deflateLengthBase[c + 1] <= length) c++; return c; }
+static int DeflateDistanceCode(int distance) { int c = 0; while (c < 29 && deflateDistanceBase[c + 1] <= distance) c++; return c; }
+
+static void DeflateFlushOutput(deflate_t *d)
+{
+    if (d->outLength > 0) d->output(d->context, d->out, d->outLength);
+    d->outLength = 0;
+}
+
+static void DeflateByte(deflate_t *d, uint8_t value)
+{
+    d->out[d->outLength++] = value;
+    if (d->outLength == DEFLATE_OUTPUT_SIZE) DeflateFlushOutput(d);
+}
+
+static void DeflateBits(deflate_t *d, uint32_t value, int count)
+{
+    d->bits |= (uint64_t)value << d->bitCount;
+    d->bitCount += count;
+    while (d->bitCount >= 8) { DeflateByte(d, (uint8_t)d->bits); d->bits >>= 8; d->bitCount -= 8; }
+}
+
+static void DeflateAlign(deflate_t *d)
+{
+    if (d->bitCount > 0) DeflateBits(d, 0, 8 - d->bitCount);
+}
+
+static int HuffmanCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Canonical Huffman codes for the code lengths, bit-reversed for output
+static void HuffmanCodes(const uint8_t *lengths, int count, uint16_t *codes)
+{
+    int nextCode[16] = { 0 }, lengthCount[16] = { 0 };
+    for (int i = 0; i < count; i++) lengthCount[lengths[i]]++;
+    lengthCount[0] = 0;
+    for (int length = 1, code = 0; length < 16; length++) { code = (code + lengthCount[length - 1]) << 1; nextCode[length] = code; }
+    for (int i = 0; i < count; i++)
+    {
+        int code = nextCode[lengths[i]]++, reversed = 0;
+        for (int b = 0; b < lengths[i]; b++) reversed |= ((code >> b) & 1) << (lengths[i] - 1 - b);
+        codes[i] = (uint16_t)reversed;
+    }
+}
+
+// Huffman code lengths (up to maxBits) for the symbol frequencies, and their codes
+static void HuffmanBuild(const uint32_t *freq, int count, int maxBits, uint8_t *lengths, uint16_t *codes)
+{
+    uint64_t sorted[288];               // frequency << 16 | symbol, ascending
+    uint32_t work[288];
+    int used = 0;
+    memset(lengths, 0, count);
+    for (int i = 0; i < count; i++) if (freq[i]) sorted[used++] = ((uint64_t)freq[i] << 16) | (uint64_t)i;
+    if (used == 1) lengths[sorted[0] & 0xffff] = 1;
+    if (used >= 2)
+    {
+        qsort(sorted, used, sizeof(sorted[0]), HuffmanCompare);
+        for (int i = 0; i < used; i++) work[i] = (uint32_t)(sorted[i] >> 16);
+
+        // Moffat & Katajainen in-place minimum-redundancy code lengths
+        int root = 0, leaf = 2;
+        work[0] += work[1];
+        for (int next = 1; next < used - 1; next++)
+        {
+            if (leaf >= used || work[root] < work[leaf]) { work[next] = work[root]; work[root++] = (uint32_t)next; }
+            else work[next] = work[leaf++];
+            if (leaf >= used || (root < next && work[root] < work[leaf])) { work[next] += work[root]; work[root++] = (uint32_t)next; }
+            else work[next] += work[leaf++];
+        }
+        work[used - 2] = 0;
+        for (int next = used - 3; next >= 0; next--) work[next] = work[work[next]] + 1;
+        int available = 1, nodes = 0, depth = 0, next = used - 1;
+        root = used - 2;
+        while (available > 0)
+        {
+            while (root >= 0 && (int)work[root] == depth) { nodes++; root--; }
+            while (available > nodes) { work[next--] = (uint32_t)depth; available--; }
+            available = 2 * nodes;
+            depth++;
+            nodes = 0;
+        }
+
+        // Limit the lengths by moving codes down the tree until the code is complete again
+        int lengthCount[33] = { 0 };
+        for (int i = 0; i < used; i++) lengthCount[work[i] < 32 ? work[i] : 32]++;
+        for (int i = maxBits + 1; i <= 32; i++) { lengthCount[maxBits] += lengthCount[i]; lengthCount[i] = 0; }
+        uint32_t total = 0;
+        for (int i = maxBits; i > 0; i--) total += (uint32_t)lengthCount[i] << (maxBits - i);
+        while (total != (1u << maxBits))
+        {
+            lengthCount[maxBits]--;
+            for (int i = maxBits - 1; i > 0; i--) if (lengthCount[i]) { lengthCount[i]--; lengthCount[i + 1] += 2; break; }
+            total--;
+        }
+
+        // Shortest codes to the most frequent symbols
+        for (int length = 1, j = used; length <= maxBits; length++)
+        {
+            for (int k = lengthCount[length]; k > 0; k--) lengths[sorted[--j] & 0xffff] = (uint8_t)length;
+        }
+    }
+
+    HuffmanCodes(lengths, count, codes);
+}
+
+// Run-length encode the code lengths (symbols 0-15, or 16/17/18 with the repeat count above 8 bits), returns the number of symbols
+static int DeflateCodeLengthRuns(const uint8_t *lengths, int count, uint16_t *runs)
+{
+    int n = 0;
+    for (int i = 0; i < count; )
+    {
+        int value = lengths[i], run = 1;
+        while (i + run < count && lengths[i + run] == value) run++;
+        i += run;
+        if (value == 0)
+        {
+            while (run >= 11) { int t = run < 138 ? run : 138; runs[n++] = (uint16_t)(18 | ((t - 11) << 8)); run -= t; }
+            if (run >= 3) { runs[n++] = (uint16_t)(17 | ((run - 3) << 8)); run = 0; }
+        }
+        else
+        {
+            runs[n++] = (uint16_t)value; run--;
+            while (run >= 3) { int t = run < 6 ? run : 6; runs[n++] = (uint16_t)(16 | ((t - 3) << 8)); run -= t; }
+        }
+        while (run-- > 0) runs[n++] = (uint16_t)value;
+    }
+    return n;
+}
+
+// Write the pending tokens as one block
+static void DeflateBlock(deflate_t *d, bool final)
+{
+    uint32_t litFreq[288] = { 0 }, distFreq[30] = { 0 };
+    uint64_t extraBits = 0;
+    for (int i = 0; i < d->tokenCount; i++)
+    {
+        uint32_t token = d->tokens[i];
+        if (token < 0x10000) { litFreq[token]++; continue; }
+        int lengthCode = DeflateLengthCode((int)(token >> 16)), distanceCode = DeflateDistanceCode((int)(token & 0xffff));
+        litFreq[257 + lengthCode]++;
+        distFreq[distanceCode]++;
+        extraBits += deflateLengthExtra[lengthCode] + deflateDistanceExtra[distanceCode];
+    }
+    litFreq[256] = 1;
+
+    // Dynamic codes (at least one distance code)
+    uint8_t litLengths[288], distLengths[30], clLengths[19], lengths[286 + 30];
+    uint16_t litCodes[288], distCodes[30], clCodes[19], runs[286 + 30];
+    bool noDistances = true;
+    for (int i = 0; i < 30; i++) if (distFreq[i]) noDistances = false;
+    if (noDistances) distFreq[0] = 1;
+    HuffmanBuild(litFreq, 286, 15, litLengths, litCodes);
+    HuffmanBuild(distFreq, 30, 15, distLengths, distCodes);
+    if (noDistances) distFreq[0] = 0;
+    int litCount = 286, distCount = 30;
+    while (litCount > 257 && litLengths[litCount - 1] == 0) litCount--;
+    while (distCount > 1 && distLengths[distCount - 1] == 0) distCount--;
+    memcpy(lengths, litLengths, litCount);
+    memcpy(lengths + litCount, distLengths, distCount);
+    int runCount = DeflateCodeLengthRuns(lengths, litCount + distCount, runs);
+    uint32_t clFreq[19] = { 0 };
+    for (int i = 0; i < runCount; i++) clFreq[runs[i] & 0xff]++;
+    HuffmanBuild(clFreq, 19, 7, clLengths, clCodes);
+    int clCount = 19;
+    while (clCount > 4 && clLengths[deflateCodeLengthOrder[clCount - 1]] == 0) clCount--;
+
+    // Sizes in bits of each block type
+    uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * (uint64_t)clCount + extraBits, fixedBits = 3 + extraBits;
+    for (int i = 0; i < 19; i++) dynamicBits += (uint64_t)clFreq[i] * (clLengths[i] + (i == 16 ? 2 : (i == 17 ? 3 : (i == 18 ? 7 : 0))));
+    for (int i = 0; i < 286; i++)
+    {
+        dynamicBits += (uint64_t)litFreq[i] * litLengths[i];
+        fixedBits += (uint64_t)litFreq[i] * (i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8)));
+    }
+    for (int i = 0; i < 30; i++) { dynamicBits += (uint64_t)distFreq[i] * distLengths[i]; fixedBits += (uint64_t)distFreq[i] * 5; }
+    int rawLength = d->position - d->blockStart;
+    uint64_t storedBits = 3 + 7 + (uint64_t)(rawLength + 4 * (rawLength / 65535 + 1)) * 8;
+
+    if (d->level == 0 || (storedBits <= dynamicBits && storedBits <= fixedBits))
+    {
+        // Stored, in parts of up to 65535 bytes
+        int offset = d->blockStart;
+        do
+        {
+            int length = rawLength < 65535 ? rawLength : 65535;
+            rawLength -= length;
+            DeflateBits(d, (final && rawLength == 0) ? 1 : 0, 3);
+            DeflateAlign(d);
+            DeflateBits(d, (uint32_t)length, 16);
+            DeflateBits(d, (uint32_t)length ^ 0xffff, 16);
+            for (int i = 0; i < length; i++) DeflateByte(d, d->window[offset + i]);
+            offset += length;
+        } while (rawLength > 0);
+    }
+    else
+    {
+        if (fixedBits <= dynamicBits)
+        {
+            DeflateBits(d, (final ? 1 : 0) | (1 << 1), 3);
+            for (int i = 0; i < 288; i++) litLengths[i] = (uint8_t)(i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8)));
+            for (int i = 0; i < 30; i++) distLengths[i] = 5;
+            HuffmanCodes(litLengths, 288, litCodes);
+            HuffmanCodes(distLengths, 30, distCodes);
+        }
+        else
+        {
+            DeflateBits(d, (final ? 1 : 0) | (2 << 1), 3);
+            DeflateBits(d, (uint32_t)(litCount - 257), 5);
+            DeflateBits(d, (uint32_t)(distCount - 1), 5);
+            DeflateBits(d, (uint32_t)(clCount - 4), 4);
+            for (int i = 0; i < clCount; i++) DeflateBits(d, clLengths[deflateCodeLengthOrder[i]], 3);
+            for (int i = 0; i < runCount; i++)
+            {
+                int symbol = runs[i] & 0xff;
+                DeflateBits(d, clCodes[symbol], clLengths[symbol]);
+                if (symbol == 16) DeflateBits(d, runs[i] >> 8, 2);
+                else if (symbol == 17) DeflateBits(d, runs[i] >> 8, 3);
+                else if (symbol == 18) DeflateBits(d, runs[i] >> 8, 7);
+            }
+        }
+        for (int i = 0; i < d->tokenCount; i++)
+        {
+            uint32_t token = d->tokens[i];
+            if (token < 0x10000) { DeflateBits(d, litCodes[token], litLengths[token]); continue; }
+            int length = (int)(token >> 16), distance = (int)(token & 0xffff);
+            int lengthCode = DeflateLengthCode(length), distanceCode = DeflateDistanceCode(distance);
+            DeflateBits(d, litCodes[257 + lengthCode], litLengths[257 + lengthCode]);
+            DeflateBits(d, (uint32_t)(length - deflateLengthBase[lengthCode]), deflateLengthExtra[lengthCode]);
+            DeflateBits(d, distCodes[distanceCode], distLengths[distanceCode]);
+            DeflateBits(d, (uint32_t)(distance - deflateDistanceBase[distanceCode]), deflateDistanceExtra[distanceCode]);
+        }
+        DeflateBits(d, litCodes[256], litLengths[256]);
+    }
+    d->tokenCount = 0;
+    d->blockStart = d->position;
+}
+
+static void DeflateInsert(deflate_t *d, int position)
+{
+    if (position + DEFLATE_MIN_MATCH > d->windowLength) return;
+    const uint8_t *p = d->window + position;
+    int hash = ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (DEFLATE_HASH_SIZE - 1);
+    d->prev[position & (DEFLATE_WINDOW - 1)] = d->head[hash];
+    d->head[hash] = position;
+}
+
+static void DeflateToken(deflate_t *d, uint32_t token)
+{
+    d->tokens[d->tokenCount++] = token;
+    if (d->tokenCount == DEFLATE_BLOCK_TOKENS) DeflateBlock(d, false);
+}
+
+// Encode the window up to the end (final), or while a whole match could still follow
+static void DeflateProcess(deflate_t *d, bool final)
+{
+    int end = final ? d->windowLength : d->windowLength - DEFLATE_MAX_MATCH;
+    while (d->position < end)
+    {
+        int position = d->position;
+        int available = d->windowLength - position;
+        int maxLength = available < DEFLATE_MAX_MATCH ? available : DEFLATE_MAX_MATCH;
+        int bestLength = DEFLATE_MIN_MATCH - 1, bestDistance = 0;
+        if (d->level > 0 && available >= DEFLATE_MIN_MATCH)
+        {
+            const uint8_t *p = d->window + position;
+            int candidate = d->head[((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (DEFLATE_HASH_SIZE - 1)];
+            for (int chain = deflateChainLength[d->level]; candidate >= 0 && chain > 0; chain--)
+            {
+                int distance = position - candidate;
+                if (distance <= 0 || distance > DEFLATE_WINDOW) break;
+                const uint8_t *q = d->window + candidate;
+                if (q[bestLength] == p[bestLength])
+                {
+                    int length = 0;
+                    while (length < maxLength && q[length] == p[length]) length++;
+                    if (length > bestLength) { bestLength = length; bestDistance = distance; }
+                    if (length >= maxLength) break;
+                }
+                candidate = d->prev[candidate & (DEFLATE_WINDOW - 1)];
+            }
+        }
+        if (bestDistance > 0)
+        {
+            for (int i = 0; i < bestLength; i++) DeflateInsert(d, position + i);
+            d->position += bestLength;
+            DeflateToken(d, ((uint32_t)bestLength << 16) | (uint32_t)bestDistance);
+        }
+        else
+        {
+            DeflateInsert(d, position);
+            d->position++;
+            DeflateToken(d, d->window[position]);
+        }
+    }
+}
+
+static void DeflateInit(deflate_t *d, int level, void (*output)(void *context, const uint8_t *data, size_t length), void *context)
+{
+    d->level = level < 0 ? 0 : (level > 9 ? 9 : level);
+    d->output = output;
+    d->context = context;
+    d->windowLength = d->position = d->blockStart = 0;
+    memset(d->head, 0xff, sizeof(d->head));
+    memset(d->prev, 0xff, sizeof(d->prev));
+    d->tokenCount = 0;
+    d->adlerA = 1;
+    d->adlerB = 0;
+    d->bits = 0;
+    d->bitCount = 0;
+    d->outLength = 0;
+    // zlib header: deflate with a 32 KB window, compression level hint, check bits
+    int levelHint = d->level < 2 ? 0 : (d->level < 6 ? 1 : (d->level == 6 ? 2 : 3));
+    uint16_t header = (uint16_t)(0x7800 | (levelHint << 6));
+    header += 31 - header % 31;
+    DeflateByte(d, (uint8_t)(header >> 8));
+    DeflateByte(d, (uint8_t)header);
+}
+
+static void DeflateWrite(deflate_t *d, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (d->windowLength == (int)sizeof(d->window))
+        {
+            // Finish the block (whose bytes would be lost for a stored block), and slide the window down
+            if (d->position > d->blockStart) DeflateBlock(d, false);
+            memmove(d->window, d->window + DEFLATE_WINDOW, DEFLATE_WINDOW);
+            d->windowLength -= DEFLATE_WINDOW;
+            d->position -= DEFLATE_WINDOW;
+            d->blockStart = d->position;
+            for (int i = 0; i < DEFLATE_HASH_SIZE; i++) d->head[i] = d->head[i] >= DEFLATE_WINDOW ? d->head[i] - DEFLATE_WINDOW : -1;
+            for (int i = 0; i < DEFLATE_WINDOW; i++) d->prev[i] = d->prev[i] >= DEFLATE_WINDOW ? d->prev[i] - DEFLATE_WINDOW : -1;
+        }
+        size_t n = sizeof(d->window) - (size_t)d->windowLength;
+        if (n > length) n = length;
+        memcpy(d->window + d->windowLength, data, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            d->adlerA += data[i];
+            d->adlerB += d->adlerA;
+            if ((i & 4095) == 4095) { d->adlerA %= 65521; d->adlerB %= 65521; }
+        }
+        d->adlerA %= 65521;
+        d->adlerB %= 65521;
+        d->windowLength += (int)n;
+        data += n;
+        length -= n;
+        DeflateProcess(d, false);
+    }
+}
+
+static void DeflateFinish(deflate_t *d)
+{
+    DeflateProcess(d, true);
+    DeflateBlock(d, true);
+    DeflateAlign(d);
+    uint32_t adler = (d->adlerB << 16) | d->adlerA;
+    for (int i = 3; i >= 0; i--) DeflateByte(d, (uint8_t)(adler >> (8 * i)));
+    DeflateFlushOutput(d);
+}
+
+
+// CRC-32 (as for PNG and zlib), four bits at a time
+static uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+static void PngChunk(FILE *fp, const char *type, const uint8_t *data, size_t length)
+{
+    uint8_t header[8] = { (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length, (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3] };
+    uint32_t crc = Crc32(Crc32(0, header + 4, 4), data, length);
+    uint8_t trailer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+    fwrite(header, 1, sizeof(header), fp);
+    if (length > 0) fwrite(data, 1, length, fp);
+    fwrite(trailer, 1, sizeof(trailer), fp);
+}
+
+static void PngIdat(void *context, const uint8_t *data, size_t length) { PngChunk((FILE *)context, "IDAT", data, length); }
+
+// 1-bit grayscale PNG: the first pixel row of each module row is unfiltered or "up" filtered (whichever has the smaller sum of signed bytes), the repeats of each row are "up" filtered to zeros
+static bool OutputQrCodeImagePng(qrcode_t *qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert, int level)
+{
+    int modules = 2 * quiet + dimension;
+    int width = modules * scale;
+    int height = modules * scale;
+    size_t lineBytes = ((size_t)width + 7) / 8;
+
+    deflate_t *deflate = (deflate_t *)malloc(sizeof(deflate_t));
+    uint8_t *row = (uint8_t *)malloc(QRCODE_ROW_BYTES(dimension, quiet));
+    uint8_t *line = (uint8_t *)calloc(lineBytes, 1);             // Current pixels (1=white)
+    uint8_t *previous = (uint8_t *)calloc(lineBytes, 1);         // Pixels of the last module row
+    uint8_t *filtered = (uint8_t *)calloc(lineBytes + 1, 1);     // Filter type and filtered bytes
+    if (deflate == NULL || row == NULL || line == NULL || previous == NULL || filtered == NULL)
+    {
+        free(filtered); free(previous); free(line); free(row); free(deflate);
+        return false;
+    }
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof(signature), fp);
+    uint8_t ihdr[13] = {
+        (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+        (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+        1,      // Bit depth
+        0,      // Color type: grayscale
+        0,      // Compression method: deflate
+        0,      // Filter method: adaptive
+        0,      // Interlace method: none
+    };
+    PngChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+    DeflateInit(deflate, level, PngIdat, fp);
     for (int y = 0; y < height; y++)
     {
-        for (int h = 0; h < span; h++)
+        if (y % scale == 0)
         {
-            uint8_t v = 0x00;
-            for (int b = 0; b < 8; b++)
+            uint8_t *swap = previous; previous = line; line = swap;
+            QrCodeRowPack(qrcode, y / scale - quiet, quiet, row);
+            ExpandRow(row, modules, scale, !invert, line);
+            unsigned int sumNone = 0, sumUp = 0;
+            for (size_t i = 0; i < lineBytes; i++)
             {
-                int i = (h * 8 + b) / scale;
-                int j = y / scale;
-                bool bit = (i < (2 * quiet + dimension)) ? (QrCodeModuleGet(qrcode, i - quiet, j - quiet) & 1) ^ invert : 0;
-                v |= bit << (7 - b);
+                int8_t up = (int8_t)(line[i] - previous[i]);
+                sumNone += (line[i] < 128) ? line[i] : 256 - line[i];
+                sumUp += (unsigned int)(up < 0 ? -up : up);
             }
-            fprintf(fp, "%c", v);
+            bool filterUp = y > 0 && sumUp < sumNone;
+            filtered[0] = filterUp ? 2 : 0;
+            for (size_t i = 0; i < lineBytes; i++) filtered[1 + i] = filterUp ? (uint8_t)(line[i] - previous[i]) : line[i];
+            DeflateWrite(deflate, filtered, lineBytes + 1);
+        }
+        else
+        {
+            // Repeated row
+            filtered[0] = 2;
+            memset(filtered + 1, 0, lineBytes);
+            DeflateWrite(deflate, filtered, lineBytes + 1);
+        }
+    }
+    DeflateFinish(deflate);
+    PngChunk(fp, "IEND", NULL, 0);
+
+    free(filtered);
+    free(previous);
+    free(line);
+    free(row);
+    free(deflate);
+    return true;
+}
+
+// Runs of set modules in a row: the dark spans, or the gaps between them when inverted (spans has QRCODE_SPANS_MAX(dimension) entries)
+static int RowSetSpans(qrcode_t *qrcode, int y, int dimension, bool invert, qrcode_span_t *spans)
+{
+    int count = QrCodeRowSpans(qrcode, y, spans);
+    if (!invert) return count;
+    // Complement in place (never more gaps before a span than its index)
+    int x = 0, gaps = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int start = spans[i].x, end = spans[i].x + spans[i].length;
+        if (start > x) { spans[gaps].x = x; spans[gaps].length = start - x; gaps++; }
+        x = end;
+    }
+    if (x < dimension) { spans[gaps].x = x; spans[gaps].length = dimension - x; gaps++; }
+    return gaps;
+}
+
+// Finder and alignment patterns drawn as whole rounded parts (centered on the middle module)
+static void SvgFinderPart(FILE *fp, const char *color, double finderRound)
+{
+    fprintf(fp, "<g id=\"fc\"><rect x=\"-3\" y=\"-3\" width=\"6\" height=\"6\" rx=\"%f\" stroke=\"%s\" stroke-width=\"1\" fill=\"none\" /><rect x=\"-1.5\" y=\"-1.5\" width=\"3\" height=\"3\" rx=\"%f\" /></g>\n", 3.0f * finderRound, color, 1.5f * finderRound);
+}
+
+static void SvgAlignmentPart(FILE *fp, const char *color, double alignmentRound)
+{
+    fprintf(fp, "<g id=\"ac\"><rect x=\"-2\" y=\"-2\" width=\"4\" height=\"4\" rx=\"%f\" stroke=\"%s\" stroke-width=\"1\" fill=\"none\" /><rect x=\"-0.5\" y=\"-0.5\" width=\"1\" height=\"1\" rx=\"%f\" /></g>\n", 2.0f * alignmentRound, color, 0.5f * alignmentRound);
+}
+
+// Place the parts at the middle module of each finder/alignment pattern
+static void SvgPartCenters(FILE *fp, const uint8_t *partMap, int dimension, bool finder, bool alignment, bool xlink)
+{
+    for (int y = 0; y < dimension; y++)
+    {
+        for (int x = 0; x < dimension; x++)
+        {
+            uint8_t entry = partMap[y * dimension + x];
+            int index = QRCODE_PART_MAP_INDEX(entry);
+            char* type = NULL;
+            qrcode_part_t part = QRCODE_PART_MAP_PART(entry);
+            if (finder && part == QRCODE_PART_FINDER && index == -1) type = "fc";
+            if (alignment && part == QRCODE_PART_ALIGNMENT && index == -1) type = "ac";
+            if (type == NULL) continue;
+            fprintf(fp, "<use x=\"%d\" y=\"%d\" %shref=\"#%s\" />\n", x, y, xlink ? "xlink:" : "", type);
         }
     }
 }
 
-static void OutputQrCodeImageSvg(qrcode_t* qrcode, FILE *fp, int dimension, int quiet, bool invert, char *color, double moduleSize, double moduleRound, bool finderPart, double finderRound, bool alignmentPart, double alignmentRound)
+static bool OutputQrCodeImageSvg(qrcode_t* qrcode, FILE *fp, int dimension, int quiet, bool invert, char *color, double moduleSize, double moduleRound, bool finderPart, double finderRound, bool alignmentPart, double alignmentRound)
 {
     const bool xlink = true;     // Use "xlink:" prefix on "href" for wider compatibility
     const bool white = false;    // Output an element for every module, not just black/dark ones but white/light ones too.
@@ -247,7 +882,7 @@ static void OutputQrCodeImageSvg(qrcode_t* qrcode, FILE *fp, int dimension, int
         // Hide finder module, use finder part
         fprintf(fp, "<path id=\"f\" d=\"\" visibility=\"hidden\" />\n");
         if (white) fprintf(fp, "<path id=\"fw\" d=\"\" visibility=\"hidden\" />\n");
-        fprintf(fp, "<g id=\"fc\"><rect x=\"-3\" y=\"-3\" width=\"6\" height=\"6\" rx=\"%f\" stroke=\"%s\" stroke-width=\"1\" fill=\"none\" /><rect x=\"-1.5\" y=\"-1.5\" width=\"3\" height=\"3\" rx=\"%f\" /></g>\n", 3.0f * finderRound, color, 1.5f * finderRound);
+        SvgFinderPart(fp, color, finderRound);
     }
     else
     {
@@ -263,7 +898,7 @@ static void OutputQrCodeImageSvg(qrcode_t* qrcode, FILE *fp, int dimension, int
         // Hide alignment module, use alignment part
         fprintf(fp, "<path id=\"a\" d=\"\" visibility=\"hidden\" />\n");
         if (white) fprintf(fp, "<path id=\"aw\" d=\"\" visibility=\"hidden\" />\n");
-        fprintf(fp, "<g id=\"ac\"><rect x=\"-2\" y=\"-2\" width=\"4\" height=\"4\" rx=\"%f\" stroke=\"%s\" stroke-width=\"1\" fill=\"none\" /><rect x=\"-0.5\" y=\"-0.5\" width=\"1\" height=\"1\" rx=\"%f\" /></g>\n", 2.0f * alignmentRound, color, 0.5f * alignmentRound);
+        SvgAlignmentPart(fp, color, alignmentRound);
     }
     else
     {
@@ -275,115 +910,218 @@ static void OutputQrCodeImageSvg(qrcode_t* qrcode, FILE *fp, int dimension, int
 
     fprintf(fp, "</defs>\n");
 
+    const uint8_t *partMap = QrCodePartMap(qrcode->version);
+    qrcode_span_t *spans = (qrcode_span_t *)malloc(QRCODE_SPANS_MAX(dimension) * sizeof(qrcode_span_t));
+    if (spans == NULL) return false;
     for (int y = 0; y < dimension; y++)
     {
-        for (int x = 0; x < dimension; x++)
+        // Alternate between the gaps and the runs of set modules
+        int count = RowSetSpans(qrcode, y, dimension, invert, spans);
+        for (int x = 0, s = 0; x < dimension; )
         {
-            qrcode_part_t part = QrCodeIdentifyModule(qrcode, x, y, NULL);
-            bool bit = ((QrCodeModuleGet(qrcode, x, y) & 1) ^ invert) & 1;
-            char* type = bit ? "b" : "w";
+            bool bit = s < count && x >= spans[s].x;
+            int end = bit ? spans[s].x + spans[s].length : (s < count ? spans[s].x : dimension);
+            if (bit) s++;
+            if (!bit && !white) { x = end; continue; }
+            for (; x < end; x++)
+            {
+                qrcode_part_t part = QRCODE_PART_MAP_PART(partMap[y * dimension + x]);
+                char* type = bit ? "b" : "w";
 
-            // Draw finder/alignment as modules (define to nothing if drawing as whole parts)
-            if (part == QRCODE_PART_FINDER) { type = bit ? "f" : "fw"; }
-            else if (part == QRCODE_PART_ALIGNMENT) { type = bit ? "a" : "aw"; }
+                // Draw finder/alignment as modules (define to nothing if drawing as whole parts)
+                if (part == QRCODE_PART_FINDER) { type = bit ? "f" : "fw"; }
+                else if (part == QRCODE_PART_ALIGNMENT) { type = bit ? "a" : "aw"; }
 
-            if (bit || white) fprintf(fp, "<use x=\"%d\" y=\"%d\" %shref=\"#%s\" />\n", x, y, xlink ? "xlink:" : "", type);
+                fprintf(fp, "<use x=\"%d\" y=\"%d\" %shref=\"#%s\" />\n", x, y, xlink ? "xlink:" : "", type);
+            }
         }
     }
+    free(spans);
 
     // Draw finder/alignment as whole parts (define to nothing if drawing as modules)
+    SvgPartCenters(fp, partMap, dimension, true, true, xlink);
+
+    fprintf(fp, "</svg>\n");
+    return true;
+}
+
+// SVG of the merged horizontal runs of modules as a single stroked path (square, full-size modules only), with the finder/alignment patterns optionally as whole parts
+static bool OutputQrCodeImageSvgPath(qrcode_t* qrcode, FILE *fp, int dimension, int quiet, bool invert, char *color, bool finderPart, double finderRound, bool alignmentPart, double alignmentRound)
+{
+    const bool xlink = true;     // Use "xlink:" prefix on "href" for wider compatibility
+
+    fprintf(fp, "<?xml version=\"1.0\"?>\n");
+    fprintf(fp, "<svg xmlns=\"http://www.w3.org/2000/svg\"%s fill=\"%s\" viewBox=\"-%d.5 -%d.5 %d %d\" shape-rendering=\"crispEdges\">\n", xlink ? " xmlns:xlink=\"http://www.w3.org/1999/xlink\"" : "", color, quiet, quiet, 2 * quiet + dimension, 2 * quiet + dimension);
+    if (finderPart || alignmentPart)
+    {
+        fprintf(fp, "<defs>\n");
+        if (finderPart) SvgFinderPart(fp, color, finderRound);
+        if (alignmentPart) SvgAlignmentPart(fp, color, alignmentRound);
+        fprintf(fp, "</defs>\n");
+    }
+
+    // Each run is a horizontal line through the middle of its modules, one module wide, moved to from the end of the previous run
+    const uint8_t *partMap = QrCodePartMap(qrcode->version);
+    qrcode_span_t *spans = (qrcode_span_t *)malloc(QRCODE_SPANS_MAX(dimension) * sizeof(qrcode_span_t));
+    if (spans == NULL) return false;
+    int lastX = 0, lastY = 0;
+    bool first = true;
+    fprintf(fp, "<path transform=\"translate(-.5 0)\" stroke=\"%s\" stroke-width=\"1\" fill=\"none\" d=\"", color);
     for (int y = 0; y < dimension; y++)
     {
-        for (int x = 0; x < dimension; x++)
+        int count = RowSetSpans(qrcode, y, dimension, invert, spans);
+        for (int s = 0; s < count; s++)
         {
-            int index;
-            char* type = NULL;
-            qrcode_part_t part = QrCodeIdentifyModule(qrcode, x, y, &index);
-            if (part == QRCODE_PART_FINDER && index == -1) type = "fc";
-            if (part == QRCODE_PART_ALIGNMENT && index == -1) type = "ac";
-            if (type == NULL) continue;
-            fprintf(fp, "<use x=\"%d\" y=\"%d\" %shref=\"#%s\" />\n", x, y, xlink ? "xlink:" : "", type);
+            for (int x = spans[s].x, end = spans[s].x + spans[s].length; x < end; )
+            {
+                // Split the run around the patterns drawn as whole parts
+                int start = x;
+                while (x < end)
+                {
+                    qrcode_part_t part = QRCODE_PART_MAP_PART(partMap[y * dimension + x]);
+                    if ((finderPart && part == QRCODE_PART_FINDER) || (alignmentPart && part == QRCODE_PART_ALIGNMENT)) break;
+                    x++;
+                }
+                if (x > start)
+                {
+                    fprintf(fp, "%s%d %dh%d", first ? "M" : "m", start - lastX, y - lastY, x - start);
+                    lastX = x;
+                    lastY = y;
+                    first = false;
+                }
+                if (x < end && x == start) x++;
+            }
         }
     }
+    fprintf(fp, "\" />\n");
+    free(spans);
+
+    if (finderPart || alignmentPart) SvgPartCenters(fp, partMap, dimension, finderPart, alignmentPart, xlink);
 
     fprintf(fp, "</svg>\n");
+    return true;
+}
+
+
+// Buffered sixel output
+typedef struct
+{
+    FILE *fp;
+    size_t length;
+    char data[4096];
+} sixel_output_t;
+
+static void SixelWrite(sixel_output_t *out, const char *text, size_t length)
+{
+    if (out->length + length > sizeof(out->data)) { fwrite(out->data, 1, out->length, out->fp); out->length = 0; }
+    if (length > sizeof(out->data)) { fwrite(text, 1, length, out->fp); return; }
+    memcpy(out->data + out->length, text, length);
+    out->length += length;
 }
 
+static void SixelText(sixel_output_t *out, const char *text) { SixelWrite(out, text, strlen(text)); }
+
+// A six pixel column repeated 'count' times: literally when that is no longer than the repeat introducer ("!<count>")
+static void SixelRun(sixel_output_t *out, int value, int count)
+{
+    char text[16];
+    int length = 0;
+    if (count > 3) length = snprintf(text, sizeof(text), "!%d%c", count, value + 63);
+    else while (length < count) text[length++] = (char)(value + 63);
+    SixelWrite(out, text, (size_t)length);
+}
 
-static void OutputQrCodeSixel(qrcode_t *qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert)
+// Sixel: each band of six pixel rows is filled with black (color 0), unless transparent, then the white pixels (color 1) drawn over it
+// (adjacent identical columns merged into repeats, and trailing empty columns omitted)
+static bool OutputQrCodeSixel(qrcode_t *qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert, bool transparent)
 {
     const int LINE_HEIGHT = 6;
+    int width = dimension + 2 * quiet;
+    int height = width * scale;
+    size_t rowBytes = QRCODE_ROW_BYTES(dimension, quiet);
+    sixel_output_t *out = (sixel_output_t *)malloc(sizeof(sixel_output_t));
+    uint8_t *rows = (uint8_t *)malloc(rowBytes * LINE_HEIGHT);
+    uint8_t *white = (uint8_t *)malloc(width);
+    if (out == NULL || rows == NULL || white == NULL) { free(white); free(rows); free(out); return false; }
+    out->fp = fp;
+    out->length = 0;
     // Enter sixel mode
-    fprintf(fp, "\x1BP7;1q");    // 1:1 ratio, 0 pixels remain at current color
+    SixelText(out, "\x1BP7;1q");   // 1:1 ratio, 0 pixels remain at current color
     // Set color map
-    fprintf(fp, "#0;2;0;0;0");       // Background
-    fprintf(fp, "#1;2;100;100;100");
-    for (int y = -quiet * scale; y < (dimension + quiet) * scale; y += LINE_HEIGHT)
+    SixelText(out, "#0;2;0;0;0");      // Background
+    SixelText(out, "#1;2;100;100;100");
+    for (int y = 0; y < height; y += LINE_HEIGHT)
     {
-        const int passes = 2;
-        for (int pass = 0; pass < passes; pass++)
+        // Packed module row of each pixel row of the strip
+        int lines = height - y < LINE_HEIGHT ? height - y : LINE_HEIGHT;
+        for (int yy = 0; yy < lines; yy++)
         {
-            // Start a pass in a specific color
-            fprintf(fp, "#%d", pass);
-            // Line data
-            for (int x = -quiet * scale; x < (dimension + quiet) * scale; x += scale)
+            QrCodeRowPack(qrcode, (y + yy) / scale - quiet, quiet, rows + yy * rowBytes);
+        }
+        // White pixels of each module column of the strip (the rest of the strip's pixels are black)
+        int mask = (1 << lines) - 1;
+        for (int x = 0; x < width; x++)
+        {
+            int value = 0;
+            for (int yy = 0; yy < lines; yy++)
             {
-                int value = 0;
-                for (int yy = 0; yy < LINE_HEIGHT; yy++) {
-                    int cx = (x < 0 ? x - scale + 1 : x) / scale;
-                    int cy = (y + yy < 0 ? y + yy - scale + 1 : y + yy) / scale;
-//if (x == 0 && pass == 0) printf("y=%d, yy=%d, y+yy=%d, scale=%d, cx=%d cy=%d\n", y, yy, y + yy, scale, cx, cy);
-                    int module = (QrCodeModuleGet(qrcode, cx, cy) & 1) ? 0x00 : 0x01;
-                    if (invert) module = 1 - module;
-                    int bit = (module == pass) ? 1 : 0;
-                    value |= (bit ? 0x01 : 0x00) << yy;
-                }
-                // Six pixels strip at 'scale' (repeated) width
-                if (scale == 1) {
-                    fprintf(fp, "%c", value + 63);
-                } else if (scale == 2) {
-                    fprintf(fp, "%c%c", value + 63, value + 63);
-                } else if (scale == 3) {
-                    fprintf(fp, "%c%c%c", value + 63, value + 63, value + 63);
-                } else if (scale > 3) {
-                    fprintf(fp, "!%d%c", scale, value + 63);
-                }
-            }
-            // Return to start of the line
-            if (pass + 1 < passes) {
-                fprintf(fp, "$");
+                if (!RowModule(rows + yy * rowBytes, x) ^ invert) value |= 1 << yy;
             }
+            white[x] = (uint8_t)value;
         }
-        // Next line
-        if (y + LINE_HEIGHT < (dimension + quiet) * scale) {
-            fprintf(fp, "-");
+        if (!transparent)
+        {
+            // Fill the whole strip in black, then return to start of the line
+            SixelText(out, "#0");
+            SixelRun(out, mask, width * scale);
+            SixelText(out, "$");
+        }
+        // Draw the white pixels over it
+        SixelText(out, "#1");
+        int end = width;
+        while (end > 0 && white[end - 1] == 0) end--;
+        for (int x = 0; x < end; )
+        {
+            int count = 1;
+            while (x + count < end && white[x + count] == white[x]) count++;
+            // Identical six pixel columns at 'scale' (repeated) width
+            SixelRun(out, white[x], count * scale);
+            x += count;
         }
+        // Next line
+        if (y + LINE_HEIGHT < height) SixelText(out, "-");
     }
     // Exit sixel mode
-    fprintf(fp, "\x1B\\");
-    fprintf(fp, "\n");
+    SixelText(out, "\x1B\\");
+    SixelText(out, "\n");
+    fwrite(out->data, 1, out->length, fp);
+    free(white);
+    free(rows);
+    free(out);
+    return true;
 }
 
 
 // TGP - Terminal Graphics Protocol
-static void OutputQrCodeTerminalGraphicsProtocol(qrcode_t *qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert)
+static bool OutputQrCodeTerminalGraphicsProtocol(qrcode_t *qrcode, FILE *fp, int dimension, int quiet, int scale, bool invert)
 {
     bool alpha = false;
     int width = (2 * quiet + dimension) * scale;
     int height = (2 * quiet + dimension) * scale;
 
     // Image buffer
-    size_t imageBufferSize = (size_t)(height * width * (alpha ? 4 : 3));
+    size_t imageBufferSize = (size_t)height * width * (alpha ? 4 : 3);
     unsigned char *imageBuffer = (unsigned char *)malloc(imageBufferSize);
+    uint8_t *row = (uint8_t *)malloc(QRCODE_ROW_BYTES(dimension, quiet));
+    if (imageBuffer == NULL || row == NULL) { free(row); free(imageBuffer); return false; }
     for (int y = 0; y < height; y++)
     {
+        if (y % scale == 0) QrCodeRowPack(qrcode, (y / scale) - quiet, quiet, row);
         for (int x = 0; x < width; x++)
         {
-            int cx = (x / scale) - quiet;
-            int cy = (y / scale) - quiet;
-            int module = QrCodeModuleGet(qrcode, cx, cy) & 1;
+            int module = RowModule(row, x / scale);
             if (invert) module = 1 - module;
-            int ofs = (y * width + x) * (alpha ? 4 : 3);
+            size_t ofs = ((size_t)y * width + x) * (alpha ? 4 : 3);
             imageBuffer[ofs + 0] = module ? 0x00 : 0xff; // R
             imageBuffer[ofs + 1] = module ? 0x00 : 0xff; // G
             imageBuffer[ofs + 2] = module ? 0x00 : 0xff; // B
@@ -393,6 +1131,7 @@ static void OutputQrCodeTerminalGraphicsProtocol(qrcode_t *qrcode, FILE *fp, int
     // Convert to Base64
     size_t base64Size = ((imageBufferSize + 2) / 3) * 4;
     char *base64Buffer = (char *)malloc(base64Size + 1);
+    if (base64Buffer == NULL) { free(row); free(imageBuffer); return false; }
     // Manually encode to Base64
     const char *base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     for (size_t i = 0; i < imageBufferSize; i += 3)
@@ -409,7 +1148,7 @@ static void OutputQrCodeTerminalGraphicsProtocol(qrcode_t *qrcode, FILE *fp, int
     int MAX_CHUNK_SIZE = 4096;
     char initialControls[256];
     for (size_t i = 0; i < base64Size; i += MAX_CHUNK_SIZE) {
-        int chunkSize = (i + MAX_CHUNK_SIZE < base64Size) ? MAX_CHUNK_SIZE : (base64Size - i);
+        int chunkSize = (int)((i + MAX_CHUNK_SIZE < base64Size) ? (size_t)MAX_CHUNK_SIZE : (base64Size - i));
         char *chunk = base64Buffer + i;
         if (i == 0) {
             // action transmit and display (a=T), direct transfer (t=d), uncompressed (o=), 3/4 bytes per pixel (f=24/32 bits per pixel), no responses at all (q=2)
@@ -423,76 +1162,1076 @@ static void OutputQrCodeTerminalGraphicsProtocol(qrcode_t *qrcode, FILE *fp, int
     fprintf(fp, "\n");
 
     // Clear up buffers
+    free(row);
     free(base64Buffer);
     free(imageBuffer);
 
-    return;
+    return true;
 }
 
 
-int main(int argc, char *argv[])
+// Rendering options
+typedef struct
 {
-    FILE *ofp = stdout;
-    const char *value = NULL;
-    bool help = false;
-    bool invert = false;
-    int quiet = QRCODE_QUIET_STANDARD;
-    bool mayUppercase = false;
-    output_mode_t outputMode = OUTPUT_TEXT;
-    const text_render_t *textRender = &textRenderMedium;
-    qrcode_error_correction_level_t errorCorrectionLevel = QRCODE_ECL_M;
-    qrcode_mask_pattern_t maskPattern = QRCODE_MASK_AUTO;
-    int version = QRCODE_VERSION_AUTO;
-    bool optimizeEcc = true;
-    int scale = 4;
+    output_mode_t outputMode;
+    const text_render_t *textRender;
+    int quiet;
+    bool invert;
+    int scale;
+    int pngLevel;
+    bool sixelTransparent;      // Only draw the white pixels of sixel output, over the existing background
     // SVG details
-    char *color = "currentColor";
-    double moduleSize = 1.0f;
-    double moduleRound = 0.0f;
-    bool finderPart = false;
-    double finderRound = 0.0f;
-    bool alignmentPart = false;
-    double alignmentRound = 0.0f;
+    bool svgPath;               // Single path of merged runs (when full-size square modules), otherwise an element per module
+    char *color;
+    double moduleSize;
+    double moduleRound;
+    bool finderPart;
+    double finderRound;
+    bool alignmentPart;
+    double alignmentRound;
+} output_options_t;
 
-    
-    for (int i = 1; i < argc; i++)
+// Write the code in the chosen format, returns false if out of memory
+static bool OutputQrCode(qrcode_t *qrcode, FILE *fp, int dimension, const output_options_t *options)
+{
+    output_options_t clamped = *options;
+    if (clamped.quiet < 0) clamped.quiet = 0;   // The packed rows always include the whole code
+    if (clamped.scale < 1) clamped.scale = 1;   // An image of at least one pixel per module
+    const output_options_t *o = &clamped;
+    switch (o->outputMode)
     {
-        if (!strcmp(argv[i], "--help")) { help = true; }
-        else if (!strcmp(argv[i], "--ecl:l")) { errorCorrectionLevel = QRCODE_ECL_L; }
-        else if (!strcmp(argv[i], "--ecl:m")) { errorCorrectionLevel = QRCODE_ECL_M; }
-        else if (!strcmp(argv[i], "--ecl:q")) { errorCorrectionLevel = QRCODE_ECL_Q; }
-        else if (!strcmp(argv[i], "--ecl:h")) { errorCorrectionLevel = QRCODE_ECL_H; }
-        else if (!strcmp(argv[i], "--fixecl")) { optimizeEcc = false; }
-        else if (!strcmp(argv[i], "--version")) { version = atoi(argv[++i]); }
+        case OUTPUT_TEXT: return OutputQrCodeText(qrcode, fp, dimension, o->textRender, o->quiet, o->invert);
+        case OUTPUT_BITMAP: return OutputQrCodeImageBitmap(qrcode, fp, dimension, o->quiet, o->scale, o->invert);
+        case OUTPUT_PNG: return OutputQrCodeImagePng(qrcode, fp, dimension, o->quiet, o->scale, o->invert, o->pngLevel);
+        case OUTPUT_SVG:
+            if (o->svgPath && o->moduleSize == 1.0 && o->moduleRound == 0.0) return OutputQrCodeImageSvgPath(qrcode, fp, dimension, o->quiet, o->invert, o->color, o->finderPart, o->finderRound, o->alignmentPart, o->alignmentRound);
+            return OutputQrCodeImageSvg(qrcode, fp, dimension, o->quiet, o->invert, o->color, o->moduleSize, o->moduleRound, o->finderPart, o->finderRound, o->alignmentPart, o->alignmentRound);
+        case OUTPUT_SIXEL: return OutputQrCodeSixel(qrcode, fp, dimension, o->quiet, o->scale, o->invert, o->sixelTransparent);
+        case OUTPUT_TGP: return OutputQrCodeTerminalGraphicsProtocol(qrcode, fp, dimension, o->quiet, o->scale, o->invert);
+        default: fprintf(fp, "<error>"); return true;
+    }
+}
+
+// Open the output file (stdout if none), numbering it "<name>-<number><.ext>" when number > 0
+static FILE *OpenOutput(const char *filename, int number)
+{
+    if (filename == NULL) return stdout;
+    char numbered[1024];
+    if (number > 0)
+    {
+        const char *ext = strrchr(filename, '.');
+        const char *sep = strrchr(filename, '/');
+        if (ext == NULL || (sep != NULL && ext < sep)) ext = filename + strlen(filename);
+        snprintf(numbered, sizeof(numbered), "%.*s-%d%s", (int)(ext - filename), filename, number, ext);
+        filename = numbered;
+    }
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) fprintf(stderr, "ERROR: Unable to open output filename: %s\n", filename);
+    return fp;
+}
+
+// Output format by name (as for --output:<name>)
+static bool ParseOutputFormat(const char *name, output_options_t *o)
+{
+    static const struct { const char *name; output_mode_t outputMode; const text_render_t *textRender; } formats[] = {
+        { "ascii", OUTPUT_TEXT, &textRenderAscii },
+        { "large", OUTPUT_TEXT, &textRenderLarge },
+        { "narrow", OUTPUT_TEXT, &textRenderNarrow },
+        { "medium", OUTPUT_TEXT, &textRenderMedium },
+        { "compact", OUTPUT_TEXT, &textRenderCompact },
+        { "tiny", OUTPUT_TEXT, &textRenderTiny },
+        { "dots", OUTPUT_TEXT, &textRenderDots },
+        { "dots6", OUTPUT_TEXT, &textRenderDots6 },
+        { "bmp", OUTPUT_BITMAP, NULL },
+        { "png", OUTPUT_PNG, NULL },
+        { "svg", OUTPUT_SVG, NULL },
+        { "sixel", OUTPUT_SIXEL, NULL },
+        { "tgp", OUTPUT_TGP, NULL },
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        if (strcmp(name, formats[i].name)) continue;
+        o->outputMode = formats[i].outputMode;
+        if (formats[i].textRender != NULL) o->textRender = formats[i].textRender;
+        return true;
+    }
+    return false;
+}
+
+// Error correction level by name (l|m|q|h)
+static bool ParseErrorCorrectionLevel(const char *name, qrcode_error_correction_level_t *errorCorrectionLevel)
+{
+    if (name[0] == '\0' || name[1] != '\0') return false;
+    switch (name[0] | 0x20)
+    {
+        case 'l': *errorCorrectionLevel = QRCODE_ECL_L; return true;
+        case 'm': *errorCorrectionLevel = QRCODE_ECL_M; return true;
+        case 'q': *errorCorrectionLevel = QRCODE_ECL_Q; return true;
+        case 'h': *errorCorrectionLevel = QRCODE_ECL_H; return true;
+        default: return false;
+    }
+}
+
+// File extension for the output format
+static const char *OutputExtension(const output_options_t *o)
+{
+    switch (o->outputMode)
+    {
+        case OUTPUT_BITMAP: return "bmp";
+        case OUTPUT_PNG: return "png";
+        case OUTPUT_SVG: return "svg";
+        case OUTPUT_SIXEL: return "six";
+        case OUTPUT_TGP: return "tgp";
+        default: return "txt";
+    }
+}
+
+// Expand an output filename template: {n} item number (from 1), {data} filename-safe start of the payload, {ext} extension for the format, {{ and }} literal braces
+static bool FormatFilename(char *out, size_t size, const char *template, size_t number, const char *data, const output_options_t *o)
+{
+    size_t len = 0;
+    for (const char *p = template; *p != '\0'; )
+    {
+        char expansion[96];
+        const char *text = expansion;
+        if (!strncmp(p, "{n}", 3)) { snprintf(expansion, sizeof(expansion), "%lu", (unsigned long)number); p += 3; }
+        else if (!strncmp(p, "{ext}", 5)) { text = OutputExtension(o); p += 5; }
+        else if (!strncmp(p, "{data}", 6))
+        {
+            // Skip any URL scheme, then replace anything other than [A-Za-z0-9-] with '_'
+            const char *d = strstr(data, "://");
+            d = (d != NULL) ? d + 3 : data;
+            size_t i;
+            for (i = 0; d[i] != '\0' && i < 64; i++)
+            {
+                char c = d[i];
+                expansion[i] = ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-') ? c : '_';
+            }
+            expansion[i] = '\0';
+            p += 6;
+        }
+        else if (!strncmp(p, "{{", 2) || !strncmp(p, "}}", 2)) { expansion[0] = *p; expansion[1] = '\0'; p += 2; }
+        else { expansion[0] = *p++; expansion[1] = '\0'; }
+        size_t n = strlen(text);
+        if (len + n >= size) return false;
+        memcpy(out + len, text, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return true;
+}
+
+// Read a whole line (without the line ending) into a growing buffer, returns false at end of input
+static bool ReadLine(FILE *fp, char **line, size_t *capacity)
+{
+    size_t len = 0;
+    int c;
+    while ((c = fgetc(fp)) != EOF && c != '\n')
+    {
+        if (len + 2 > *capacity)
+        {
+            size_t newCapacity = *capacity ? *capacity * 2 : 256;
+            char *newLine = realloc(*line, newCapacity);
+            if (newLine == NULL) return false;
+            *line = newLine;
+            *capacity = newCapacity;
+        }
+        (*line)[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) return false;
+    if (len > 0 && (*line)[len - 1] == '\r') len--;
+    if (*line == NULL) { *line = malloc(1); *capacity = 1; if (*line == NULL) return false; }
+    (*line)[len] = '\0';
+    return true;
+}
+
+// Value of a hex digit (-1=not hex)
+static int HexDigit(char c)
+{
+    return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+// Four hex digits of a JSON \u escape
+static bool JsonHex4(const char *p, unsigned long *value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int digit = HexDigit(p[i]);
+        if (digit < 0) return false;    // (also stops at the terminator)
+        *value = (*value << 4) | (unsigned long)digit;
+    }
+    return true;
+}
+
+// Decode a JSON string value in place (at the opening quote), returns the character after the closing quote (NULL=invalid)
+static char *JsonString(char *p, char **value, size_t *length)
+{
+    char *out = ++p;
+    *value = out;
+    while (*p != '"')
+    {
+        if (*p == '\0') return NULL;
+        if (*p != '\\') { *out++ = *p++; continue; }
+        p++;
+        switch (*p++)
+        {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u':
+            {
+                unsigned long cp, low;
+                if (!JsonHex4(p, &cp)) return NULL;
+                p += 4;
+                // Surrogate pair
+                if (cp >= 0xD800 && cp <= 0xDBFF && p[0] == '\\' && p[1] == 'u' && JsonHex4(p + 2, &low) && low >= 0xDC00 && low <= 0xDFFF)
+                {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                // Encode as UTF-8 (never longer than the escape)
+                if (cp < 0x80) { *out++ = (char)cp; }
+                else if (cp < 0x800) { *out++ = (char)(0xC0 | (cp >> 6)); *out++ = (char)(0x80 | (cp & 0x3F)); }
+                else if (cp < 0x10000) { *out++ = (char)(0xE0 | (cp >> 12)); *out++ = (char)(0x80 | ((cp >> 6) & 0x3F)); *out++ = (char)(0x80 | (cp & 0x3F)); }
+                else { *out++ = (char)(0xF0 | (cp >> 18)); *out++ = (char)(0x80 | ((cp >> 12) & 0x3F)); *out++ = (char)(0x80 | ((cp >> 6) & 0x3F)); *out++ = (char)(0x80 | (cp & 0x3F)); }
+                break;
+            }
+            default: return NULL;
+        }
+    }
+    *out = '\0';
+    if (length != NULL) *length = (size_t)(out - *value);
+    return p + 1;
+}
+
+#ifdef QRCODE_STATS
+// Generation statistics as a JSON line
+static void PrintStats(const qrcode_stats_t *stats)
+{
+    static const char *stages[QRCODE_STAGE_COUNT] = { "prepare", "segments", "padding", "ecc", "placement", "mask_selection", "finish" };
+    static const char eclNames[] = "MLHQ";  // (by value)
+    fprintf(stderr, "{\"total_ns\":%lu", (unsigned long)stats->totalNs);
+    for (int i = 0; i < QRCODE_STAGE_COUNT; i++) fprintf(stderr, ",\"%s_ns\":%lu", stages[i], (unsigned long)stats->stageNs[i]);
+    fprintf(stderr, ",\"cursor_steps\":%u,\"placement_steps\":%u,\"mask_penalty\":[", (unsigned int)stats->cursorSteps, (unsigned int)stats->placementSteps);
+    for (int i = 0; i < 8; i++) fprintf(stderr, "%s%d", i ? "," : "", stats->maskPenalty[i]);
+    fprintf(stderr, "],\"version\":%d,\"mask\":%d,\"ecl\":\"%c\",\"requested_ecl\":\"%c\",\"ecl_upgraded\":%s,\"cached\":%s}\n",
+        stats->version, (int)stats->maskPattern, eclNames[stats->errorCorrectionLevel & 3], eclNames[stats->requestedErrorCorrectionLevel & 3],
+        stats->eclUpgraded ? "true" : "false", stats->cached ? "true" : "false");
+}
+#endif
+
+// Cache of generated codes shared by the batch or server workers (entries <= 0 or out of memory: none)
+static qrcode_cache_t *CreateCache(qrcode_cache_t *cache, int entries, int maxVersion)
+{
+    if (entries <= 0) return NULL;
+    size_t memorySize = QrCodeCacheMemorySize(entries, maxVersion);
+    void *memory = malloc(memorySize);
+    if (memory == NULL || !QrCodeCacheInit(cache, memory, memorySize, entries, maxVersion))
+    {
+        fprintf(stderr, "WARNING: Unable to create a cache of %d entries.\n", entries);
+        free(memory);
+        return NULL;
+    }
+    return cache;
+}
+
+static void PrintCacheStats(qrcode_cache_t *cache)
+{
+    if (cache == NULL) return;
+    uint64_t hits = 0, misses = 0;
+    QrCodeCacheStats(cache, &hits, &misses);
+    fprintf(stderr, "Cache: %lu hits, %lu misses\n", (unsigned long)hits, (unsigned long)misses);
+}
+
+// One batch item: the payload and how to output it
+typedef struct
+{
+    char *line;                 // Owned input line (the values below point into it)
+    size_t lineCapacity;
+    const char *data;
+    size_t dataLength;
+    const char *path;           // Output filename template (NULL=--file template or stdout)
+    qrcode_error_correction_level_t errorCorrectionLevel;
+    output_options_t options;
+    int lineNumber;
+} batch_record_t;
+
+// Parse a manifest record as a flat JSON object: {"data": "...", "path": "...", "format": "svg", "ecl": "m", "scale": 4, "quiet": 4, "invert": false}
+static bool ParseBatchJson(batch_record_t *record)
+{
+    char *p = record->line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p++ != '{') return false;
+    record->data = NULL;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '}') break;
+        char *key, *text;
+        if (*p != '"' || (p = JsonString(p, &key, NULL)) == NULL) return false;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p++ != ':') return false;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '"')
+        {
+            size_t length;
+            char *end = JsonString(p, &text, &length);
+            if (end == NULL) return false;
+            if (!strcmp(key, "data")) { record->data = text; record->dataLength = length; }
+            else if (!strcmp(key, "path")) { record->path = text; }
+            else if (!strcmp(key, "format") && !ParseOutputFormat(text, &record->options)) return false;
+            else if (!strcmp(key, "ecl") && !ParseErrorCorrectionLevel(text, &record->errorCorrectionLevel)) return false;
+            p = end;
+        }
+        else
+        {
+            // Number or literal
+            char *value = p;
+            while (*p != '\0' && *p != ',' && *p != '}' && *p != ' ' && *p != '\t') p++;
+            char saved = *p;
+            *p = '\0';
+            bool valid = true;  // Same ranges as the server
+            if (!strcmp(key, "scale")) { record->options.scale = atoi(value); valid = (record->options.scale >= 1 && record->options.scale <= 64); }
+            else if (!strcmp(key, "quiet")) { record->options.quiet = atoi(value); valid = (record->options.quiet >= 0 && record->options.quiet <= 64); }
+            else if (!strcmp(key, "invert")) record->options.invert = !strcmp(value, "true");
+            *p = saved;
+            if (!valid) return false;
+        }
+    }
+    return record->data != NULL;
+}
+
+#define BATCH_CHUNK 1024    // Records read, generated, then written at a time
+
+// Open a record's output: a per-record template, else the --file template (numbered "<name>-<n><.ext>" if it has no fields), else stdout
+static FILE *OpenBatchOutput(const batch_record_t *record, const char *filename, size_t number)
+{
+    const char *template = (record->path != NULL) ? record->path : filename;
+    if (template == NULL) return stdout;
+    if (record->path == NULL && strchr(template, '{') == NULL) return OpenOutput(template, (int)number);
+    char expanded[1024];
+    if (!FormatFilename(expanded, sizeof(expanded), template, number, record->data, &record->options))
+    {
+        fprintf(stderr, "ERROR: Output filename too long on line %d.\n", record->lineNumber);
+        return NULL;
+    }
+    return OpenOutput(expanded, 0);
+}
+
+// Generate consecutive records with the same generation options together
+static void GenerateBatchChunk(batch_record_t *records, qrcode_batch_item_t *items, size_t count, const qrcode_batch_options_t *batchOptions, uint8_t *scratchBuffer)
+{
+    for (size_t start = 0, end; start < count; start = end)
+    {
+        for (end = start + 1; end < count && records[end].errorCorrectionLevel == records[start].errorCorrectionLevel; end++) { ; }
+        qrcode_batch_options_t options = *batchOptions;
+        options.errorCorrectionLevel = records[start].errorCorrectionLevel;
+        QrCodeGenerateBatch(items + start, end - start, &options, NULL, 0, scratchBuffer);
+    }
+}
+
+// Generate a code for every line of input: either the payload itself, or a JSON object (see ParseBatchJson()); returns the number of failures
+static int RunBatch(FILE *ifp, bool json, const char *filename, const output_options_t *defaults, const qrcode_batch_options_t *batchOptions)
+{
+    size_t bufferSize = QRCODE_BUFFER_SIZE(batchOptions->maxVersion);
+    batch_record_t *records = calloc(BATCH_CHUNK, sizeof(batch_record_t));
+    qrcode_batch_item_t *items = calloc(BATCH_CHUNK, sizeof(qrcode_batch_item_t));
+    uint8_t *buffers = malloc(bufferSize * BATCH_CHUNK);
+    uint8_t *scratchBuffer = malloc(QRCODE_SCRATCH_BUFFER_SIZE(batchOptions->maxVersion) * (batchOptions->threads > 1 ? batchOptions->threads : 1));
+    if (records == NULL || items == NULL || buffers == NULL || scratchBuffer == NULL)
+    {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+
+    int failures = 0;
+    int lineNumber = 0;
+    size_t number = 0;
+    for (bool more = true; more; )
+    {
+        // Read the next chunk of records
+        size_t count = 0;
+        while (count < BATCH_CHUNK)
+        {
+            batch_record_t *record = &records[count];
+            if (!ReadLine(ifp, &record->line, &record->lineCapacity)) { more = false; break; }
+            lineNumber++;
+            if (record->line[0] == '\0') continue;
+            record->lineNumber = lineNumber;
+            record->path = NULL;
+            record->errorCorrectionLevel = batchOptions->errorCorrectionLevel;
+            record->options = *defaults;
+            if (!json)
+            {
+                record->data = record->line;
+                record->dataLength = strlen(record->line);
+            }
+            else if (!ParseBatchJson(record))
+            {
+                fprintf(stderr, "ERROR: Invalid record on line %d.\n", lineNumber);
+                failures++;
+                continue;
+            }
+            items[count].text = record->data;
+            items[count].charCount = record->dataLength;
+            items[count].buffer = buffers + count * bufferSize;
+            count++;
+        }
+
+        GenerateBatchChunk(records, items, count, batchOptions, scratchBuffer);
+
+        // Write in input order
+        for (size_t i = 0; i < count; i++)
+        {
+            number++;
+            if (items[i].qrcode.dimension <= 0)
+            {
+                fprintf(stderr, "ERROR: Could not generate QR Code (too much data) on line %d.\n", records[i].lineNumber);
+                failures++;
+                continue;
+            }
+            FILE *ofp = OpenBatchOutput(&records[i], filename, number);
+            if (ofp == NULL) { failures++; continue; }
+            if (!OutputQrCode(&items[i].qrcode, ofp, items[i].qrcode.dimension, &records[i].options))
+            {
+                fprintf(stderr, "ERROR: Out of memory writing the QR Code on line %d.\n", records[i].lineNumber);
+                failures++;
+            }
+            if (ofp != stdout) fclose(ofp);
+        }
+    }
+
+    for (size_t i = 0; i < BATCH_CHUNK; i++) free(records[i].line);
+    free(scratchBuffer);
+    free(buffers);
+    free(items);
+    free(records);
+    return failures;
+}
+
+#ifdef SERVE_SUPPORTED
+// --- HTTP server (--serve) and load generator (--load) ---
+
+// Log-linear latency histogram in microseconds: exact below 256, then 128 buckets per power of two (<1% error)
+#define LATENCY_LINEAR 256
+#define LATENCY_BUCKETS (LATENCY_LINEAR + 56 * 128)
+
+typedef struct
+{
+    uint64_t counts[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+static int LatencyBucket(uint64_t us)
+{
+    if (us < LATENCY_LINEAR) return (int)us;
+    int shift = 63 - __builtin_clzll(us) - 7;
+    return LATENCY_LINEAR + (shift - 1) * 128 + (int)((us >> shift) - 128);
+}
+
+static uint64_t LatencyBucketValue(int bucket)
+{
+    if (bucket < LATENCY_LINEAR) return (uint64_t)bucket;
+    int shift = (bucket - LATENCY_LINEAR) / 128 + 1;
+    return (uint64_t)((bucket - LATENCY_LINEAR) % 128 + 128) << shift;
+}
+
+static void LatencyRecord(latency_histogram_t *histogram, uint64_t us)
+{
+    __atomic_fetch_add(&histogram->counts[LatencyBucket(us)], 1, __ATOMIC_RELAXED);
+}
+
+// Value at the given fraction (0-1) of recorded latencies
+static uint64_t LatencyPercentile(const latency_histogram_t *histogram, double fraction)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) total += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(fraction * (double)(total - 1)) + 1, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) return LatencyBucketValue(i);
+    }
+    return LatencyBucketValue(LATENCY_BUCKETS - 1);
+}
+
+static uint64_t NowMicroseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Split "host:port" (host may be empty for all interfaces)
+static struct addrinfo *ResolveAddress(const char *address, bool passive)
+{
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) return NULL;
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    struct addrinfo hints = { 0 }, *result = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &result) != 0) return NULL;
+    return result;
+}
+
+// Send all of the header and body (the sockets are non-blocking)
+static bool SendAll(int fd, const char *header, size_t headerLength, const char *body, size_t bodyLength)
+{
+    struct iovec iov[2] = { { (void *)header, headerLength }, { (void *)body, bodyLength } };
+    int first = 0;
+    while (first < 2)
+    {
+        struct msghdr msg = { 0 };
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = 2 - first;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, 5000) <= 0) return false;
+            continue;
+        }
+        for (; first < 2 && (size_t)sent >= iov[first].iov_len; first++) sent -= iov[first].iov_len;
+        if (first < 2) { iov[first].iov_base = (char *)iov[first].iov_base + sent; iov[first].iov_len -= sent; }
+    }
+    return true;
+}
+
+#define SERVE_REQUEST_MAX 65536     // Largest request header accepted
+#define SERVE_IMAGE_MAX 4096        // Largest bitmap/PNG width and height served, in pixels
+#define SERVE_EVENTS 64             // Events taken per wait
+
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    uint64_t arrival;           // Time the pending request bytes arrived
+} serve_connection_t;
+
+typedef struct
+{
+    int listenFd;
+    qrcode_error_correction_level_t errorCorrectionLevel;
+    qrcode_mask_pattern_t maskPattern;
+    bool optimizeEcc;
+    int maskThreads;
+    bool mayUppercase;
+    bool eciUtf8;
+    output_options_t defaults;
+    qrcode_cache_t *cache;      // Generated codes (NULL=none)
+    uint64_t requests;
+    uint64_t errors;
+    latency_histogram_t latency;
+} serve_t;
+
+static int serveStop = 0;
+
+static void ServeSignal(int signal)
+{
+    int savedErrno = errno;
+    (void)signal;
+    __atomic_store_n(&serveStop, 1, __ATOMIC_RELAXED);
+    errno = savedErrno;
+}
+
+// Decode %XX and '+' in place, returns the decoded length
+static size_t UrlDecode(char *text)
+{
+    char *out = text;
+    for (char *p = text; *p != '\0'; p++)
+    {
+        if (*p == '+') { *out++ = ' '; }
+        else if (*p == '%' && HexDigit(p[1]) >= 0 && HexDigit(p[2]) >= 0) { *out++ = (char)(HexDigit(p[1]) << 4 | HexDigit(p[2])); p += 2; }
+        else { *out++ = *p; }
+    }
+    *out = '\0';
+    return (size_t)(out - text);
+}
+
+static const char *ContentType(const output_options_t *options)
+{
+    switch (options->outputMode)
+    {
+        case OUTPUT_BITMAP: return "image/bmp";
+        case OUTPUT_PNG: return "image/png";
+        case OUTPUT_SVG: return "image/svg+xml";
+        default: return "text/plain; charset=utf-8";
+    }
+}
+
+static bool ServeRespond(int fd, int status, const char *reason, const char *contentType, const char *body, size_t bodyLength, bool keepAlive)
+{
+    char header[256];
+    int headerLength = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n", status, reason, contentType, (unsigned long)bodyLength, keepAlive ? "keep-alive" : "close");
+    return SendAll(fd, header, (size_t)headerLength, body, bodyLength);
+}
+
+static bool ServeError(serve_t *server, int fd, int status, const char *reason, bool keepAlive)
+{
+    __atomic_fetch_add(&server->errors, 1, __ATOMIC_RELAXED);
+    char body[128];
+    int length = snprintf(body, sizeof(body), "%d %s\n", status, reason);
+    return ServeRespond(fd, status, reason, "text/plain; charset=utf-8", body, (size_t)length, keepAlive) && keepAlive;
+}
+
+// Handle one request header (null-terminated, modified in place), returns whether the connection stays open
+static bool ServeRequest(serve_t *server, int fd, char *request, uint8_t *buffer, uint8_t *scratchBuffer)
+{
+    // Request line
+    char *method = request;
+    char *target = strchr(method, ' ');
+    if (target == NULL) return ServeError(server, fd, 400, "Bad Request", false);
+    *target++ = '\0';
+    char *protocol = strchr(target, ' ');
+    if (protocol == NULL) return ServeError(server, fd, 400, "Bad Request", false);
+    *protocol++ = '\0';
+    char *headers = strstr(protocol, "\r\n");
+    if (headers != NULL) { *headers = '\0'; headers += 2; } else headers = "";
+
+    // Connections persist by default from HTTP/1.1
+    bool keepAlive = strcmp(protocol, "HTTP/1.0") != 0;
+    for (char *line = headers; *line != '\0'; )
+    {
+        char *next = strstr(line, "\r\n");
+        if (next != NULL) *next = '\0';
+        if (!strncasecmp(line, "Connection:", 11))
+        {
+            if (strcasestr(line + 11, "close")) keepAlive = false;
+            else if (strcasestr(line + 11, "keep-alive")) keepAlive = true;
+        }
+        else if (!strncasecmp(line, "Content-Length:", 15) && atol(line + 15) != 0) return ServeError(server, fd, 413, "Payload Too Large", false);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18)) return ServeError(server, fd, 501, "Not Implemented", false);
+        if (next == NULL) break;
+        line = next + 2;
+    }
+
+    if (strcmp(method, "GET")) return ServeError(server, fd, 405, "Method Not Allowed", keepAlive);
+
+    char *query = strchr(target, '?');
+    if (query != NULL) *query++ = '\0'; else query = "";
+
+    // Server statistics
+    if (!strcmp(target, "/stats"))
+    {
+        char body[256];
+        uint64_t hits = 0, misses = 0;
+        if (server->cache != NULL) QrCodeCacheStats(server->cache, &hits, &misses);
+        int length = snprintf(body, sizeof(body), "{\"requests\":%lu,\"errors\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"cache_hits\":%lu,\"cache_misses\":%lu}\n",
+            (unsigned long)__atomic_load_n(&server->requests, __ATOMIC_RELAXED), (unsigned long)__atomic_load_n(&server->errors, __ATOMIC_RELAXED),
+            (unsigned long)LatencyPercentile(&server->latency, 0.50), (unsigned long)LatencyPercentile(&server->latency, 0.99), (unsigned long)hits, (unsigned long)misses);
+        return ServeRespond(fd, 200, "OK", "application/json", body, (size_t)length, keepAlive) && keepAlive;
+    }
+    if (strcmp(target, "/qr")) return ServeError(server, fd, 404, "Not Found", keepAlive);
+
+    // Parameters: data, fmt, ecl, scale, quiet, invert
+    output_options_t options = server->defaults;
+    qrcode_error_correction_level_t errorCorrectionLevel = server->errorCorrectionLevel;
+    const char *data = NULL;
+    size_t dataLength = 0;
+    for (char *param = query; param != NULL && *param != '\0'; )
+    {
+        char *next = strchr(param, '&');
+        if (next != NULL) *next++ = '\0';
+        char *value = strchr(param, '=');
+        if (value != NULL) *value++ = '\0'; else value = "";
+        size_t valueLength = UrlDecode(value);
+        if (!strcmp(param, "data")) { data = value; dataLength = valueLength; }
+        else if (!strcmp(param, "fmt") && !ParseOutputFormat(value, &options)) return ServeError(server, fd, 400, "Bad Request", keepAlive);
+        else if (!strcmp(param, "ecl") && !ParseErrorCorrectionLevel(value, &errorCorrectionLevel)) return ServeError(server, fd, 400, "Bad Request", keepAlive);
+        else if (!strcmp(param, "scale")) { options.scale = atoi(value); if (options.scale < 1 || options.scale > 64) return ServeError(server, fd, 400, "Bad Request", keepAlive); }
+        else if (!strcmp(param, "quiet")) { options.quiet = atoi(value); if (options.quiet < 0 || options.quiet > 64) return ServeError(server, fd, 400, "Bad Request", keepAlive); }
+        else if (!strcmp(param, "invert")) { options.invert = !strcmp(value, "1") || !strcmp(value, "true"); }
+        param = next;
+    }
+    if (data == NULL) return ServeError(server, fd, 400, "Bad Request", keepAlive);
+    bool image = (options.outputMode == OUTPUT_BITMAP || options.outputMode == OUTPUT_PNG);
+    if (!image && options.outputMode != OUTPUT_SVG && options.outputMode != OUTPUT_TEXT) return ServeError(server, fd, 400, "Bad Request", keepAlive);  // Only the formats with a content type
+
+    // Generate into this worker's buffers
+    qrcode_t qrcode;
+    qrcode_segment_t segments[64];
+    QrCodeInit(&qrcode, QRCODE_VERSION_MAX, errorCorrectionLevel);
+    qrcode.maskPattern = server->maskPattern;
+    qrcode.optimizeEcc = server->optimizeEcc;
+    qrcode.maskThreads = server->maskThreads;
+    QrCodeSegmentAppendOptimal(&qrcode, segments, sizeof(segments) / sizeof(segments[0]), data, dataLength, server->mayUppercase, server->eciUtf8);
+    if (!QrCodeGenerateCached(server->cache, &qrcode, buffer, scratchBuffer)) return ServeError(server, fd, 413, "Payload Too Large", keepAlive);
+    if (image && (qrcode.dimension + 2 * options.quiet) * options.scale > SERVE_IMAGE_MAX) return ServeError(server, fd, 413, "Payload Too Large", keepAlive);
+
+    // Render straight into memory (bitmaps), or with the usual output
+    char *body = NULL;
+    size_t bodyLength = 0;
+    if (options.outputMode == OUTPUT_BITMAP)
+    {
+        bodyLength = BitmapSize(qrcode.dimension, options.quiet, options.scale);
+        body = (char *)malloc(bodyLength);
+        if (body == NULL) return ServeError(server, fd, 500, "Internal Server Error", false);
+        if (!RenderQrCodeBitmap(&qrcode, (uint8_t *)body, qrcode.dimension, options.quiet, options.scale, options.invert)) { free(body); return ServeError(server, fd, 500, "Internal Server Error", false); }
+    }
+    else
+    {
+        FILE *fp = open_memstream(&body, &bodyLength);
+        if (fp == NULL) return ServeError(server, fd, 500, "Internal Server Error", false);
+        bool written = OutputQrCode(&qrcode, fp, qrcode.dimension, &options);
+        if (fclose(fp) != 0 || !written) { free(body); return ServeError(server, fd, 500, "Internal Server Error", false); }
+    }
+    bool result = ServeRespond(fd, 200, "OK", ContentType(&options), body, bodyLength, keepAlive);
+    free(body);
+    return result && keepAlive;
+}
+
+// Read what has arrived and answer each complete request, returns whether the connection stays open
+static bool ServeConnection(serve_t *server, serve_connection_t *connection, uint8_t *buffer, uint8_t *scratchBuffer)
+{
+    for (;;)
+    {
+        if (connection->capacity - connection->length < 4096)
+        {
+            if (connection->capacity >= SERVE_REQUEST_MAX + 4096) return ServeError(server, connection->fd, 431, "Request Header Fields Too Large", false);
+            size_t capacity = connection->capacity ? connection->capacity * 2 : 8192;
+            char *newBuffer = realloc(connection->buffer, capacity);
+            if (newBuffer == NULL) return false;
+            connection->buffer = newBuffer;
+            connection->capacity = capacity;
+        }
+        ssize_t received = recv(connection->fd, connection->buffer + connection->length, connection->capacity - connection->length - 1, 0);
+        if (received == 0) return false;
+        if (received < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        if (connection->length == 0) connection->arrival = NowMicroseconds();
+        connection->length += (size_t)received;
+    }
+    connection->buffer[connection->length] = '\0';
+
+    // Each complete (possibly pipelined) request
+    char *end;
+    while ((end = strstr(connection->buffer, "\r\n\r\n")) != NULL)
+    {
+        *end = '\0';
+        size_t consumed = (size_t)(end + 4 - connection->buffer);
+        bool keepAlive = ServeRequest(server, connection->fd, connection->buffer, buffer, scratchBuffer);
+        __atomic_fetch_add(&server->requests, 1, __ATOMIC_RELAXED);
+        uint64_t now = NowMicroseconds();
+        LatencyRecord(&server->latency, now - connection->arrival);
+        if (!keepAlive) return false;
+        memmove(connection->buffer, connection->buffer + consumed, connection->length - consumed + 1);
+        connection->length -= consumed;
+        if (connection->length > 0) connection->arrival = now;    // A pipelined request is timed from when the previous one finished
+    }
+    if (connection->length >= SERVE_REQUEST_MAX) return ServeError(server, connection->fd, 431, "Request Header Fields Too Large", false);
+    return true;
+}
+
+// Each worker runs its own event loop: the shared listening socket wakes one worker, which keeps the connections it accepts
+static void *ServeWorker(void *argument)
+{
+    serve_t *server = (serve_t *)argument;
+    uint8_t *buffer = malloc(QRCODE_BUFFER_SIZE(QRCODE_VERSION_MAX));
+    uint8_t *scratchBuffer = malloc(QRCODE_SCRATCH_BUFFER_SIZE(QRCODE_VERSION_MAX));
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEvent = { EPOLLIN | EPOLLEXCLUSIVE, { .ptr = NULL } };
+    if (buffer == NULL || scratchBuffer == NULL || epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, server->listenFd, &listenEvent) < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to start worker.\n");
+        if (epollFd >= 0) close(epollFd);
+        free(scratchBuffer);
+        free(buffer);
+        return NULL;
+    }
+    while (!__atomic_load_n(&serveStop, __ATOMIC_RELAXED))
+    {
+        struct epoll_event events[SERVE_EVENTS];
+        int count = epoll_wait(epollFd, events, SERVE_EVENTS, 200);
+        for (int i = 0; i < count; i++)
+        {
+            serve_connection_t *connection = (serve_connection_t *)events[i].data.ptr;
+            if (connection == NULL)
+            {
+                // Accept the pending connections (other workers may take some)
+                int fd;
+                while ((fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    serve_connection_t *accepted = calloc(1, sizeof(serve_connection_t));
+                    if (accepted == NULL) { close(fd); continue; }
+                    accepted->fd = fd;
+                    struct epoll_event event = { EPOLLIN | EPOLLRDHUP, { .ptr = accepted } };
+                    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) { close(fd); free(accepted); }
+                }
+                continue;
+            }
+            if (!(events[i].events & (EPOLLERR | EPOLLHUP)) && ServeConnection(server, connection, buffer, scratchBuffer)) continue;
+            close(connection->fd);      // (also removes it from the epoll set)
+            free(connection->buffer);
+            free(connection);
+        }
+    }
+    // Open connections are dropped at exit
+    close(epollFd);
+    free(scratchBuffer);
+    free(buffer);
+    return NULL;
+}
+
+// Serve GET /qr?data=...&fmt=svg&ecl=m&scale=4 (and GET /stats) until interrupted
+static int RunServer(serve_t *server, const char *address, int workers)
+{
+    struct addrinfo *addresses = ResolveAddress(address, true);
+    if (addresses == NULL) { fprintf(stderr, "ERROR: Invalid address (expected host:port): %s\n", address); return -1; }
+    server->listenFd = -1;
+    for (struct addrinfo *ai = addresses; ai != NULL && server->listenFd < 0; ai = ai->ai_next)
+    {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) server->listenFd = fd;
+        else close(fd);
+    }
+    freeaddrinfo(addresses);
+    if (server->listenFd < 0) { fprintf(stderr, "ERROR: Unable to listen on: %s\n", address); return -1; }
+
+    signal(SIGINT, ServeSignal);
+    signal(SIGTERM, ServeSignal);
+    signal(SIGPIPE, SIG_IGN);
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    fprintf(stderr, "Serving on %s with %d workers (GET /qr?data=...&fmt=svg&ecl=m&scale=4, GET /stats)...\n", address, workers);
+
+    pthread_t *threads = calloc((size_t)workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; threads != NULL && i < workers; i++)
+    {
+        if (pthread_create(&threads[started], NULL, ServeWorker, server) == 0) started++;
+    }
+    ServeWorker(server);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    close(server->listenFd);
+
+    fprintf(stderr, "Served %lu requests (%lu errors), latency p50 %lu us, p99 %lu us\n", (unsigned long)server->requests, (unsigned long)server->errors,
+        (unsigned long)LatencyPercentile(&server->latency, 0.50), (unsigned long)LatencyPercentile(&server->latency, 0.99));
+    PrintCacheStats(server->cache);
+    return 0;
+}
+
+typedef struct
+{
+    struct addrinfo *address;
+    const char *path;
+    int requests;
+    int completed;
+    int errors;
+    latency_histogram_t *latency;
+} load_client_t;
+
+// Read one response, returns the status code (0=failed)
+static int LoadReadResponse(int fd, char *buffer, size_t capacity)
+{
+    size_t length = 0;
+    char *end = NULL;
+    while (end == NULL)
+    {
+        if (length + 1 >= capacity) return 0;
+        ssize_t received = recv(fd, buffer + length, capacity - length - 1, 0);
+        if (received <= 0) return 0;
+        length += (size_t)received;
+        buffer[length] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+    int status = atoi(buffer + 9);
+    char *contentLength = strcasestr(buffer, "\r\nContent-Length:");
+    size_t remaining = contentLength ? strtoul(contentLength + 17, NULL, 10) : 0;
+    size_t have = length - (size_t)(end + 4 - buffer);
+    if (have > remaining) return 0;     // (no pipelining)
+    for (remaining -= have; remaining > 0; )
+    {
+        ssize_t received = recv(fd, buffer, remaining < capacity ? remaining : capacity, 0);
+        if (received <= 0) return 0;
+        remaining -= (size_t)received;
+    }
+    return status;
+}
+
+static int LoadConnect(struct addrinfo *address)
+{
+    int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0) return -1;
+    if (connect(fd, address->ai_addr, address->ai_addrlen) < 0) { close(fd); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// One keep-alive connection sending requests one after another
+static void *LoadClient(void *argument)
+{
+    load_client_t *client = (load_client_t *)argument;
+    char request[4096];
+    int requestLength = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", client->path);
+    char *buffer = malloc(65536);
+    int fd = -1;
+    for (int i = 0; buffer != NULL && i < client->requests; i++)
+    {
+        if (fd < 0 && (fd = LoadConnect(client->address)) < 0) { client->errors++; continue; }
+        uint64_t start = NowMicroseconds();
+        int status = 0;
+        if (send(fd, request, (size_t)requestLength, MSG_NOSIGNAL) == requestLength) status = LoadReadResponse(fd, buffer, 65536);
+        if (status == 0) { close(fd); fd = -1; }
+        if (status != 200) { client->errors++; continue; }
+        LatencyRecord(client->latency, NowMicroseconds() - start);
+        client->completed++;
+    }
+    if (fd >= 0) close(fd);
+    free(buffer);
+    return NULL;
+}
+
+// Load generator: a number of connections to the server sharing the requests, reports throughput and latency
+static int RunLoad(const char *address, const char *path, int connections, int requests)
+{
+    struct addrinfo *addresses = ResolveAddress(address, false);
+    if (addresses == NULL) { fprintf(stderr, "ERROR: Invalid address (expected host:port): %s\n", address); return -1; }
+    if (connections < 1) connections = 1;
+    static latency_histogram_t latency;
+    load_client_t *clients = calloc((size_t)connections, sizeof(load_client_t));
+    pthread_t *threads = calloc((size_t)connections, sizeof(pthread_t));
+    bool *started = calloc((size_t)connections, sizeof(bool));
+    if (clients == NULL || threads == NULL || started == NULL) return -1;
+
+    uint64_t start = NowMicroseconds();
+    for (int i = 0; i < connections; i++)
+    {
+        clients[i].address = addresses;
+        clients[i].path = path;
+        clients[i].requests = requests / connections + (i < requests % connections ? 1 : 0);
+        clients[i].latency = &latency;
+        started[i] = pthread_create(&threads[i], NULL, LoadClient, &clients[i]) == 0;
+    }
+    int completed = 0, errors = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else LoadClient(&clients[i]);
+        completed += clients[i].completed;
+        errors += clients[i].errors;
+    }
+    double seconds = (double)(NowMicroseconds() - start) / 1000000.0;
+    freeaddrinfo(addresses);
+    free(started);
+    free(threads);
+    free(clients);
+
+    printf("{\"requests\":%d,\"errors\":%d,\"connections\":%d,\"seconds\":%.3f,\"requests_per_second\":%.1f,\"p50_us\":%lu,\"p99_us\":%lu}\n",
+        completed, errors, connections, seconds, seconds > 0 ? completed / seconds : 0.0,
+        (unsigned long)LatencyPercentile(&latency, 0.50), (unsigned long)LatencyPercentile(&latency, 0.99));
+    return errors ? -1 : 0;
+}
+#endif
+
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    const char *value = NULL;
+    bool help = false;
+    bool mayUppercase = false;
+    bool eciUtf8 = false;
+    qrcode_error_correction_level_t errorCorrectionLevel = QRCODE_ECL_M;
+    qrcode_mask_pattern_t maskPattern = QRCODE_MASK_AUTO;
+    int version = QRCODE_VERSION_AUTO;
+    bool optimizeEcc = true;
+    int maskThreads = 0;
+    int appendSymbols = 0;
+    int appendThreads = 4;
+    int batch = 0;  // 1=lines, 2=JSON lines
+    int jobs = 0;
+    int cacheEntries = 0;
+#ifdef QRCODE_STATS
+    bool printStats = false;
+#endif
+    bool outputSet = false;
+    const char *serveAddress = NULL;
+    const char *loadAddress = NULL;
+    int connections = 8;
+    int requests = 10000;
+    output_options_t options = {
+        .outputMode = OUTPUT_TEXT,
+        .textRender = &textRenderMedium,
+        .quiet = QRCODE_QUIET_STANDARD,
+        .invert = false,
+        .scale = 4,
+        .pngLevel = 6,
+        .sixelTransparent = false,
+        .svgPath = false,
+        .color = "currentColor",
+        .moduleSize = 1.0f,
+        .moduleRound = 0.0f,
+        .finderPart = false,
+        .finderRound = 0.0f,
+        .alignmentPart = false,
+        .alignmentRound = 0.0f,
+    };
+
+    
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--help")) { help = true; }
+        else if (!strncmp(argv[i], "--ecl:", 6) && ParseErrorCorrectionLevel(argv[i] + 6, &errorCorrectionLevel)) { ; }
+        else if (!strcmp(argv[i], "--fixecl")) { optimizeEcc = false; }
+        else if (!strcmp(argv[i], "--version")) { version = atoi(argv[++i]); }
         else if (!strcmp(argv[i], "--mask")) { maskPattern = atoi(argv[++i]); }
-        else if (!strcmp(argv[i], "--quiet")) { quiet = atoi(argv[++i]); }
-        else if (!strcmp(argv[i], "--invert")) { invert = !invert; }
+        else if (!strcmp(argv[i], "--mask:fast")) { maskPattern = QRCODE_MASK_FAST; }
+        else if (!strcmp(argv[i], "--mask-threads")) { maskThreads = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--batch")) { batch = 1; }
+        else if (!strcmp(argv[i], "--batch:jsonl")) { batch = 2; }
+        else if (!strcmp(argv[i], "--jobs")) { jobs = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--cache")) { cacheEntries = atoi(argv[++i]); }
+#ifdef QRCODE_STATS
+        else if (!strcmp(argv[i], "--stats")) { printStats = true; }
+#endif
+        else if (!strcmp(argv[i], "--serve")) { serveAddress = argv[++i]; }
+        else if (!strcmp(argv[i], "--load")) { loadAddress = argv[++i]; }
+        else if (!strcmp(argv[i], "--connections")) { connections = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--requests")) { requests = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--append")) { appendSymbols = QRCODE_STRUCTURED_APPEND_MAX; }
+        else if (!strcmp(argv[i], "--append-max")) { appendSymbols = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--append-threads")) { appendThreads = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--quiet")) { options.quiet = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--invert")) { options.invert = !options.invert; }
         else if (!strcmp(argv[i], "--uppercase")) { mayUppercase = true; }
-        else if (!strcmp(argv[i], "--file"))
-        {
-            ofp = fopen(argv[++i], "wb");
-            if (ofp == NULL) { fprintf(stderr, "ERROR: Unable to open output filename: %s\n", argv[i]); return -1; }
-        }
-        else if (!strcmp(argv[i], "--output:ascii")) { outputMode = OUTPUT_TEXT; textRender = &textRenderAscii; }
-        else if (!strcmp(argv[i], "--output:large")) { outputMode = OUTPUT_TEXT; textRender = &textRenderLarge; }
-        else if (!strcmp(argv[i], "--output:narrow")) { outputMode = OUTPUT_TEXT; textRender = &textRenderNarrow; }
-        else if (!strcmp(argv[i], "--output:medium")) { outputMode = OUTPUT_TEXT; textRender = &textRenderMedium; }
-        else if (!strcmp(argv[i], "--output:compact")) { outputMode = OUTPUT_TEXT; textRender = &textRenderCompact; }
-        else if (!strcmp(argv[i], "--output:tiny")) { outputMode = OUTPUT_TEXT; textRender = &textRenderTiny; }
-        else if (!strcmp(argv[i], "--output:dots")) { outputMode = OUTPUT_TEXT; textRender = &textRenderDots; }
-        else if (!strcmp(argv[i], "--output:dots6")) { outputMode = OUTPUT_TEXT; textRender = &textRenderDots6; }
-        else if (!strcmp(argv[i], "--output:bmp")) { outputMode = OUTPUT_BITMAP; }
-        else if (!strcmp(argv[i], "--output:svg")) { outputMode = OUTPUT_SVG; }
-        else if (!strcmp(argv[i], "--output:sixel")) { outputMode = OUTPUT_SIXEL; }
-        else if (!strcmp(argv[i], "--output:tgp")) { outputMode = OUTPUT_TGP; }
-        else if (!strcmp(argv[i], "--svg-color")) { color = argv[++i]; }
-        else if (!strcmp(argv[i], "--svg-point")) { moduleSize = atof(argv[++i]); }
-        else if (!strcmp(argv[i], "--svg-round")) { moduleRound = atof(argv[++i]); }
-        else if (!strcmp(argv[i], "--svg-finder-round")) { finderPart = true; finderRound = atof(argv[++i]); }
-        else if (!strcmp(argv[i], "--svg-alignment-round")) { alignmentPart = true; alignmentRound = atof(argv[++i]); }
+        else if (!strcmp(argv[i], "--eci:utf8")) { eciUtf8 = true; }
+        else if (!strcmp(argv[i], "--file")) { filename = argv[++i]; }
+        else if (!strncmp(argv[i], "--output:", 9) && ParseOutputFormat(argv[i] + 9, &options)) { outputSet = true; }
+        else if (!strcmp(argv[i], "--svg-color")) { options.color = argv[++i]; }
+        else if (!strcmp(argv[i], "--svg-mode")) { const char *mode = argv[++i]; options.svgPath = !strcmp(mode, "path"); if (!options.svgPath && strcmp(mode, "use")) { fprintf(stderr, "ERROR: Unrecognized SVG mode: %s\n", mode); help = true; break; } }
+        else if (!strcmp(argv[i], "--svg-point")) { options.moduleSize = atof(argv[++i]); }
+        else if (!strcmp(argv[i], "--svg-round")) { options.moduleRound = atof(argv[++i]); }
+        else if (!strcmp(argv[i], "--svg-finder-round")) { options.finderPart = true; options.finderRound = atof(argv[++i]); }
+        else if (!strcmp(argv[i], "--svg-alignment-round")) { options.alignmentPart = true; options.alignmentRound = atof(argv[++i]); }
         // Scale
-        else if (!strcmp(argv[i], "--scale")) { scale = atoi(argv[++i]); }
-        else if (!strcmp(argv[i], "--bmp-scale")) { scale = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--scale") || !strcmp(argv[i], "--bmp-scale")) { options.scale = atoi(argv[++i]); if (options.scale < 1 || options.scale > 64) { fprintf(stderr, "ERROR: Scale must be 1-64: %s\n", argv[i]); help = true; break; } }
+        else if (!strcmp(argv[i], "--png-level")) { options.pngLevel = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "--sixel-transparent")) { options.sixelTransparent = true; }
         else if (argv[i][0] == '-')
         {
             fprintf(stderr, "ERROR: Unrecognized parameter: %s\n", argv[i]); 
@@ -511,7 +2250,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (value == NULL)
+    if (value == NULL && !batch && serveAddress == NULL && loadAddress == NULL)
     {
         fprintf(stderr, "ERROR: Value not specified.\n"); 
         help = true;
@@ -519,28 +2258,132 @@ int main(int argc, char *argv[])
 
     if (help)
     {
-        fprintf(stderr, "Usage:  qrcode [--ecl:<l|m|q|h>] [--uppercase] [--invert] [--quiet 4] [--output:<large|narrow|medium|compact|tiny|bmp|svg|sixel|tgp>] [--file filename] <value>\n");
+        fprintf(stderr, "Usage:  qrcode [--ecl:<l|m|q|h>] [--uppercase] [--eci:utf8] [--invert] [--quiet 4] [--mask-threads 0] [--append [--append-max 16] [--append-threads 4]] [--batch[:jsonl] [--jobs 0] [--cache 0]] [--serve host:port] [--load host:port] [--output:<large|narrow|medium|compact|tiny|bmp|png|svg|sixel|tgp>] [--file filename] <value>\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "For --output:bmp:  [--scale 4]\n");
-        fprintf(stderr, "For --output:svg:  [--svg-point 1.0] [--svg-round 0.0] [--svg-finder-round 0.0] [--svg-alignment-round 0.0]\n");
-        fprintf(stderr, "For --output:sixel:  [--scale 4]\n");
+        fprintf(stderr, "For --output:png:  [--scale 4] [--png-level 6] (0=uncompressed to 9=smallest)\n");
+        fprintf(stderr, "For --output:svg:  [--svg-mode use|path] [--svg-point 1.0] [--svg-round 0.0] [--svg-finder-round 0.0] [--svg-alignment-round 0.0] (path: one path of merged runs, unless a smaller or rounded --svg-point/--svg-round)\n");
+        fprintf(stderr, "For --output:sixel:  [--scale 4] [--sixel-transparent]\n");
         fprintf(stderr, "For --output:tgp:  [--scale 4]\n");
+        fprintf(stderr, "For --batch[:jsonl]:  reads one payload (or JSON object) per line from the <value> file (default stdin); the --file name is numbered, or a template with {n}, {data}, {ext}\n");
+        fprintf(stderr, "For --serve host:port:  [--jobs 0] [--cache 0] HTTP server for GET /qr?data=...&fmt=svg&ecl=m&scale=4 (and /stats), other options are defaults\n");
+        fprintf(stderr, "For --load host:port:  [--connections 8] [--requests 10000] [<path>] load generator, reports p50/p99 latency\n");
+#ifdef QRCODE_STATS
+        fprintf(stderr, "For --stats:  writes the generation stage timings and outcome as JSON to stderr\n");
+#endif
+        fprintf(stderr, "For --append:  structured append symbols are written to numbered files (e.g. name-1.svg, name-2.svg, ...)\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Example:  ./qrcode --output:svg --svg-round 1 --svg-finder-round 1 --svg-point 0.9 --file hello.svg \"Hello world!\"\n");
         fprintf(stderr, "\n");
         return -1;
     }
 
+#ifdef _WIN32
+    _setmode(_fileno(stdout), O_BINARY);
+    if (options.outputMode == OUTPUT_TEXT) SetConsoleOutputCP(CP_UTF8);
+#endif
+
+    // HTTP server and load generator
+    if (serveAddress != NULL || loadAddress != NULL)
+    {
+#ifdef SERVE_SUPPORTED
+        if (loadAddress != NULL) return RunLoad(loadAddress, value ? value : "/qr?data=Hello%2C+World%21&fmt=svg", connections, requests);
+        static serve_t server;
+        server.errorCorrectionLevel = errorCorrectionLevel;
+        server.maskPattern = maskPattern;
+        server.optimizeEcc = optimizeEcc;
+        server.maskThreads = maskThreads;
+        server.mayUppercase = mayUppercase;
+        server.eciUtf8 = eciUtf8;
+        server.defaults = options;
+        static qrcode_cache_t cache;
+        server.cache = CreateCache(&cache, cacheEntries, QRCODE_VERSION_MAX);
+        if (!outputSet) server.defaults.outputMode = OUTPUT_SVG;     // (unless requested with fmt=)
+        return RunServer(&server, serveAddress, jobs);
+#else
+        fprintf(stderr, "ERROR: --serve and --load are not supported on this platform.\n");
+        return -1;
+#endif
+    }
+
+    // Many codes from lines of input
+    if (batch)
+    {
+        FILE *ifp = stdin;
+        if (value != NULL && strcmp(value, "-"))
+        {
+            ifp = fopen(value, "rb");
+            if (ifp == NULL) { fprintf(stderr, "ERROR: Unable to open input filename: %s\n", value); return -1; }
+        }
+        qrcode_batch_options_t batchOptions;
+        QrCodeBatchOptionsInit(&batchOptions, (version == QRCODE_VERSION_AUTO) ? QRCODE_VERSION_MAX : version, errorCorrectionLevel);
+        batchOptions.optimizeEcc = optimizeEcc;
+        batchOptions.maskPattern = maskPattern;
+        batchOptions.maskThreads = maskThreads;
+        batchOptions.mayUppercase = mayUppercase;
+        batchOptions.eciUtf8 = eciUtf8;
+        batchOptions.threads = jobs;
+        qrcode_cache_t cache;
+        batchOptions.cache = CreateCache(&cache, cacheEntries, batchOptions.maxVersion);
+        int failures = RunBatch(ifp, batch == 2, filename, &options, &batchOptions);
+        PrintCacheStats(batchOptions.cache);
+        if (ifp != stdin) fclose(ifp);
+        return failures ? -1 : 0;
+    }
+
+    // Split the text over several Structured Append symbols of the same version
+    if (appendSymbols > 0)
+    {
+        static qrcode_t qrcodes[QRCODE_STRUCTURED_APPEND_MAX];
+        static qrcode_segment_t segments[QRCODE_STRUCTURED_APPEND_MAX * 64];
+        int maxVersion = (version == QRCODE_VERSION_AUTO) ? QRCODE_VERSION_MAX : version;
+        int count = QrCodeStructuredAppend(qrcodes, appendSymbols, maxVersion, errorCorrectionLevel, segments, sizeof(segments) / sizeof(segments[0]), value, QRCODE_TEXT_LENGTH, mayUppercase);
+        if (count <= 0)
+        {
+            fprintf(stderr, "ERROR: Could not generate QR Code (too much data).\n");
+            return -1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            qrcodes[i].maskPattern = maskPattern;
+            qrcodes[i].optimizeEcc = optimizeEcc;
+            qrcodes[i].maskThreads = maskThreads;
+        }
+
+        size_t bufferSize = 0;
+        size_t scratchBufferSize = 0;
+        int dimension = QrCodeSize(&qrcodes[0], &bufferSize, &scratchBufferSize);
+        uint8_t *buffer = malloc(bufferSize * count);
+        uint8_t *scratchBuffer = malloc(scratchBufferSize * count);
+        bool result = QrCodeStructuredAppendGenerate(qrcodes, count, buffer, scratchBuffer, appendThreads);
+        for (int i = 0; result && i < count; i++)
+        {
+            FILE *ofp = OpenOutput(filename, i + 1);
+            if (ofp == NULL) { result = false; break; }
+            if (!OutputQrCode(&qrcodes[i], ofp, dimension, &options)) result = false;
+            if (ofp != stdout) fclose(ofp);
+        }
+        if (!result) fprintf(stderr, "ERROR: Could not generate QR Code.\n");
+        free(scratchBuffer);
+        free(buffer);
+        return result ? 0 : -1;
+    }
+
     // Clean QR Code object
     qrcode_t qrcode;
     QrCodeInit(&qrcode, QRCODE_VERSION_MAX, errorCorrectionLevel);
     qrcode.maskPattern = maskPattern;
     qrcode.optimizeEcc = optimizeEcc;
+    qrcode.maskThreads = maskThreads;
     qrcode.version = version;
+#ifdef QRCODE_STATS
+    qrcode_stats_t stats;
+    if (printStats) qrcode.stats = &stats;
+#endif
 
-    // Add one text segment
-    qrcode_segment_t segment;
-    QrCodeSegmentAppend(&qrcode, &segment, QRCODE_MODE_INDICATOR_AUTOMATIC, value, QRCODE_TEXT_LENGTH, mayUppercase);
+    // Add the text as the shortest sequence of segments
+    qrcode_segment_t segments[64];
+    QrCodeSegmentAppendOptimal(&qrcode, segments, sizeof(segments) / sizeof(segments[0]), value, QRCODE_TEXT_LENGTH, mayUppercase, eciUtf8);
 
     // Gets required buffer sizes
     size_t bufferSize = 0;
@@ -553,25 +2396,19 @@ int main(int argc, char *argv[])
     bool result = QrCodeGenerate(&qrcode, buffer, scratchBuffer);
     if (result)
     {
-#ifdef _WIN32
-        _setmode(_fileno(stdout), O_BINARY);
-        if (outputMode == OUTPUT_TEXT) SetConsoleOutputCP(CP_UTF8);
+        FILE *ofp = OpenOutput(filename, 0);
+        if (ofp == NULL) return -1;
+        bool written = OutputQrCode(&qrcode, ofp, dimension, &options);
+        if (ofp != stdout) fclose(ofp);
+        if (!written) { fprintf(stderr, "ERROR: Out of memory writing the QR Code.\n"); return -1; }
+#ifdef QRCODE_STATS
+        if (printStats) PrintStats(&stats);
 #endif
-        switch (outputMode)
-        {
-            case OUTPUT_TEXT: OutputQrCodeText(&qrcode, ofp, dimension, textRender, quiet, invert); break;
-            case OUTPUT_BITMAP: OutputQrCodeImageBitmap(&qrcode, ofp, dimension, quiet, scale, invert); break;
-            case OUTPUT_SVG: OutputQrCodeImageSvg(&qrcode, ofp, dimension, quiet, invert, color, moduleSize, moduleRound, finderPart, finderRound, alignmentPart, alignmentRound); break;
-            case OUTPUT_SIXEL: OutputQrCodeSixel(&qrcode, ofp, dimension, quiet, scale, invert); break;
-            case OUTPUT_TGP: OutputQrCodeTerminalGraphicsProtocol(&qrcode, ofp, dimension, quiet, scale, invert); break;
-            default: fprintf(ofp, "<error>"); break;
-        }
     }
     else
     {
         fprintf(stderr, "ERROR: Could not generate QR Code (too much data).\n");
     }
 
-    if (ofp != stdout) fclose(ofp);
     return 0;
 }
@@ -1,6 +1,10 @@
 ﻿// QR Code Generator
 // Dan Jackson, 2020
 
+#if defined(QRCODE_STATS) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L    // clock_gettime()
+#endif
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -9,6 +13,10 @@
 
 #include "qrcode.h"
 
+#ifndef QRCODE_NO_KANJI
+#include "qrcode_sjis.h"
+#endif
+
 #ifdef _DEBUG
 //#define QR_DEBUG_DUMP
 #endif
@@ -17,6 +25,45 @@
 #include <stdio.h>
 #endif
 
+// Vectorized character classification (define QRCODE_NO_SIMD to use only the scalar table)
+#if !defined(QRCODE_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define QRCODE_SIMD_AVX2
+#define QRCODE_SIMD_SSE2
+#elif !defined(QRCODE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define QRCODE_SIMD_SSE2
+#endif
+
+// Stage timing (define QRCODE_STATS; otherwise compiles to nothing)
+#ifdef QRCODE_STATS
+#if defined(_WIN32)
+#include <windows.h>
+static uint64_t QrCodeStatsNow(void)
+{
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+}
+#else
+#include <time.h>
+static uint64_t QrCodeStatsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+#define QRCODE_STATS_START(_qrcode) uint64_t statsStart = (_qrcode)->stats ? QrCodeStatsNow() : 0, statsTime = statsStart
+#define QRCODE_STATS_STAGE(_qrcode, _stage) do { if ((_qrcode)->stats) { uint64_t now = QrCodeStatsNow(); (_qrcode)->stats->stageNs[_stage] += now - statsTime; statsTime = now; } } while (0)
+#define QRCODE_STATS_END(_qrcode) do { if ((_qrcode)->stats) (_qrcode)->stats->totalNs += statsTime - statsStart; } while (0)
+#else
+#define QRCODE_STATS_START(_qrcode)
+#define QRCODE_STATS_STAGE(_qrcode, _stage)
+#define QRCODE_STATS_END(_qrcode)
+#endif
+
 
 //#define QRCODE_DIMENSION_TO_VERSION(_n) (((_n) - 17) / 4)
 #define QRCODE_FINDER_SIZE 7
@@ -30,35 +77,172 @@
 #define QRCODE_SIZE_MASK 3              // 3-bit code for mask size
 #define QRCODE_SIZE_BCH 10              // 10,5 BCH for format information
 #define QRCODE_SIZE_MODE_INDICATOR 4    // 4-bit mode indicator
+#define QRCODE_SIZE_STRUCTURED_APPEND 16 // 4-bit position, 4-bit total, 8-bit parity
 
 #define QRCODE_PAD_CODEWORDS 0xec11 // Pad codewords 0b11101100=0xec 0b00010001=0x11
 
-#ifdef QR_DEBUG_DUMP
-static int qrWritingCodeword = 0;    // for QrCodeCursorWrite()
+// One-time initialization of shared tables (0=not built, 1=building, 2=built) -- callers that lose the race wait for the builder
+#if defined(_MSC_VER)
+#include <intrin.h>
+static long QrCodeOnceLoad(volatile long *once) { return _InterlockedOr(once, 0); }
+static bool QrCodeOnceExchange(volatile long *once, long expected, long value) { return _InterlockedCompareExchange(once, value, expected) == expected; }
+static void QrCodeOnceStore(volatile long *once, long value) { _InterlockedExchange(once, value); }
+#elif defined(__GNUC__) || defined(__clang__)
+static long QrCodeOnceLoad(volatile long *once) { return __atomic_load_n(once, __ATOMIC_ACQUIRE); }
+static bool QrCodeOnceExchange(volatile long *once, long expected, long value) { return __atomic_compare_exchange_n(once, &expected, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+static void QrCodeOnceStore(volatile long *once, long value) { __atomic_store_n(once, value, __ATOMIC_RELEASE); }
+#else   // No atomics: tables must first be built from a single thread
+static long QrCodeOnceLoad(volatile long *once) { return *once; }
+static bool QrCodeOnceExchange(volatile long *once, long expected, long value) { if (*once != expected) return false; *once = value; return true; }
+static void QrCodeOnceStore(volatile long *once, long value) { *once = value; }
+#endif
+
+// Returns true if the caller must build the table and then call QrCodeOnceEnd()
+static bool QrCodeOnceBegin(volatile long *once)
+{
+    for (;;)
+    {
+        long state = QrCodeOnceLoad(once);
+        if (state == 2) return false;
+        if (state == 0 && QrCodeOnceExchange(once, 0, 1)) return true;
+    }
+}
+
+static void QrCodeOnceEnd(volatile long *once)
+{
+    QrCodeOnceStore(once, 2);
+}
+
+// 64-bit compare-and-swap for the batch work queues (without QRCODE_ATOMICS, batches are generated on a single thread)
+#if defined(_MSC_VER)
+#define QRCODE_ATOMICS
+static int64_t QrCodeAtomicLoad64(volatile int64_t *value) { return _InterlockedCompareExchange64(value, 0, 0); }
+static bool QrCodeAtomicExchange64(volatile int64_t *value, int64_t expected, int64_t desired) { return _InterlockedCompareExchange64(value, desired, expected) == expected; }
+#elif defined(__GNUC__) || defined(__clang__)
+#define QRCODE_ATOMICS
+static int64_t QrCodeAtomicLoad64(volatile int64_t *value) { return __atomic_load_n(value, __ATOMIC_ACQUIRE); }
+static bool QrCodeAtomicExchange64(volatile int64_t *value, int64_t expected, int64_t desired) { return __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+#else
+static int64_t QrCodeAtomicLoad64(volatile int64_t *value) { return *value; }
+static bool QrCodeAtomicExchange64(volatile int64_t *value, int64_t expected, int64_t desired) { if (*value != expected) return false; *value = desired; return true; }
+#endif
+
+// Minimal thread wrapper (define QRCODE_NO_THREADS to build without thread support)
+#ifndef QRCODE_NO_THREADS
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE qrcode_thread_t;
+typedef struct { void (*function)(void *); void *argument; } qrcode_thread_start_t;
+static DWORD WINAPI QrCodeThreadEntry(LPVOID parameter) { qrcode_thread_start_t *start = (qrcode_thread_start_t *)parameter; start->function(start->argument); return 0; }
+static bool QrCodeThreadCreate(qrcode_thread_t *thread, qrcode_thread_start_t *start) { *thread = CreateThread(NULL, 0, QrCodeThreadEntry, start, 0, NULL); return *thread != NULL; }
+static void QrCodeThreadJoin(qrcode_thread_t thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+static void QrCodeThreadYield(void) { SwitchToThread(); }
+#else
+#include <pthread.h>
+#include <sched.h>
+typedef pthread_t qrcode_thread_t;
+typedef struct { void (*function)(void *); void *argument; } qrcode_thread_start_t;
+static void *QrCodeThreadEntry(void *parameter) { qrcode_thread_start_t *start = (qrcode_thread_start_t *)parameter; start->function(start->argument); return NULL; }
+static bool QrCodeThreadCreate(qrcode_thread_t *thread, qrcode_thread_start_t *start) { return pthread_create(thread, NULL, QrCodeThreadEntry, start) == 0; }
+static void QrCodeThreadJoin(qrcode_thread_t thread) { pthread_join(thread, NULL); }
+static void QrCodeThreadYield(void) { sched_yield(); }
+#endif
+#endif
+
+// Run 'count' workers over an array of jobs of 'jobSize' bytes each
+// Workers 1+ on their own threads (a worker that fails to start, or beyond QRCODE_BATCH_THREADS_MAX, is run on this thread instead), worker 0 on this thread
+static void QrCodeRunWorkers(void (*function)(void *), void *jobs, size_t jobSize, int count)
+{
+#ifndef QRCODE_NO_THREADS
+    qrcode_thread_t threads[QRCODE_BATCH_THREADS_MAX];
+    qrcode_thread_start_t starts[QRCODE_BATCH_THREADS_MAX];
+    bool started[QRCODE_BATCH_THREADS_MAX] = { false };
+    for (int i = 1; i < count && i < QRCODE_BATCH_THREADS_MAX; i++)
+    {
+        starts[i].function = function;
+        starts[i].argument = (char *)jobs + i * jobSize;
+        started[i] = QrCodeThreadCreate(&threads[i], &starts[i]);
+    }
+    function(jobs);
+    for (int i = 1; i < count; i++)
+    {
+        if (i < QRCODE_BATCH_THREADS_MAX && started[i]) QrCodeThreadJoin(threads[i]);
+        else function((char *)jobs + i * jobSize);
+    }
+#else
+    for (int i = 0; i < count; i++) function((char *)jobs + i * jobSize);
 #endif
+}
+
+// Bit stream writer: MSB-first bits gathered in a 64-bit accumulator, stored to the buffer 32 bits at a time
+typedef struct
+{
+    uint8_t *buffer;
+    size_t byteOffset;      // Next byte to store
+    uint64_t accumulator;   // Pending bits in the low 'count' bits (higher bits are stale)
+    int count;              // Pending bits (< 32 between writes)
+} qrcode_bit_writer_t;
+
+// Start writing at a bit position (keeping any earlier bits of a partial byte)
+static void QrCodeBitWriterInit(qrcode_bit_writer_t *writer, uint8_t *buffer, size_t bitPosition)
+{
+    writer->buffer = buffer;
+    writer->byteOffset = bitPosition >> 3;
+    writer->count = (int)(bitPosition & 7);
+    writer->accumulator = writer->count ? (uint64_t)(buffer[writer->byteOffset] >> (8 - writer->count)) : 0;
+}
+
+static size_t QrCodeBitWriterPosition(const qrcode_bit_writer_t *writer)
+{
+    return writer->byteOffset * 8 + (size_t)writer->count;
+}
+
+// Append the low bitCount (0-32) bits of value
+static void QrCodeBitWrite(qrcode_bit_writer_t *writer, uint32_t value, int bitCount)
+{
+    if (bitCount <= 0) return;
+    writer->accumulator = (writer->accumulator << bitCount) | (value & (0xffffffffu >> (32 - bitCount)));
+    writer->count += bitCount;
+    if (writer->count >= 32)
+    {
+        writer->count -= 32;
+        uint32_t word = (uint32_t)(writer->accumulator >> writer->count);
+        uint8_t *out = writer->buffer + writer->byteOffset;
+        out[0] = (uint8_t)(word >> 24);
+        out[1] = (uint8_t)(word >> 16);
+        out[2] = (uint8_t)(word >> 8);
+        out[3] = (uint8_t)word;
+        writer->byteOffset += 4;
+    }
+}
 
-static bool QrCodeBufferRead(uint8_t* scratchBuffer, size_t bitPosition)
+// Store all pending bits (the rest of a final partial byte is cleared); the writer remains usable
+static void QrCodeBitWriterFlush(qrcode_bit_writer_t *writer)
 {
-    return (scratchBuffer[bitPosition >> 3] & (1 << (7 - (bitPosition & 7)))) ? 1 : 0;
+    while (writer->count >= 8)
+    {
+        writer->count -= 8;
+        writer->buffer[writer->byteOffset++] = (uint8_t)(writer->accumulator >> writer->count);
+    }
+    if (writer->count > 0) writer->buffer[writer->byteOffset] = (uint8_t)(writer->accumulator << (8 - writer->count));
 }
 
-// Write bits to buffer
-static size_t QrCodeBufferAppend(uint8_t *writeBuffer, size_t writePosition, uint32_t value, size_t bitCount)
+// Append whole bytes: copied directly when byte-aligned, otherwise shifted in 32 bits at a time
+static void QrCodeBitWriteBytes(qrcode_bit_writer_t *writer, const uint8_t *bytes, size_t length)
 {
-//dump_scratch(writeBuffer, writePosition, "BEFORE");
-//char bin[65]; memset(bin, '0', 32); _itoa(value, bin+32, 2);
-//printf("Writing last %d bits from 0x%08X=%s\n", (int)bitCount, value, bin + strlen(bin) - bitCount);
-    for (size_t i = 0; i < bitCount; i++)
+    size_t i = 0;
+    if ((writer->count & 7) == 0)
+    {
+        QrCodeBitWriterFlush(writer);
+        memcpy(writer->buffer + writer->byteOffset, bytes, length);
+        writer->byteOffset += length;
+        return;
+    }
+    for (; i + 4 <= length; i += 4)
     {
-        uint8_t *writeByte = writeBuffer + ((writePosition + i) >> 3);
-        int writeBit = 7 - ((writePosition + i) & 0x07);
-        int writeMask = (1 << writeBit);
-        int readMask = (1 << (bitCount - 1 - i));
-//printf("bit#%d +%d writeBit=%d writeMask=%02x readMask=%02x read=%d\n", (int)i, (int)((writePosition + i) >> 3), writeBit, writeMask, readMask, (value & readMask) ? 1 : 0);
-        *writeByte = (*writeByte & ~writeMask) | ((value & readMask) ? writeMask : 0);
+        QrCodeBitWrite(writer, ((uint32_t)bytes[i] << 24) | ((uint32_t)bytes[i + 1] << 16) | ((uint32_t)bytes[i + 2] << 8) | bytes[i + 3], 32);
     }
-//dump_scratch(writeBuffer, writePosition + bitCount, "AFTER");
-    return bitCount;
+    for (; i < length; i++) QrCodeBitWrite(writer, bytes[i], 8);
 }
 
 // [Table 13] Number of error correction blocks (count of error-correction-blocks; for each error-correction level and version)
@@ -80,54 +264,186 @@ static const int8_t qrcode_ecc_block_codewords[1 << QRCODE_SIZE_ECL][QRCODE_VERS
 };
 #define QRCODE_ECC_CODEWORDS_MAX 30
 
+// Number of data codewords for each error-correction level and version (QRCODE_TOTAL_CAPACITY() / 8, less the ECC codewords above)
+static const uint16_t qrcode_data_codewords[1 << QRCODE_SIZE_ECL][QRCODE_VERSION_MAX + 1] = {
+    //-,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,   15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40
+    { 0,   16,   28,   44,   64,   86,  108,  124,  154,  182,  216,  254,  290,  334,  365,  415,  453,  507,  563,  627,  669,  714,  782,  860,  914, 1000, 1062, 1128, 1193, 1267, 1373, 1455, 1541, 1631, 1725, 1812, 1914, 1992, 2102, 2216, 2334 },  // 0b00 Medium
+    { 0,   19,   34,   55,   80,  108,  136,  156,  194,  232,  274,  324,  370,  428,  461,  523,  589,  647,  721,  795,  861,  932, 1006, 1094, 1174, 1276, 1370, 1468, 1531, 1631, 1735, 1843, 1955, 2071, 2191, 2306, 2434, 2566, 2702, 2812, 2956 },  // 0b01 Low
+    { 0,    9,   16,   26,   36,   46,   60,   66,   86,  100,  122,  140,  158,  180,  197,  223,  253,  283,  313,  341,  385,  406,  442,  464,  514,  538,  596,  628,  661,  701,  745,  793,  845,  901,  961,  986, 1054, 1096, 1142, 1222, 1276 },  // 0b10 High
+    { 0,   13,   22,   34,   48,   62,   76,   88,  110,  132,  154,  180,  206,  244,  261,  295,  325,  367,  397,  445,  485,  512,  568,  614,  664,  718,  754,  808,  871,  911,  985, 1033, 1115, 1171, 1231, 1286, 1354, 1426, 1502, 1582, 1666 },  // 0b11 Quartile
+};
+
 // Total number of data bits available in the codewords (cooked: after ecc and remainder)
 static size_t QrCodeDataCapacity(int version, qrcode_error_correction_level_t errorCorrectionLevel)
 {
-    size_t capacityCodewords = QRCODE_TOTAL_CAPACITY(version) / 8;
-    size_t eccCodewords = (size_t)qrcode_ecc_block_count[errorCorrectionLevel][version] * qrcode_ecc_block_codewords[errorCorrectionLevel][version];
-    size_t dataCapacityCodewords = capacityCodewords - eccCodewords;
-    return dataCapacityCodewords * 8;
+    return (size_t)qrcode_data_codewords[errorCorrectionLevel][version] * 8;
 }
 
-// Check the buffer is entirely compatible with a numeric encoding
-static bool QrCodeSegmentNumericCheck(const char* text, size_t charCount)
-{
-    for (size_t i = 0; i < charCount; i++)
-    {
-        if (text[i] < '0' || text[i] > '9') return false;
-    }
-    return true;
-}
+// Character classes: alphanumeric index (0-44; digits are 0-9), or QRCODE_CHAR_NONE; lowercase letters are flagged as only alphanumeric when uppercased
+#define QRCODE_CHAR_INDEX_MASK 0x3f
+#define QRCODE_CHAR_NONE 0x3f
+#define QRCODE_CHAR_LOWERCASE 0x40
+static const uint8_t qrcode_char_class[256] = {
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x24, 0x3f, 0x3f, 0x3f, 0x25, 0x26, 0x3f, 0x3f, 0x3f, 0x3f, 0x27, 0x28, 0x3f, 0x29, 0x2a, 0x2b,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x2c, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+    0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+};
 
 // Returns Alphanumeric index for a character (0-44), or -1 if none
 static int QrCodeSegmentAlphanumericIndex(char c, bool mayUppercase)
 {
-    if (c >= '0' && c <= '9') return c - '0';      // 0-9 (0-9)
-    if (c >= 'A' && c <= 'Z') return 10 + c - 'A'; // A-Z (10-35)
-    if (mayUppercase && c >= 'a' && c <= 'z') return 10 + c - 'a'; // transform to upper-case A-Z (10-35)
     //  36,  37,  38,  39,  40,  41,  42,  43,  44
     // ' ', '$', '%', '*', '+', '-', '.', '/', ':'
     //0x20,0x24,0x25,0x2A,0x2B,0x2D,0x2E,0x2F,0x3A
-    static const char* symbols = " $%*+-./:";
-    const char* p = strchr(symbols, c);
-    if (p != NULL) return 36 + (int)(p - symbols);
+    uint8_t charClass = qrcode_char_class[(uint8_t)c];
+    if (charClass == QRCODE_CHAR_NONE || ((charClass & QRCODE_CHAR_LOWERCASE) && !mayUppercase)) return -1;
+    return charClass & QRCODE_CHAR_INDEX_MASK;
+}
+
+#ifdef QRCODE_SIMD_SSE2
+// Bytes within lo-hi (a range of at most 127): offset so that lo is -128, then a signed comparison
+static __m128i QrCodeSimdRange16(__m128i v, int lo, int hi)
+{
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - lo)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + (hi - lo) + 1)));
+}
+#endif
+#ifdef QRCODE_SIMD_AVX2
+static __m256i QrCodeSimdRange32(__m256i v, int lo, int hi)
+{
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - lo)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (hi - lo) + 1)), shifted);
+}
+#endif
+
+// Classify the whole text in one pass: QRCODE_CLASS_NUMERIC if every character is a digit, QRCODE_CLASS_ALPHANUMERIC if every character is alphanumeric (16/32 bytes per step with SSE2/AVX2)
+#define QRCODE_CLASS_NUMERIC 0x01
+#define QRCODE_CLASS_ALPHANUMERIC 0x02
+static int QrCodeSegmentClassify(const char *text, size_t charCount, bool mayUppercase)
+{
+    int classes = QRCODE_CLASS_NUMERIC | QRCODE_CLASS_ALPHANUMERIC;
+    size_t i = 0;
+#ifdef QRCODE_SIMD_AVX2
+    for (; classes && i + 32 <= charCount; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));
+        __m256i numeric = QrCodeSimdRange32(v, '0', '9');
+        // ' ', '$'-'%', '*'-'+', '-'-':' (incl. digits), 'A'-'Z', and maybe 'a'-'z'
+        __m256i alphanumeric = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), QrCodeSimdRange32(v, '$', '%')),
+            _mm256_or_si256(_mm256_or_si256(QrCodeSimdRange32(v, '*', '+'), QrCodeSimdRange32(v, '-', ':')), QrCodeSimdRange32(v, 'A', 'Z')));
+        if (mayUppercase) alphanumeric = _mm256_or_si256(alphanumeric, QrCodeSimdRange32(v, 'a', 'z'));
+        if (_mm256_movemask_epi8(numeric) != -1) classes &= ~QRCODE_CLASS_NUMERIC;
+        if (_mm256_movemask_epi8(alphanumeric) != -1) classes &= ~QRCODE_CLASS_ALPHANUMERIC;
+    }
+#endif
+#ifdef QRCODE_SIMD_SSE2
+    for (; classes && i + 16 <= charCount; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i numeric = QrCodeSimdRange16(v, '0', '9');
+        __m128i alphanumeric = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), QrCodeSimdRange16(v, '$', '%')),
+            _mm_or_si128(_mm_or_si128(QrCodeSimdRange16(v, '*', '+'), QrCodeSimdRange16(v, '-', ':')), QrCodeSimdRange16(v, 'A', 'Z')));
+        if (mayUppercase) alphanumeric = _mm_or_si128(alphanumeric, QrCodeSimdRange16(v, 'a', 'z'));
+        if (_mm_movemask_epi8(numeric) != 0xffff) classes &= ~QRCODE_CLASS_NUMERIC;
+        if (_mm_movemask_epi8(alphanumeric) != 0xffff) classes &= ~QRCODE_CLASS_ALPHANUMERIC;
+    }
+#endif
+    for (; classes && i < charCount; i++)
+    {
+        uint8_t charClass = qrcode_char_class[(uint8_t)text[i]];
+        if (charClass == QRCODE_CHAR_NONE || ((charClass & QRCODE_CHAR_LOWERCASE) && !mayUppercase)) return 0;
+        if (charClass >= 10) classes &= ~QRCODE_CLASS_NUMERIC;
+    }
+    return classes;
+}
+
+#ifndef QRCODE_NO_KANJI
+// Decodes one UTF-8 character, returns its length in bytes (0 if invalid or incomplete)
+static size_t QrCodeUtf8Decode(const char *text, size_t remaining, uint32_t *codePoint)
+{
+    const uint8_t *bytes = (const uint8_t *)text;
+    size_t length;
+    uint32_t value;
+    if (remaining < 1) return 0;
+    if (bytes[0] < 0x80) { *codePoint = bytes[0]; return 1; }
+    else if ((bytes[0] & 0xe0) == 0xc0) { length = 2; value = bytes[0] & 0x1f; }
+    else if ((bytes[0] & 0xf0) == 0xe0) { length = 3; value = bytes[0] & 0x0f; }
+    else if ((bytes[0] & 0xf8) == 0xf0) { length = 4; value = bytes[0] & 0x07; }
+    else return 0;
+    if (remaining < length) return 0;
+    for (size_t i = 1; i < length; i++)
+    {
+        if ((bytes[i] & 0xc0) != 0x80) return 0;
+        value = (value << 6) | (bytes[i] & 0x3f);
+    }
+    *codePoint = value;
+    return length;
+}
+#endif
+
+// Returns the Shift JIS code for the UTF-8 character at the start of the text (and its length in bytes), or -1 if none
+static int QrCodeSegmentSjisCode(const char *text, size_t remaining, size_t *length)
+{
+#ifndef QRCODE_NO_KANJI
+    uint32_t codePoint;
+    *length = QrCodeUtf8Decode(text, remaining, &codePoint);
+    if (*length < 2 || codePoint > 0xffff) return -1;
+    // Binary search of the Unicode to Shift JIS table
+    int low = 0, high = QRCODE_SJIS_COUNT - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (qrcode_sjis_unicode[mid] < codePoint) low = mid + 1;
+        else if (qrcode_sjis_unicode[mid] > codePoint) high = mid - 1;
+        else return qrcode_sjis_code[mid];
+    }
+#else
+    *length = 0;
+#endif
     return -1;
 }
 
-// Check the buffer is entirely compatible with an alphanumeric encoding
-static bool QrCodeSegmentAlphanumericCheck(const char* text, size_t charCount, bool mayUppercase)
+// Returns the 13-bit Kanji mode value for the UTF-8 character at the start of the text (and its length in bytes), or -1 if none
+static int QrCodeSegmentKanjiValue(const char *text, size_t remaining, size_t *length)
 {
-    for (size_t i = 0; i < charCount; i++)
+    int code = QrCodeSegmentSjisCode(text, remaining, length);
+    if (code < 0) return -1;
+    // Subtract 0x8140 (for 0x8140-0x9FFC) or 0xC140 (for 0xE040-0xEBBF), then (most significant byte * 0xC0) + least significant byte
+    int value = code - (code >= 0xe040 ? 0xc140 : 0x8140);
+    return ((value >> 8) * 0xc0) + (value & 0xff);
+}
+
+// Number of Kanji characters in the UTF-8 text, or 0 if not entirely compatible with a Kanji encoding
+static size_t QrCodeSegmentKanjiCount(const char *text, size_t charCount)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < charCount; count++)
     {
-        if (QrCodeSegmentAlphanumericIndex(text[i], mayUppercase) < 0) return false;
+        size_t length;
+        if (QrCodeSegmentKanjiValue(text + i, charCount - i, &length) < 0) return 0;
+        i += length;
     }
-    return true;
+    return count;
 }
 
 // Calculate segment buffer sizes (payload only -- excluding 4-bit mode indicator and version-specific sized char count)
 #define QRCODE_SEGMENT_NUMERIC_BUFFER_BITS(_c) ((10 * ((_c) / 3)) + (((_c) % 3) * 4) - (((_c) % 3) / 2))
 #define QRCODE_SEGMENT_ALPHANUMERIC_BUFFER_BITS(_c) (11 * ((_c) >> 1) + 6 * ((_c) & 1))
 #define QRCODE_SEGMENT_8_BIT_BUFFER_BITS(_c) (8 * (_c))
+#define QRCODE_SEGMENT_KANJI_BUFFER_BITS(_c) (13 * (_c))
 
 void QrCodeSegmentAppend(qrcode_t *qrcode, qrcode_segment_t *segment, qrcode_mode_indicator_t mode, const char *text, size_t charCount, bool mayUppercase)
 {
@@ -138,13 +454,20 @@ void QrCodeSegmentAppend(qrcode_t *qrcode, qrcode_segment_t *segment, qrcode_mod
     segment->text = text;
     segment->next = NULL;
 
-    // Find the most efficient mode for the entire given string (TODO: Analyze sub-strings for more efficient mode switching)
+    // Find the most efficient mode for the entire given string (see QrCodeSegmentAppendOptimal() to switch modes within the text)
     if (segment->mode == QRCODE_MODE_INDICATOR_AUTOMATIC)
     {
-        if (QrCodeSegmentNumericCheck(text, segment->charCount)) segment->mode = QRCODE_MODE_INDICATOR_NUMERIC;
-        else if (QrCodeSegmentAlphanumericCheck(text, segment->charCount, mayUppercase)) segment->mode = QRCODE_MODE_INDICATOR_ALPHANUMERIC;
+        int classes = QrCodeSegmentClassify(text, segment->charCount, mayUppercase);
+        if (classes & QRCODE_CLASS_NUMERIC) segment->mode = QRCODE_MODE_INDICATOR_NUMERIC;
+        else if (classes & QRCODE_CLASS_ALPHANUMERIC) segment->mode = QRCODE_MODE_INDICATOR_ALPHANUMERIC;
+        else if (QrCodeSegmentKanjiCount(text, segment->charCount) > 0) segment->mode = QRCODE_MODE_INDICATOR_KANJI;
         else segment->mode = QRCODE_MODE_INDICATOR_8_BIT;
     }
+    // Kanji text must be entirely encodable (its size, count and data would disagree otherwise): any other text is added as 8-bit
+    else if (segment->mode == QRCODE_MODE_INDICATOR_KANJI && segment->charCount > 0 && QrCodeSegmentKanjiCount(text, segment->charCount) == 0)
+    {
+        segment->mode = QRCODE_MODE_INDICATOR_8_BIT;
+    }
 
     qrcode_segment_t* seg = qrcode->firstSegment;
     if (seg == NULL) { qrcode->firstSegment = segment; }
@@ -158,20 +481,14 @@ void QrCodeSegmentAppend(qrcode_t *qrcode, qrcode_segment_t *segment, qrcode_mod
 }
 
 // Writes an 8-bit text segment
-static size_t QrCodeSegmentWrite8bit(uint8_t *buffer, size_t bitPosition, const char *text, size_t charCount)
+static void QrCodeSegmentWrite8bit(qrcode_bit_writer_t *writer, const char *text, size_t charCount)
 {
-    size_t bitsWritten = 0;
-    for (size_t i = 0; i < charCount; i++)
-    {
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, text[i], 8);
-    }
-    return bitsWritten;
+    QrCodeBitWriteBytes(writer, (const uint8_t *)text, charCount);
 }
 
 // Writes a numeric segment, buffer size should be at least: QRCODE_SEGMENT_NUMERIC_BUFFER_BYTES(charCount)
-static size_t QrCodeSegmentWriteNumeric(uint8_t *buffer, size_t bitPosition, const char *text, size_t charCount)
+static void QrCodeSegmentWriteNumeric(qrcode_bit_writer_t *writer, const char *text, size_t charCount)
 {
-    size_t bitsWritten = 0;
     for (size_t i = 0; i < charCount; )
     {
         size_t remain = (charCount - i) > 3 ? 3 : (charCount - i);
@@ -180,27 +497,38 @@ static size_t QrCodeSegmentWriteNumeric(uint8_t *buffer, size_t bitPosition, con
         // Maximal groups of 3/2/1 digits encoded to 10/7/4-bit binary
         if (remain > 1) { value = value * 10 + text[i + 1] - '0'; bits += 3; }
         if (remain > 2) { value = value * 10 + text[i + 2] - '0'; bits += 3; }
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, value, bits);
+        QrCodeBitWrite(writer, (uint32_t)value, bits);
         i += remain;
     }
-    return bitsWritten;
 }
 
 // Writes an alphanumeric segment, buffer size should be at least: QRCODE_SEGMENT_ALPHANUMERIC_BUFFER_BYTES(charCount)
-static size_t QrCodeSegmentWriteAlphanumeric(uint8_t *buffer, size_t bitPosition, const char *text, size_t charCount)
+static void QrCodeSegmentWriteAlphanumeric(qrcode_bit_writer_t *writer, const char *text, size_t charCount)
 {
-    size_t bitsWritten = 0;
     for (size_t i = 0; i < charCount; )
     {
         size_t remain = (charCount - i) > 2 ? 2 : (charCount - i);
-        int value = QrCodeSegmentAlphanumericIndex(text[i], true);
+        // (already validated: index straight from the class table, lowercase as uppercase)
+        int value = qrcode_char_class[(uint8_t)text[i]] & QRCODE_CHAR_INDEX_MASK;
         int bits = 6;
         // Pairs combined(a * 45 + b) encoded as 11 - bit; odd remainder encoded as 6 - bit.
-        if (remain > 1) { value = value * 45 + QrCodeSegmentAlphanumericIndex(text[i + 1], true); bits += 5; }
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, value, bits);
+        if (remain > 1) { value = value * 45 + (qrcode_char_class[(uint8_t)text[i + 1]] & QRCODE_CHAR_INDEX_MASK); bits += 5; }
+        QrCodeBitWrite(writer, (uint32_t)value, bits);
         i += remain;
     }
-    return bitsWritten;
+}
+
+// Writes a Kanji segment (UTF-8 text, all characters must have a Kanji mode value)
+static void QrCodeSegmentWriteKanji(qrcode_bit_writer_t *writer, const char *text, size_t charCount)
+{
+    for (size_t i = 0; i < charCount; )
+    {
+        size_t length;
+        int value = QrCodeSegmentKanjiValue(text + i, charCount - i, &length);
+        if (value < 0) break;
+        QrCodeBitWrite(writer, (uint32_t)value, 13);
+        i += length;
+    }
 }
 
 // Number of bits in Character Count Indicator
@@ -222,6 +550,10 @@ static size_t QrCodeBitsInCharacterCount(int version, qrcode_mode_indicator_t mo
     }
 }
 
+// Segment sizes only change between the character count bands (versions 1-9, 10-26, 27-40): first version of each band
+#define QRCODE_VERSION_BANDS 3
+static const int qrcodeVersionBandFirst[QRCODE_VERSION_BANDS + 1] = { QRCODE_VERSION_MIN, 10, 27, QRCODE_VERSION_MAX + 1 };
+
 // Size of a segment (including 4-bit mode indicator, version-specific sized char count, mode-specific encoding)
 static size_t QrCodeSegmentSize(qrcode_segment_t *segment, int version)
 {
@@ -239,6 +571,9 @@ static size_t QrCodeSegmentSize(qrcode_segment_t *segment, int version)
         case QRCODE_MODE_INDICATOR_8_BIT:
             bits += QRCODE_SEGMENT_8_BIT_BUFFER_BITS(segment->charCount);
             break;
+        case QRCODE_MODE_INDICATOR_KANJI:
+            bits += QRCODE_SEGMENT_KANJI_BUFFER_BITS(QrCodeSegmentKanjiCount(segment->text, segment->charCount));
+            break;
         case QRCODE_MODE_INDICATOR_ECI:
         {
             // Extended Channel Interpretation (e.g. character set)
@@ -247,6 +582,9 @@ static size_t QrCodeSegmentSize(qrcode_segment_t *segment, int version)
             bits += (eciAssignmentNumber <= 0xFF) ? 8 : (eciAssignmentNumber <= 0x3FFF) ? 16 : 24;
             break;
         }
+        case QRCODE_MODE_INDICATOR_STRUCTURED_APPEND:
+            bits += QRCODE_SIZE_STRUCTURED_APPEND;
+            break;
         default:
             // Other segments?
             break;
@@ -255,31 +593,35 @@ static size_t QrCodeSegmentSize(qrcode_segment_t *segment, int version)
 }
 
 // Write a segment (the 4-bit mode indicator, version-specific sized char count, mode-specific encoding)
-static size_t QrCodeSegmentWrite(qrcode_segment_t *segment, int version, uint8_t *buffer, size_t bitPosition)
+static void QrCodeSegmentWrite(qrcode_segment_t *segment, int version, qrcode_bit_writer_t *writer)
 {
-    size_t bitsWritten = 0;
-
     // Write 4-bit mode
-    bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, segment->mode, QRCODE_SIZE_MODE_INDICATOR);
+    QrCodeBitWrite(writer, (uint32_t)segment->mode, QRCODE_SIZE_MODE_INDICATOR);
 
     // Write mode-specific content
     if (segment->mode == QRCODE_MODE_INDICATOR_NUMERIC)
     {
         size_t countBits = QrCodeBitsInCharacterCount(version, segment->mode);
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, (uint32_t)segment->charCount, countBits);
-        bitsWritten += QrCodeSegmentWriteNumeric(buffer, bitPosition + bitsWritten, segment->text, segment->charCount);
+        QrCodeBitWrite(writer, (uint32_t)segment->charCount, (int)countBits);
+        QrCodeSegmentWriteNumeric(writer, segment->text, segment->charCount);
     }
     else if (segment->mode == QRCODE_MODE_INDICATOR_ALPHANUMERIC)
     {
         size_t countBits = QrCodeBitsInCharacterCount(version, segment->mode);
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, (uint32_t)segment->charCount, countBits);
-        bitsWritten += QrCodeSegmentWriteAlphanumeric(buffer, bitPosition + bitsWritten, segment->text, segment->charCount);
+        QrCodeBitWrite(writer, (uint32_t)segment->charCount, (int)countBits);
+        QrCodeSegmentWriteAlphanumeric(writer, segment->text, segment->charCount);
     }
     else if (segment->mode == QRCODE_MODE_INDICATOR_8_BIT)
     {
         size_t countBits = QrCodeBitsInCharacterCount(version, segment->mode);
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, (uint32_t)segment->charCount, countBits);
-        bitsWritten += QrCodeSegmentWrite8bit(buffer, bitPosition + bitsWritten, segment->text, segment->charCount);
+        QrCodeBitWrite(writer, (uint32_t)segment->charCount, (int)countBits);
+        QrCodeSegmentWrite8bit(writer, segment->text, segment->charCount);
+    }
+    else if (segment->mode == QRCODE_MODE_INDICATOR_KANJI)
+    {
+        size_t countBits = QrCodeBitsInCharacterCount(version, segment->mode);
+        QrCodeBitWrite(writer, (uint32_t)QrCodeSegmentKanjiCount(segment->text, segment->charCount), (int)countBits);
+        QrCodeSegmentWriteKanji(writer, segment->text, segment->charCount);
     }
     else if (segment->mode == QRCODE_MODE_INDICATOR_ECI)
     {
@@ -289,13 +631,421 @@ static size_t QrCodeSegmentWrite(qrcode_segment_t *segment, int version, uint8_t
         if (eciAssignmentNumber <= 0xFF) { countBits = 8; }                                          // 0-127 8-bit 0vvvvvvv
         else if (eciAssignmentNumber <= 0x3FFF) { countBits = 16; eciAssignmentNumber = 0x8000 | eciAssignmentNumber; } // 128-16383 16-bit 10vvvvvv vvvvvvvv
         else { countBits = 24; eciAssignmentNumber = 0xC00000 | (eciAssignmentNumber % 1000000); }    // 16384 to 999999 24-bit 110vvvvv vvvvvvvv vvvvvvvv
-        bitsWritten += QrCodeBufferAppend(buffer, bitPosition + bitsWritten, eciAssignmentNumber, countBits);
+        QrCodeBitWrite(writer, eciAssignmentNumber, (int)countBits);
+    }
+    else if (segment->mode == QRCODE_MODE_INDICATOR_STRUCTURED_APPEND)
+    {
+        // 4-bit symbol position, 4-bit total symbols - 1, 8-bit parity (packed in 'charCount' as for ECI)
+        QrCodeBitWrite(writer, (uint32_t)segment->charCount, QRCODE_SIZE_STRUCTURED_APPEND);
     }
     else
     {
         ;   // No content
     }
-    return bitsWritten;
+}
+
+// Optimal segmentation states: numeric (digits so far mod 3), alphanumeric (characters so far mod 2), 8-bit, Kanji
+#define QRCODE_SEGMENT_STATE_N0 0
+#define QRCODE_SEGMENT_STATE_N1 1
+#define QRCODE_SEGMENT_STATE_N2 2
+#define QRCODE_SEGMENT_STATE_A0 3
+#define QRCODE_SEGMENT_STATE_A1 4
+#define QRCODE_SEGMENT_STATE_B 5
+#define QRCODE_SEGMENT_STATE_K 6
+#define QRCODE_SEGMENT_STATE_COUNT 7
+static const qrcode_mode_indicator_t qrcode_segment_state_mode[QRCODE_SEGMENT_STATE_COUNT] = {
+    QRCODE_MODE_INDICATOR_NUMERIC, QRCODE_MODE_INDICATOR_NUMERIC, QRCODE_MODE_INDICATOR_NUMERIC,
+    QRCODE_MODE_INDICATOR_ALPHANUMERIC, QRCODE_MODE_INDICATOR_ALPHANUMERIC,
+    QRCODE_MODE_INDICATOR_8_BIT,
+    QRCODE_MODE_INDICATOR_KANJI,
+};
+
+// Shortest encoding of the text (exact bits, for the character count sizes of the given version) as a state per byte: returns the total bits, and replaces path[i] with the state of byte i
+// Only encodes the longest prefix (ending on a UTF-8 character boundary) that fits in bitLimit bits, and updates *charCount to its length.
+// path must have charCount entries, each holding the previous state of N1 (bits 0-2), A1 (bits 3-5), B (bits 6-8) and K (bits 9-11) while searching -- all other states can only continue a segment.
+// A Kanji character is costed at its first byte, and its other bytes can only continue the same Kanji segment.
+static size_t QrCodeSegmentOptimalPath(const char *text, size_t *textLength, bool mayUppercase, int version, size_t bitLimit, uint16_t *path)
+{
+    size_t charCount = *textLength;
+    const size_t unreachable = (size_t)-1 / 2;
+    size_t headerNumeric = QRCODE_SIZE_MODE_INDICATOR + QrCodeBitsInCharacterCount(version, QRCODE_MODE_INDICATOR_NUMERIC);
+    size_t headerAlphanumeric = QRCODE_SIZE_MODE_INDICATOR + QrCodeBitsInCharacterCount(version, QRCODE_MODE_INDICATOR_ALPHANUMERIC);
+    size_t header8bit = QRCODE_SIZE_MODE_INDICATOR + QrCodeBitsInCharacterCount(version, QRCODE_MODE_INDICATOR_8_BIT);
+    size_t headerKanji = QRCODE_SIZE_MODE_INDICATOR + QrCodeBitsInCharacterCount(version, QRCODE_MODE_INDICATOR_KANJI);
+    size_t cost[QRCODE_SEGMENT_STATE_COUNT];
+    for (int state = 0; state < QRCODE_SEGMENT_STATE_COUNT; state++) cost[state] = unreachable;
+
+    size_t kanjiEnd = 0;    // End of the current Kanji character
+    size_t fitLength = 0;   // Longest prefix that fits, its cheapest final state and bits
+    int fitState = QRCODE_SEGMENT_STATE_B;
+    size_t fitBits = 0;
+    for (size_t i = 0; i < charCount; i++)
+    {
+        bool numeric = (text[i] >= '0' && text[i] <= '9');
+        bool alphanumeric = QrCodeSegmentAlphanumericIndex(text[i], mayUppercase) >= 0;
+        bool kanjiContinue = (i < kanjiEnd);
+        bool kanjiStart = false;
+        if (!kanjiContinue)
+        {
+            size_t length;
+            kanjiStart = QrCodeSegmentKanjiValue(text + i, charCount - i, &length) >= 0;
+            if (kanjiStart) kanjiEnd = i + length;
+        }
+
+        // Cheapest state of each mode to start a new segment of another mode from (nothing before the first character; not from within a Kanji character)
+        int fromNumeric = QRCODE_SEGMENT_STATE_N0, fromAlphanumeric = QRCODE_SEGMENT_STATE_A0, from8bit = QRCODE_SEGMENT_STATE_B, fromKanji = QRCODE_SEGMENT_STATE_K;
+        for (int state = QRCODE_SEGMENT_STATE_N1; state <= QRCODE_SEGMENT_STATE_N2; state++) if (cost[state] < cost[fromNumeric]) fromNumeric = state;
+        if (cost[QRCODE_SEGMENT_STATE_A1] < cost[fromAlphanumeric]) fromAlphanumeric = QRCODE_SEGMENT_STATE_A1;
+        if (kanjiContinue) fromKanji = -1;
+        int from[4] = { fromNumeric, fromAlphanumeric, from8bit, fromKanji };
+        int start[4];           // For each mode (numeric, alphanumeric, 8-bit, Kanji): cheapest state of any other mode
+        size_t startCost[4];
+        for (int mode = 0; mode < 4; mode++)
+        {
+            start[mode] = -1;
+            startCost[mode] = (i == 0) ? 0 : unreachable;
+            for (int other = 0; i > 0 && other < 4; other++)
+            {
+                if (other == mode || from[other] < 0) continue;
+                if (start[mode] < 0 || cost[from[other]] < startCost[mode]) { start[mode] = from[other]; startCost[mode] = cost[from[other]]; }
+            }
+            if (start[mode] < 0) start[mode] = 0;
+        }
+
+        size_t next[QRCODE_SEGMENT_STATE_COUNT];
+        uint16_t previous = 0;
+        for (int state = 0; state < QRCODE_SEGMENT_STATE_COUNT; state++) next[state] = unreachable;
+
+        // Numeric: groups of 3/2/1 digits are 10/7/4 bits, so the first digit of a group costs 4 bits, and the others 3 bits
+        if (numeric)
+        {
+            if (cost[QRCODE_SEGMENT_STATE_N0] + 4 <= startCost[0] + headerNumeric + 4)
+            {
+                next[QRCODE_SEGMENT_STATE_N1] = cost[QRCODE_SEGMENT_STATE_N0] + 4;
+                previous |= QRCODE_SEGMENT_STATE_N0;
+            }
+            else
+            {
+                next[QRCODE_SEGMENT_STATE_N1] = startCost[0] + headerNumeric + 4;
+                previous |= start[0];
+            }
+            next[QRCODE_SEGMENT_STATE_N2] = cost[QRCODE_SEGMENT_STATE_N1] + 3;
+            next[QRCODE_SEGMENT_STATE_N0] = cost[QRCODE_SEGMENT_STATE_N2] + 3;
+        }
+
+        // Alphanumeric: pairs are 11 bits, so the first character of a pair costs 6 bits, and the second 5 bits
+        if (alphanumeric)
+        {
+            if (cost[QRCODE_SEGMENT_STATE_A0] + 6 <= startCost[1] + headerAlphanumeric + 6)
+            {
+                next[QRCODE_SEGMENT_STATE_A1] = cost[QRCODE_SEGMENT_STATE_A0] + 6;
+                previous |= QRCODE_SEGMENT_STATE_A0 << 3;
+            }
+            else
+            {
+                next[QRCODE_SEGMENT_STATE_A1] = startCost[1] + headerAlphanumeric + 6;
+                previous |= start[1] << 3;
+            }
+            next[QRCODE_SEGMENT_STATE_A0] = cost[QRCODE_SEGMENT_STATE_A1] + 5;
+        }
+
+        // 8-bit: any byte
+        if (cost[QRCODE_SEGMENT_STATE_B] + 8 <= startCost[2] + header8bit + 8)
+        {
+            next[QRCODE_SEGMENT_STATE_B] = cost[QRCODE_SEGMENT_STATE_B] + 8;
+            previous |= QRCODE_SEGMENT_STATE_B << 6;
+        }
+        else
+        {
+            next[QRCODE_SEGMENT_STATE_B] = startCost[2] + header8bit + 8;
+            previous |= start[2] << 6;
+        }
+
+        // Kanji: 13 bits per character
+        if (kanjiContinue)
+        {
+            next[QRCODE_SEGMENT_STATE_K] = cost[QRCODE_SEGMENT_STATE_K];
+            previous |= QRCODE_SEGMENT_STATE_K << 9;
+        }
+        else if (kanjiStart)
+        {
+            if (cost[QRCODE_SEGMENT_STATE_K] + 13 <= startCost[3] + headerKanji + 13)
+            {
+                next[QRCODE_SEGMENT_STATE_K] = cost[QRCODE_SEGMENT_STATE_K] + 13;
+                previous |= QRCODE_SEGMENT_STATE_K << 9;
+            }
+            else
+            {
+                next[QRCODE_SEGMENT_STATE_K] = startCost[3] + headerKanji + 13;
+                previous |= start[3] << 9;
+            }
+        }
+
+        for (int state = 0; state < QRCODE_SEGMENT_STATE_COUNT; state++) cost[state] = (next[state] < unreachable) ? next[state] : unreachable;
+        path[i] = previous;
+
+        // Cheapest state so far: costs never decrease, so stop once nothing fits
+        int best = QRCODE_SEGMENT_STATE_B;
+        for (int state = 0; state < QRCODE_SEGMENT_STATE_COUNT; state++) if (cost[state] < cost[best]) best = state;
+        if (cost[best] > bitLimit) break;
+        if (i + 1 == charCount || ((uint8_t)text[i + 1] & 0xc0) != 0x80)
+        {
+            fitLength = i + 1;
+            fitState = best;
+            fitBits = cost[best];
+        }
+    }
+
+    // Trace back from the cheapest final state
+    int state = fitState;
+    size_t totalBits = fitBits;
+    *textLength = fitLength;
+    for (size_t i = fitLength; i-- > 0; )
+    {
+        uint16_t previous = path[i];
+        path[i] = (uint16_t)state;
+        switch (state)
+        {
+            case QRCODE_SEGMENT_STATE_N1: state = previous & 7; break;
+            case QRCODE_SEGMENT_STATE_N2: state = QRCODE_SEGMENT_STATE_N1; break;
+            case QRCODE_SEGMENT_STATE_N0: state = QRCODE_SEGMENT_STATE_N2; break;
+            case QRCODE_SEGMENT_STATE_A1: state = (previous >> 3) & 7; break;
+            case QRCODE_SEGMENT_STATE_A0: state = QRCODE_SEGMENT_STATE_A1; break;
+            case QRCODE_SEGMENT_STATE_B: state = (previous >> 6) & 7; break;
+            default: state = (previous >> 9) & 7; break;
+        }
+    }
+    return totalBits;
+}
+
+// Number of segments for a path from QrCodeSegmentOptimalPath()
+static int QrCodeSegmentPathCount(size_t charCount, const uint16_t *path)
+{
+    int count = 0;
+    for (size_t i = 0; i < charCount; i++)
+    {
+        if (i == 0 || qrcode_segment_state_mode[path[i]] != qrcode_segment_state_mode[path[i - 1]]) count++;
+    }
+    return count;
+}
+
+// Add the segments for a path from QrCodeSegmentOptimalPath(), returns the number of segments used
+static int QrCodeSegmentAppendPath(qrcode_t *qrcode, qrcode_segment_t *segments, const char *text, size_t charCount, bool mayUppercase, const uint16_t *path)
+{
+    int count = 0;
+    for (size_t start = 0, i = 1; i <= charCount; i++)
+    {
+        if (i == charCount || qrcode_segment_state_mode[path[i]] != qrcode_segment_state_mode[path[start]])
+        {
+            QrCodeSegmentAppend(qrcode, &segments[count++], qrcode_segment_state_mode[path[start]], text + start, i - start, mayUppercase);
+            start = i;
+        }
+    }
+    return count;
+}
+
+// Number of structured append symbols needed when each holds the longest prefix of the remaining text that fits in bitLimit bits (stops counting at maxCount)
+static int QrCodeStructuredAppendCount(const char *text, size_t charCount, bool mayUppercase, int version, size_t bitLimit, int maxCount, uint16_t *path)
+{
+    int count = 0;
+    for (size_t offset = 0; (offset < charCount || count == 0) && count < maxCount; count++)
+    {
+        size_t length = charCount - offset;
+        if (length > QRCODE_SEGMENT_OPTIMAL_MAX_CHARS) length = QRCODE_SEGMENT_OPTIMAL_MAX_CHARS;
+        QrCodeSegmentOptimalPath(text + offset, &length, mayUppercase, version, bitLimit, path);
+        if (length == 0 && offset < charCount) return maxCount;  // Nothing fits
+        offset += length;
+    }
+    return count;
+}
+
+// Add text as the shortest sequence of numeric, alphanumeric, Kanji and 8-bit segments
+int QrCodeSegmentAppendOptimal(qrcode_t *qrcode, qrcode_segment_t *segments, int maxSegments, const char *text, size_t charCount, bool mayUppercase, bool eciUtf8)
+{
+    if (charCount == QRCODE_TEXT_LENGTH) charCount = strlen(text);
+    if (maxSegments <= 0) return 0;
+
+    // Longer text cannot fit in any version -- or too many segments would be needed below: add as a single segment
+    uint16_t path[QRCODE_SEGMENT_OPTIMAL_MAX_CHARS];
+    bool single = (charCount == 0) || (charCount > QRCODE_SEGMENT_OPTIMAL_MAX_CHARS);
+    bool eci = false;
+    qrcode_segment_t eciSegment = { QRCODE_MODE_INDICATOR_ECI, NULL, QRCODE_ECI_UTF8, NULL };
+
+    // Segment for each version band (smallest first) until it fits: the character count sizes change at V10 and V27
+    bool segmented = false;
+    for (int band = 0; !single && band < QRCODE_VERSION_BANDS; band++)
+    {
+        int minVersion = qrcodeVersionBandFirst[band];
+        int maxVersion = qrcodeVersionBandFirst[band + 1] - 1;
+        if (qrcode->version != QRCODE_VERSION_AUTO)
+        {
+            if (qrcode->version < minVersion || qrcode->version > maxVersion) continue;
+            maxVersion = qrcode->version;
+        }
+        else if (qrcode->maxVersion < maxVersion)
+        {
+            maxVersion = qrcode->maxVersion;
+        }
+        if (minVersion > maxVersion) break;
+        size_t length = charCount;
+        size_t bits = QrCodeSegmentOptimalPath(text, &length, mayUppercase, minVersion, (size_t)-1, path);
+        segmented = true;
+        // Optional ECI designator if any non-ASCII is in 8-bit segments
+        eci = false;
+        for (size_t i = 0; eciUtf8 && !eci && i < charCount; i++) eci = (path[i] == QRCODE_SEGMENT_STATE_B && (uint8_t)text[i] >= 0x80);
+        if (eci) bits += QrCodeSegmentSize(&eciSegment, minVersion);
+        for (qrcode_segment_t *seg = qrcode->firstSegment; seg != NULL; seg = seg->next) bits += QrCodeSegmentSize(seg, minVersion);
+        // Use this band if it fits (or the largest band tried)
+        if (bits <= QrCodeDataCapacity(maxVersion, qrcode->errorCorrectionLevel)) break;
+    }
+
+    if (!segmented) single = true;
+
+    // Count the segments needed
+    int count = (eci ? 1 : 0) + (single ? 0 : QrCodeSegmentPathCount(charCount, path));
+    if (count > maxSegments) single = true;
+
+    if (single)
+    {
+        QrCodeSegmentAppend(qrcode, &segments[0], QRCODE_MODE_INDICATOR_AUTOMATIC, text, charCount, mayUppercase);
+        return 1;
+    }
+
+    count = 0;
+    if (eci) QrCodeSegmentAppend(qrcode, &segments[count++], QRCODE_MODE_INDICATOR_ECI, NULL, QRCODE_ECI_UTF8, false);
+    count += QrCodeSegmentAppendPath(qrcode, segments + count, text, charCount, mayUppercase, path);
+    return count;
+}
+
+// Split text across the fewest structured append symbols of the smallest common version, balancing the data between them
+int QrCodeStructuredAppend(qrcode_t *qrcodes, int maxSymbols, int maxVersion, qrcode_error_correction_level_t errorCorrectionLevel, qrcode_segment_t *segments, int maxSegments, const char *text, size_t charCount, bool mayUppercase)
+{
+    if (charCount == QRCODE_TEXT_LENGTH) charCount = strlen(text);
+    if (maxSymbols > QRCODE_STRUCTURED_APPEND_MAX) maxSymbols = QRCODE_STRUCTURED_APPEND_MAX;
+    if (maxVersion > QRCODE_VERSION_MAX) maxVersion = QRCODE_VERSION_MAX;
+    if (maxSymbols <= 0 || maxVersion < QRCODE_VERSION_MIN) return 0;
+
+    // Fewest symbols: as many as needed at the largest version
+    uint16_t path[QRCODE_SEGMENT_OPTIMAL_MAX_CHARS];
+    size_t bitLimit = QrCodeDataCapacity(maxVersion, errorCorrectionLevel) - QRCODE_SIZE_MODE_INDICATOR - QRCODE_SIZE_STRUCTURED_APPEND;
+    int symbols = QrCodeStructuredAppendCount(text, charCount, mayUppercase, maxVersion, bitLimit, maxSymbols + 1, path);
+    if (symbols > maxSymbols) return 0;
+
+    // Smallest version that still needs no more symbols
+    int lowVersion = QRCODE_VERSION_MIN, version = maxVersion;
+    while (lowVersion < version)
+    {
+        int mid = (lowVersion + version) / 2;
+        bitLimit = QrCodeDataCapacity(mid, errorCorrectionLevel) - QRCODE_SIZE_MODE_INDICATOR - QRCODE_SIZE_STRUCTURED_APPEND;
+        if (QrCodeStructuredAppendCount(text, charCount, mayUppercase, mid, bitLimit, symbols + 1, path) <= symbols) version = mid;
+        else lowVersion = mid + 1;
+    }
+
+    // Balance: smallest per-symbol bit limit that still needs no more symbols
+    size_t lowLimit = 0;
+    bitLimit = QrCodeDataCapacity(version, errorCorrectionLevel) - QRCODE_SIZE_MODE_INDICATOR - QRCODE_SIZE_STRUCTURED_APPEND;
+    while (lowLimit < bitLimit)
+    {
+        size_t mid = (lowLimit + bitLimit) / 2;
+        if (QrCodeStructuredAppendCount(text, charCount, mayUppercase, version, mid, symbols + 1, path) <= symbols) bitLimit = mid;
+        else lowLimit = mid + 1;
+    }
+
+    // Parity of the whole message as encoded: the Shift JIS bytes of Kanji characters, the text bytes otherwise
+    uint8_t parity = 0;
+    for (size_t offset = 0; offset < charCount; )
+    {
+        size_t length = charCount - offset;
+        if (length > QRCODE_SEGMENT_OPTIMAL_MAX_CHARS) length = QRCODE_SEGMENT_OPTIMAL_MAX_CHARS;
+        QrCodeSegmentOptimalPath(text + offset, &length, mayUppercase, version, bitLimit, path);
+        if (length == 0) break;
+        for (size_t i = 0; i < length; )
+        {
+            size_t charLength = 0;
+            int code = (path[i] == QRCODE_SEGMENT_STATE_K) ? QrCodeSegmentSjisCode(text + offset + i, length - i, &charLength) : -1;
+            if (code >= 0) parity ^= (uint8_t)(code >> 8) ^ (uint8_t)code;
+            else { parity ^= (uint8_t)text[offset + i]; charLength = 1; }
+            i += charLength;
+        }
+        offset += length;
+    }
+
+    // Add the header and segments for each symbol
+    int used = 0;
+    size_t offset = 0;
+    for (int symbol = 0; symbol < symbols; symbol++)
+    {
+        size_t length = charCount - offset;
+        if (length > QRCODE_SEGMENT_OPTIMAL_MAX_CHARS) length = QRCODE_SEGMENT_OPTIMAL_MAX_CHARS;
+        QrCodeSegmentOptimalPath(text + offset, &length, mayUppercase, version, bitLimit, path);
+        if (used + 1 + QrCodeSegmentPathCount(length, path) > maxSegments) return 0;
+
+        qrcode_t *qrcode = &qrcodes[symbol];
+        QrCodeInit(qrcode, maxVersion, errorCorrectionLevel);
+        qrcode->version = version;
+        uint32_t header = ((uint32_t)symbol << 12) | ((uint32_t)(symbols - 1) << 8) | parity;
+        QrCodeSegmentAppend(qrcode, &segments[used++], QRCODE_MODE_INDICATOR_STRUCTURED_APPEND, NULL, header, false);
+        used += QrCodeSegmentAppendPath(qrcode, segments + used, text + offset, length, mayUppercase, path);
+        offset += length;
+    }
+    return symbols;
+}
+
+// Generates one of several codes per worker (first, first + step, ...)
+typedef struct
+{
+    qrcode_t *qrcodes;
+    int count;
+    uint8_t *buffer;
+    uint8_t *scratchBuffer;
+    size_t bufferSize;
+    size_t scratchBufferSize;
+    int first;
+    int step;
+    bool result;
+} qrcode_generate_job_t;
+
+static void QrCodeGenerateJob(void *argument)
+{
+    qrcode_generate_job_t *job = (qrcode_generate_job_t *)argument;
+    job->result = true;
+    for (int i = job->first; i < job->count; i += job->step)
+    {
+        if (!QrCodeGenerate(&job->qrcodes[i], job->buffer + i * job->bufferSize, job->scratchBuffer + i * job->scratchBufferSize)) job->result = false;
+    }
+}
+
+// Generate the structured append symbols in parallel
+bool QrCodeStructuredAppendGenerate(qrcode_t *qrcodes, int count, uint8_t *buffer, uint8_t *scratchBuffer, int threads)
+{
+    if (count <= 0) return false;
+    size_t bufferSize = 0, scratchBufferSize = 0;
+    if (QrCodeSize(&qrcodes[0], &bufferSize, &scratchBufferSize) <= 0) return false;
+    if (threads > count) threads = count;
+    if (threads > QRCODE_STRUCTURED_APPEND_MAX) threads = QRCODE_STRUCTURED_APPEND_MAX;
+    if (threads < 1) threads = 1;
+#ifdef QRCODE_NO_THREADS
+    threads = 1;
+#endif
+
+    qrcode_generate_job_t jobs[QRCODE_STRUCTURED_APPEND_MAX];
+    for (int i = 0; i < threads; i++)
+    {
+        jobs[i].qrcodes = qrcodes;
+        jobs[i].count = count;
+        jobs[i].buffer = buffer;
+        jobs[i].scratchBuffer = scratchBuffer;
+        jobs[i].bufferSize = bufferSize;
+        jobs[i].scratchBufferSize = scratchBufferSize;
+        jobs[i].first = i;
+        jobs[i].step = threads;
+    }
+
+    QrCodeRunWorkers(QrCodeGenerateJob, jobs, sizeof(jobs[0]), threads);
+
+    bool result = true;
+    for (int i = 0; i < threads; i++) result &= jobs[i].result;
+    return result;
 }
 
 // Returns coordinates to be used in all combinations (unless overlapping finder pattern) as x/y pairs for alignment, <0: end
@@ -340,29 +1090,132 @@ int QrCodeModuleGet(qrcode_t *qrcode, int x, int y)
 #endif
 }
 
-static void QrCodeModuleSet(qrcode_t *qrcode, int x, int y, int value)
+int QrCodeRowPack(qrcode_t *qrcode, int y, int quiet, uint8_t *row)
 {
-    if (x < 0 || y < 0 || x >= qrcode->dimension || y >= qrcode->dimension) return; // quiet
-    int offset = y * qrcode->dimension + x;
+    int dimension = qrcode->dimension;
+    if (dimension <= 0 || qrcode->buffer == NULL || quiet < 0) return 0;
+    int width = dimension + 2 * quiet;
+    memset(row, 0, QRCODE_ROW_BYTES(dimension, quiet));
+    if (y < 0 || y >= dimension) return width;   // quiet
 #ifdef QR_DEBUG_DUMP
-    if (qrcode->buffer == NULL || offset < 0 || offset >= qrcode->bufferSize) return;
-    qrcode->buffer[offset] = value;
+    const uint8_t *modules = qrcode->buffer + (size_t)y * dimension;
+    for (int x = 0; x < dimension; x++)
+    {
+        if (modules[x] & 1) row[(quiet + x) >> 3] |= 0x80 >> ((quiet + x) & 7);
+    }
 #else
-    if (qrcode->buffer == NULL || offset < 0 || (size_t)(offset >> 3) >= qrcode->bufferSize) return;
-    uint8_t mask = (1 << (7 - (offset & 7)));
-    qrcode->buffer[offset >> 3] = (qrcode->buffer[offset >> 3] & ~mask) | (value ? mask : 0);
+    // Copy up to 24 modules at a time from the (unaligned) code buffer to the (unaligned) row
+    size_t bufferBytes = QRCODE_BUFFER_SIZE_BYTES((size_t)dimension * dimension);
+    size_t source = (size_t)y * dimension;
+    for (int x = 0; x < dimension; x += 24)
+    {
+        int count = dimension - x < 24 ? dimension - x : 24;
+        size_t position = source + x;
+        uint32_t window = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            size_t index = (position >> 3) + i;
+            window = (window << 8) | (index < bufferBytes ? qrcode->buffer[index] : 0);
+        }
+        uint32_t bits = (window << (position & 7)) & ~(0xffffffffu >> count);   // Most-significant aligned
+        int target = quiet + x;
+        bits >>= target & 7;
+        uint8_t *out = row + (target >> 3);
+        for (int i = 0; i < 4 && bits != 0; i++, bits <<= 8) out[i] |= (uint8_t)(bits >> 24);
+    }
 #endif
+    return width;
 }
 
-
-// Determines which part a given module coordinate belongs to.
-qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index)
+// Next position from x (up to width) of a bit with the given value in a packed row
+static int QrCodeRowFind(const uint8_t *row, int x, int width, int value)
 {
-    int dimension = qrcode->dimension;
-    int dummy;
-    if (index == NULL) {
-        index = &dummy;
+    uint8_t skip = value ? 0x00 : 0xff;
+    while (x < width)
+    {
+        if ((x & 7) == 0 && row[x >> 3] == skip) { x += 8; continue; }
+        if (((row[x >> 3] >> (7 - (x & 7))) & 1) == value) return x;
+        x++;
+    }
+    return width;
+}
+
+int QrCodeRowSpans(qrcode_t *qrcode, int y, qrcode_span_t *spans)
+{
+    uint8_t row[QRCODE_ROW_BYTES(QRCODE_VERSION_TO_DIMENSION(QRCODE_VERSION_MAX), 0)];
+    int width = QrCodeRowPack(qrcode, y, 0, row);
+    int count = 0;
+    for (int x = QrCodeRowFind(row, 0, width, 1); x < width; x = QrCodeRowFind(row, x, width, 1))
+    {
+        int end = QrCodeRowFind(row, x, width, 0);
+        spans[count].x = x;
+        spans[count].length = end - x;
+        count++;
+        x = end;
     }
+    return count;
+}
+
+// Row-padded bitboard of the modules: module (x, y) is at bit position (y * QRCODE_BOARD_STRIDE + x), least-significant bit first in each 64-bit word
+#define QRCODE_BOARD_WORDS 3                                // 64-bit words per row (V40 is 177 modules wide)
+#define QRCODE_BOARD_STRIDE (64 * QRCODE_BOARD_WORDS)       // bits per row
+#define QRCODE_DIMENSION_MAX QRCODE_VERSION_TO_DIMENSION(QRCODE_VERSION_MAX)
+typedef struct
+{
+    int dimension;
+    uint64_t rows[QRCODE_DIMENSION_MAX * QRCODE_BOARD_WORDS];
+} qrcode_board_t;
+
+#ifdef QR_DEBUG_DUMP
+static int QrCodeBoardGet(const qrcode_board_t *board, int x, int y)
+{
+    size_t position = (size_t)y * QRCODE_BOARD_STRIDE + x;
+    return (int)(board->rows[position >> 6] >> (position & 63)) & 1;
+}
+#endif
+
+static void QrCodeBoardSet(qrcode_board_t *board, int x, int y, int value)
+{
+    if (x < 0 || y < 0 || x >= board->dimension || y >= board->dimension) return; // quiet
+    size_t position = (size_t)y * QRCODE_BOARD_STRIDE + x;
+    uint64_t mask = (uint64_t)1 << (position & 63);
+    if (value) board->rows[position >> 6] |= mask;
+    else board->rows[position >> 6] &= ~mask;
+}
+
+// Population count and count of trailing zero bits (v != 0) for 64-bit words
+#if defined(__GNUC__) || defined(__clang__)
+static int QrCodePopCount(uint64_t v) { return __builtin_popcountll(v); }
+static int QrCodeTrailingZeros(uint64_t v) { return __builtin_ctzll(v); }
+#else
+static int QrCodePopCount(uint64_t v)
+{
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((v * 0x0101010101010101ull) >> 56);
+}
+static int QrCodeTrailingZeros(uint64_t v) { return QrCodePopCount((v & (~v + 1)) - 1); }
+#endif
+
+// Mask of the lowest 'count' bits (clamped to 0-64)
+static uint64_t QrCodeLowBits(int count)
+{
+    if (count <= 0) return 0;
+    if (count >= 64) return ~(uint64_t)0;
+    return ((uint64_t)1 << count) - 1;
+}
+
+// Bits of the next module along a row (module x+1 at bit x) for one word of the row
+static uint64_t QrCodeNextModules(const uint64_t *line, int w, int words)
+{
+    return (line[w] >> 1) | (w + 1 < words ? line[w + 1] << 63 : 0);
+}
+
+// Calculates which part a given module coordinate belongs to for a version (see QrCodeIdentifyModule() for the cached lookup)
+static qrcode_part_t QrCodeIdentifyModuleCalculate(int version, int x, int y, int *index)
+{
+    int dimension = QRCODE_VERSION_TO_DIMENSION(version);
 
     // Quiet zone
     if (x < 0 || y < 0 || x >= dimension || y >= dimension) { *index = QRCODE_MODULE_LIGHT; return QRCODE_PART_QUIET; } // Outside
@@ -382,9 +1235,9 @@ qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index)
     }
 
     // Alignment
-    for (int hi = 0, h; (h = QrCodeAlignmentCoordinates(qrcode->version, hi)) > 0; hi++)
+    for (int hi = 0, h; (h = QrCodeAlignmentCoordinates(version, hi)) > 0; hi++)
     {
-        for (int vi = 0, v; (v = QrCodeAlignmentCoordinates(qrcode->version, vi)) > 0; vi++)
+        for (int vi = 0, v; (v = QrCodeAlignmentCoordinates(version, vi)) > 0; vi++)
         {
             if (h <= QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;                  // Obscured by top-left finder
             if (h >= dimension - 1 - QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;  // Obscured by top-right finder
@@ -411,7 +1264,7 @@ qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index)
     if (x == QRCODE_FINDER_SIZE + 1 && y >= dimension - QRCODE_FINDER_SIZE - 1) { *index = y + 14 - (dimension - 1); return QRCODE_PART_FORMAT; }  // Format info (right of bottom-left finder)
 
     // Version info (V7+) (additional 2*18=36 modules, total 67 for format+version)
-    if (qrcode->version >= 7)
+    if (version >= 7)
     {
         if (x < QRCODE_TIMING_OFFSET && y >= dimension - QRCODE_FINDER_SIZE - 1 - QRCODE_VERSION_SIZE && y < dimension - QRCODE_FINDER_SIZE - 1) { *index = x * QRCODE_VERSION_SIZE + (y - (dimension - QRCODE_FINDER_SIZE - 1 - QRCODE_VERSION_SIZE)); return QRCODE_PART_VERSION; }  // Bottom-left version
         if (y < QRCODE_TIMING_OFFSET && x >= dimension - QRCODE_FINDER_SIZE - 1 - QRCODE_VERSION_SIZE && x < dimension - QRCODE_FINDER_SIZE - 1) { *index = y * QRCODE_VERSION_SIZE + (x - (dimension - QRCODE_FINDER_SIZE - 1 - QRCODE_VERSION_SIZE)); return QRCODE_PART_VERSION; }  // Top-right version
@@ -422,9 +1275,44 @@ qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index)
     return QRCODE_PART_CONTENT;
 }
 
+static bool QrCodeContentModule(const uint8_t *contentMap, int offset)
+{
+    return (contentMap[offset >> 3] & (1 << (7 - (offset & 7)))) ? true : false;
+}
+
+// Advance the codeword placement cursor (2-module wide columns, zig-zag from bottom-right) to the next content module
+static bool QrCodeCursorAdvance(int dimension, const uint8_t *contentMap, int* x, int* y, uint32_t *steps)
+{
+    while (*x >= 0)
+    {
+        (*steps)++;
+        // Right-hand side of 2-module column? (otherwise, left-hand side)
+        if ((*x & 1) ^ (*x > QRCODE_TIMING_OFFSET ? 1 : 0))
+        {
+            (*x)--;
+        }
+        else // Left-hand side
+        {
+            (*x)++;
+            // Upwards? (otherwise, downwards)
+            if (((*x - (*x > QRCODE_TIMING_OFFSET ? 1 : 0)) / 2) & 1)
+            {
+                if (*y <= 0) *x -= 2;
+                else (*y)--;
+            }
+            else
+            {
+                if (*y >= dimension - 1) *x -= 2;
+                else (*y)++;
+            }
+        }
+        if (*x >= 0 && QrCodeContentModule(contentMap, *y * dimension + *x)) return true;
+    }
+    return false;
+}
 
 // Draw finder and separator
-static void QrCodeDrawFinder(qrcode_t *qrcode, int ox, int oy)
+static void QrCodeDrawFinder(qrcode_board_t *board, int ox, int oy)
 {
     for (int y = -QRCODE_FINDER_SIZE / 2 - 1; y <= QRCODE_FINDER_SIZE / 2 + 1; y++)
     {
@@ -432,82 +1320,260 @@ static void QrCodeDrawFinder(qrcode_t *qrcode, int ox, int oy)
         {
             int value = (abs(x) > abs(y) ? abs(x) : abs(y)) & 1;
             if (x == 0 && y == 0) value = QRCODE_MODULE_DARK;
-            QrCodeModuleSet(qrcode, ox + x, oy + y, value);
+            QrCodeBoardSet(board, ox + x, oy + y, value);
         }
     }
 }
 
-static void QrCodeDrawTiming(qrcode_t *qrcode)
+static void QrCodeDrawTiming(qrcode_board_t *board)
 {
-    for (int i = QRCODE_FINDER_SIZE + 1; i < qrcode->dimension - QRCODE_FINDER_SIZE - 1; i++)
+    for (int i = QRCODE_FINDER_SIZE + 1; i < board->dimension - QRCODE_FINDER_SIZE - 1; i++)
     {
         int value = (~i & 1);
-        QrCodeModuleSet(qrcode, i, QRCODE_TIMING_OFFSET, value);
-        QrCodeModuleSet(qrcode, QRCODE_TIMING_OFFSET, i, value);
+        QrCodeBoardSet(board, i, QRCODE_TIMING_OFFSET, value);
+        QrCodeBoardSet(board, QRCODE_TIMING_OFFSET, i, value);
     }
 }
 
-static void QrCodeDrawAlignment(qrcode_t* qrcode, int ox, int oy)
+static void QrCodeDrawAlignment(qrcode_board_t *board, int ox, int oy)
 {
     for (int y = -QRCODE_ALIGNMENT_RADIUS; y <= QRCODE_ALIGNMENT_RADIUS; y++)
     {
         for (int x = -QRCODE_ALIGNMENT_RADIUS; x <= QRCODE_ALIGNMENT_RADIUS; x++)
         {
             int value = 1 - ((abs(x) > abs(y) ? abs(x) : abs(y)) & 1);
-            QrCodeModuleSet(qrcode, ox + x, oy + y, value);
+            QrCodeBoardSet(board, ox + x, oy + y, value);
         }
     }
 }
 
 // Draw 15-bit format information (2-bit error-correction level, 3-bit mask, 10-bit BCH error-correction; all masked)
-static void QrCodeDrawFormatInfo(qrcode_t* qrcode, uint16_t value)
+static void QrCodeDrawFormatInfo(qrcode_board_t *board, uint16_t value)
 {
     for (int i = 0; i < 15; i++)
     {
         int v = (value >> i) & 1;
-#ifdef QR_DEBUG_DUMP
-        v = ((40 + i) << 1) | v; // for debug
-#endif
         // 15-bits starting LSB clockwise from top-left finder avoiding timing strips
-        if (i < 6) QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE + 1, i, v);
-        else if (i == 6) QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE + 1, QRCODE_FINDER_SIZE, v);
-        else if (i == 7) QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE + 1, QRCODE_FINDER_SIZE + 1, v);
-        else if (i == 8) QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE, QRCODE_FINDER_SIZE + 1, v);
-        else QrCodeModuleSet(qrcode, 14 - i, QRCODE_FINDER_SIZE + 1, v);
+        if (i < 6) QrCodeBoardSet(board, QRCODE_FINDER_SIZE + 1, i, v);
+        else if (i == 6) QrCodeBoardSet(board, QRCODE_FINDER_SIZE + 1, QRCODE_FINDER_SIZE, v);
+        else if (i == 7) QrCodeBoardSet(board, QRCODE_FINDER_SIZE + 1, QRCODE_FINDER_SIZE + 1, v);
+        else if (i == 8) QrCodeBoardSet(board, QRCODE_FINDER_SIZE, QRCODE_FINDER_SIZE + 1, v);
+        else QrCodeBoardSet(board, 14 - i, QRCODE_FINDER_SIZE + 1, v);
 
         // lower 8-bits starting LSB right-to-left underneath top-right finder
-        if (i < 8) QrCodeModuleSet(qrcode, qrcode->dimension - 1 - i, QRCODE_FINDER_SIZE + 1, v);
+        if (i < 8) QrCodeBoardSet(board, board->dimension - 1 - i, QRCODE_FINDER_SIZE + 1, v);
         // upper 7-bits starting LSB top-to-bottom right of bottom-left finder
-        else QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE + 1, qrcode->dimension - QRCODE_FINDER_SIZE - 8 + i, v);
+        else QrCodeBoardSet(board, QRCODE_FINDER_SIZE + 1, board->dimension - QRCODE_FINDER_SIZE - 8 + i, v);
     }
     // dark module
-    {
-        int v = QRCODE_MODULE_DARK;
-#ifdef QR_DEBUG_DUMP
-        v = ((40 + 19) << 1) | v; // for debug
-#endif
-        QrCodeModuleSet(qrcode, QRCODE_FINDER_SIZE + 1, qrcode->dimension - 1 - QRCODE_FINDER_SIZE, v);
-    }
+    QrCodeBoardSet(board, QRCODE_FINDER_SIZE + 1, board->dimension - 1 - QRCODE_FINDER_SIZE, QRCODE_MODULE_DARK);
 }
 
 // Draw 18-bit version information (6-bit version number, 12-bit error-correction (18,6) Golay code)
-static void QrCodeDrawVersionInfo(qrcode_t *qrcode, uint32_t value)
+static void QrCodeDrawVersionInfo(qrcode_board_t *board, uint32_t value)
 {
     // No version information on V1-V6
-    if (qrcode->version < 7) return;
+    if (board->dimension < QRCODE_VERSION_TO_DIMENSION(7)) return;
     for (int i = 0; i < 18; i++)
     {
         int v = (value >> i) & 1;
-#ifdef QR_DEBUG_DUMP
-        v = ((60 + i) << 1) | v; // for debug
-#endif
         int col = i / QRCODE_VERSION_SIZE;
         int row = i % QRCODE_VERSION_SIZE;
-        QrCodeModuleSet(qrcode, col, qrcode->dimension - 1 - QRCODE_FINDER_SIZE - QRCODE_VERSION_SIZE + row, v);
-        QrCodeModuleSet(qrcode, qrcode->dimension - 1 - QRCODE_FINDER_SIZE - QRCODE_VERSION_SIZE + row, col, v);
+        QrCodeBoardSet(board, col, board->dimension - 1 - QRCODE_FINDER_SIZE - QRCODE_VERSION_SIZE + row, v);
+        QrCodeBoardSet(board, board->dimension - 1 - QRCODE_FINDER_SIZE - QRCODE_VERSION_SIZE + row, col, v);
+    }
+}
+
+// Cached per-version module layout (built on first use, then shared read-only)
+#define QRCODE_LAYOUT_MODULES 477320        // Sum of dimension^2 for V1-V40
+#define QRCODE_LAYOUT_CONTENT_BYTES 59700   // Sum of QRCODE_BUFFER_SIZE() for V1-V40
+#define QRCODE_LAYOUT_PLACEMENT 441561      // Sum of QRCODE_TOTAL_CAPACITY() for V1-V40
+#define QRCODE_LAYOUT_ROWS 3960             // Sum of dimension for V1-V40
+typedef struct
+{
+    volatile long once;
+    const uint8_t *partMap;         // One byte per module: part and index (QRCODE_PART_MAP_PART() / QRCODE_PART_MAP_INDEX())
+    const uint8_t *contentMap;      // Packed bits as the code buffer: set for content (data/ECC) modules
+    const uint64_t *contentBoard;   // Board rows: set for content (data/ECC) modules
+    const uint64_t *templateBoard;  // Board rows: function patterns drawn (finders, separators, timing, alignment), all else light
+    const uint16_t *placement;      // Board bit position (y * QRCODE_BOARD_STRIDE + x) of each codeword bit in placement order (QRCODE_TOTAL_CAPACITY() entries)
+    const uint64_t *blockBoard;     // Board rows: set at the top-left of each 2x2 block that includes a module changed by the mask or format information
+    int fixedBlocks;                // Count of uniform 2x2 blocks made only of fixed modules (mask-invariant part of penalty feature 2)
+    uint32_t cursorSteps;           // Placement cursor steps taken to build the placement table
+} qrcode_layout_t;
+
+static qrcode_layout_t qrcodeLayouts[QRCODE_VERSION_MAX + 1];
+static uint8_t qrcodePartMaps[QRCODE_LAYOUT_MODULES];
+static uint8_t qrcodeContentMaps[QRCODE_LAYOUT_CONTENT_BYTES];
+static uint64_t qrcodeContentBoards[QRCODE_LAYOUT_ROWS * QRCODE_BOARD_WORDS];
+static uint64_t qrcodeTemplateBoards[QRCODE_LAYOUT_ROWS * QRCODE_BOARD_WORDS];
+static uint16_t qrcodePlacements[QRCODE_LAYOUT_PLACEMENT];
+static uint64_t qrcodeBlockBoards[QRCODE_LAYOUT_ROWS * QRCODE_BOARD_WORDS];
+
+// Clear the board and draw the function patterns (finders, separators, timing, alignment) of a version
+static void QrCodeDrawFunctionPatterns(qrcode_board_t *board, int version)
+{
+    int dimension = QRCODE_VERSION_TO_DIMENSION(version);
+    memset(board, 0, sizeof(*board));
+    board->dimension = dimension;
+    QrCodeDrawFinder(board, QRCODE_FINDER_SIZE / 2, QRCODE_FINDER_SIZE / 2);
+    QrCodeDrawFinder(board, dimension - 1 - QRCODE_FINDER_SIZE / 2, QRCODE_FINDER_SIZE / 2);
+    QrCodeDrawFinder(board, QRCODE_FINDER_SIZE / 2, dimension - 1 - QRCODE_FINDER_SIZE / 2);
+    QrCodeDrawTiming(board);
+    for (int hi = 0, h; (h = QrCodeAlignmentCoordinates(version, hi)) > 0; hi++)
+    {
+        for (int vi = 0, v; (v = QrCodeAlignmentCoordinates(version, vi)) > 0; vi++)
+        {
+            if (h <= QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;                  // Obscured by top-left finder
+            if (h >= dimension - 1 - QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;  // Obscured by top-right finder
+            if (h <= QRCODE_FINDER_SIZE && v >= dimension - 1 - QRCODE_FINDER_SIZE) continue;  // Obscured by bottom-left finder
+            QrCodeDrawAlignment(board, h, v);
+        }
+    }
+}
+
+static void QrCodeLayoutBuild(qrcode_layout_t *layout, int version)
+{
+    // Storage for this version follows all earlier versions
+    size_t partOffset = 0;
+    size_t contentOffset = 0;
+    size_t placementOffset = 0;
+    size_t rowOffset = 0;
+    for (int v = QRCODE_VERSION_MIN; v < version; v++)
+    {
+        partOffset += (size_t)QRCODE_VERSION_TO_DIMENSION(v) * QRCODE_VERSION_TO_DIMENSION(v);
+        contentOffset += QRCODE_BUFFER_SIZE(v);
+        placementOffset += QRCODE_TOTAL_CAPACITY(v);
+        rowOffset += QRCODE_VERSION_TO_DIMENSION(v);
+    }
+    uint8_t *partMap = qrcodePartMaps + partOffset;
+    uint8_t *contentMap = qrcodeContentMaps + contentOffset;
+    uint64_t *contentBoard = qrcodeContentBoards + rowOffset * QRCODE_BOARD_WORDS;
+    uint64_t *templateBoard = qrcodeTemplateBoards + rowOffset * QRCODE_BOARD_WORDS;
+    uint16_t *placement = qrcodePlacements + placementOffset;
+    uint64_t *blockBoard = qrcodeBlockBoards + rowOffset * QRCODE_BOARD_WORDS;
+
+    int dimension = QRCODE_VERSION_TO_DIMENSION(version);
+    memset(contentMap, 0, QRCODE_BUFFER_SIZE(version));
+    memset(contentBoard, 0, (size_t)dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+    for (int y = 0; y < dimension; y++)
+    {
+        for (int x = 0; x < dimension; x++)
+        {
+            int offset = y * dimension + x;
+            int index;
+            qrcode_part_t part = QrCodeIdentifyModuleCalculate(version, x, y, &index);
+            partMap[offset] = (uint8_t)(((part + 4) << 5) | (index + 1));
+            if (part == QRCODE_PART_CONTENT)
+            {
+                size_t position = (size_t)y * QRCODE_BOARD_STRIDE + x;
+                contentMap[offset >> 3] |= (1 << (7 - (offset & 7)));
+                contentBoard[position >> 6] |= (uint64_t)1 << (position & 63);
+            }
+        }
+    }
+
+    // Function patterns
+    qrcode_board_t board;
+    QrCodeDrawFunctionPatterns(&board, version);
+    memcpy(templateBoard, board.rows, (size_t)dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+
+    // Modules that differ between mask candidates: content, and format information (leaves the fixed modules, incl. the dark module, on the board)
+    uint64_t variant[QRCODE_DIMENSION_MAX * QRCODE_BOARD_WORDS];
+    QrCodeDrawFormatInfo(&board, 0x7fff);
+    memcpy(variant, board.rows, (size_t)dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+    QrCodeDrawFormatInfo(&board, 0);
+    for (int i = 0; i < dimension * QRCODE_BOARD_WORDS; i++) variant[i] = (variant[i] ^ board.rows[i]) | contentBoard[i];
+
+    // 2x2 blocks touching a variant module are scored per candidate, the uniform blocks of fixed modules only once here
+    int words = (dimension + 63) >> 6;
+    int fixedBlocks = 0;
+    memset(blockBoard, 0, (size_t)dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+    for (int by = 0; by < dimension - 1; by++)
+    {
+        const uint64_t *v0 = variant + (size_t)by * QRCODE_BOARD_WORDS;
+        const uint64_t *v1 = v0 + QRCODE_BOARD_WORDS;
+        const uint64_t *a = board.rows + (size_t)by * QRCODE_BOARD_WORDS;
+        const uint64_t *b = a + QRCODE_BOARD_WORDS;
+        for (int w = 0; w < words; w++)
+        {
+            uint64_t valid = QrCodeLowBits(dimension - 1 - 64 * w);
+            uint64_t touched = (v0[w] | v1[w] | QrCodeNextModules(v0, w, words) | QrCodeNextModules(v1, w, words)) & valid;
+            uint64_t a1 = QrCodeNextModules(a, w, words);
+            uint64_t b1 = QrCodeNextModules(b, w, words);
+            uint64_t uniform = (a[w] & b[w] & a1 & b1) | ~(a[w] | b[w] | a1 | b1);
+            blockBoard[(size_t)by * QRCODE_BOARD_WORDS + w] = touched;
+            fixedBlocks += QrCodePopCount(uniform & ~touched & valid);
+        }
+    }
+
+    // Walk the placement cursor once, from the bottom-right module
+    int x = dimension - 1;
+    int y = dimension - 1;
+    size_t totalCapacity = QRCODE_TOTAL_CAPACITY(version);
+    uint32_t cursorSteps = 0;
+    for (size_t i = 0; i < totalCapacity; i++)
+    {
+        placement[i] = (uint16_t)(y * QRCODE_BOARD_STRIDE + x);
+        if (!QrCodeCursorAdvance(dimension, contentMap, &x, &y, &cursorSteps)) break;
+    }
+
+    layout->partMap = partMap;
+    layout->contentMap = contentMap;
+    layout->contentBoard = contentBoard;
+    layout->templateBoard = templateBoard;
+    layout->placement = placement;
+    layout->blockBoard = blockBoard;
+    layout->fixedBlocks = fixedBlocks;
+    layout->cursorSteps = cursorSteps;
+}
+
+static const qrcode_layout_t *QrCodeLayout(int version)
+{
+    if (version < QRCODE_VERSION_MIN || version > QRCODE_VERSION_MAX) return NULL;
+    qrcode_layout_t *layout = &qrcodeLayouts[version];
+    if (QrCodeOnceBegin(&layout->once))
+    {
+        QrCodeLayoutBuild(layout, version);
+        QrCodeOnceEnd(&layout->once);
+    }
+    return layout;
+}
+
+// Cached map of the part and index for each module of a version (y * dimension + x)
+const uint8_t *QrCodePartMap(int version)
+{
+    const qrcode_layout_t *layout = QrCodeLayout(version);
+    return layout ? layout->partMap : NULL;
+}
+
+// Cached bitmask of the content (data/ECC) modules of a version (same packing as the code buffer)
+const uint8_t *QrCodeContentMap(int version)
+{
+    const qrcode_layout_t *layout = QrCodeLayout(version);
+    return layout ? layout->contentMap : NULL;
+}
+
+// Determines which part a given module coordinate belongs to.
+qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index)
+{
+    int dimension = qrcode->dimension;
+    int dummy;
+    if (index == NULL) {
+        index = &dummy;
     }
+
+    // Quiet zone
+    if (x < 0 || y < 0 || x >= dimension || y >= dimension) { *index = QRCODE_MODULE_LIGHT; return QRCODE_PART_QUIET; } // Outside
+
+    const uint8_t *partMap = QrCodePartMap(qrcode->version);
+    if (partMap == NULL) return QrCodeIdentifyModuleCalculate(qrcode->version, x, y, index);
+    uint8_t entry = partMap[y * dimension + x];
+    *index = QRCODE_PART_MAP_INDEX(entry);
+    return QRCODE_PART_MAP_PART(entry);
 }
 
+
 // Calculate 15-bit format information (2-bit error-correction level, 3-bit mask, 10-bit BCH error-correction; all masked)
 static uint16_t QrCodeCalcFormatInfo(qrcode_t *qrcode, qrcode_error_correction_level_t errorCorrectionLevel, qrcode_mask_pattern_t maskPattern)
 {
@@ -551,62 +1617,104 @@ static bool QrCodeCalculateMask(qrcode_mask_pattern_t maskPattern, int j, int i)
     }
 }
 
-static void QrCodeApplyMask(qrcode_t* qrcode, qrcode_mask_pattern_t maskPattern)
+// Cached mask patterns for board rows (every mask pattern repeats within 12 rows)
+#define QRCODE_MASK_ROW_PERIOD 12
+static uint64_t qrcodeMaskRows[1 << QRCODE_SIZE_MASK][QRCODE_MASK_ROW_PERIOD][QRCODE_BOARD_WORDS];
+static volatile long qrcodeMaskRowsOnce;
+
+static const uint64_t (*QrCodeMaskRows(qrcode_mask_pattern_t maskPattern))[QRCODE_BOARD_WORDS]
 {
-    for (int y = 0; y < qrcode->dimension; y++)
+    if (QrCodeOnceBegin(&qrcodeMaskRowsOnce))
     {
-        for (int x = 0; x < qrcode->dimension; x++)
+        for (int m = QRCODE_MASK_000; m <= QRCODE_MASK_111; m++)
         {
-            qrcode_part_t part = QrCodeIdentifyModule(qrcode, x, y, NULL);
-            if (part == QRCODE_PART_CONTENT)
+            for (int y = 0; y < QRCODE_MASK_ROW_PERIOD; y++)
             {
-                bool mask = QrCodeCalculateMask(maskPattern, x, y);
-                
-                if (mask)
+                for (int x = 0; x < QRCODE_BOARD_STRIDE; x++)
                 {
-                    int module = QrCodeModuleGet(qrcode, x, y);
-                    int value = 1 ^ module;
-                    //value = mask ? QRCODE_MODULE_DARK : QRCODE_MODULE_LIGHT; // DEBUG
-                    QrCodeModuleSet(qrcode, x, y, value);
+                    if (QrCodeCalculateMask(m, x, y)) qrcodeMaskRows[m][y][x >> 6] |= (uint64_t)1 << (x & 63);
                 }
             }
         }
+        QrCodeOnceEnd(&qrcodeMaskRowsOnce);
     }
+    return (const uint64_t (*)[QRCODE_BOARD_WORDS])qrcodeMaskRows[maskPattern & ((1 << QRCODE_SIZE_MASK) - 1)];
 }
 
-static void QrCodeCursorReset(qrcode_t* qrcode, int* x, int* y)
+// XOR the mask pattern over the content modules (applying the same mask again removes it)
+static void QrCodeApplyMask(qrcode_board_t *board, const uint64_t *contentBoard, qrcode_mask_pattern_t maskPattern)
 {
-    *x = qrcode->dimension - 1;
-    *y = qrcode->dimension - 1;
+    const uint64_t (*maskRows)[QRCODE_BOARD_WORDS] = QrCodeMaskRows(maskPattern);
+    int words = (board->dimension + 63) >> 6;
+    for (int y = 0; y < board->dimension; y++)
+    {
+        const uint64_t *pattern = maskRows[y % QRCODE_MASK_ROW_PERIOD];
+        const uint64_t *content = contentBoard + (size_t)y * QRCODE_BOARD_WORDS;
+        uint64_t *row = board->rows + (size_t)y * QRCODE_BOARD_WORDS;
+        for (int w = 0; w < words; w++) row[w] ^= pattern[w] & content[w];
+    }
 }
 
-static bool QrCodeCursorAdvance(qrcode_t* qrcode, int* x, int* y)
+// Pack the board into the code buffer (dimension * dimension bits, most-significant bit first, no row padding)
+static void QrCodeBoardPack(const qrcode_board_t *board, const qrcode_layout_t *layout, uint8_t *buffer, size_t bufferSize)
 {
-    while (*x >= 0)
+    int dimension = board->dimension;
+#ifdef QR_DEBUG_DUMP
+    // One byte per module, tagged with the bit index of codewords, format and version information for QrCodeDebugDump()
+    for (int y = 0; y < dimension; y++)
     {
-        // Right-hand side of 2-module column? (otherwise, left-hand side)
-        if ((*x & 1) ^ (*x > QRCODE_TIMING_OFFSET ? 1 : 0))
+        for (int x = 0; x < dimension; x++)
         {
-            (*x)--;
+            int offset = y * dimension + x;
+            uint8_t entry = layout->partMap[offset];
+            int index = QRCODE_PART_MAP_INDEX(entry);
+            int tag = 0;
+            if (QRCODE_PART_MAP_PART(entry) == QRCODE_PART_FORMAT) tag = (index < 0) ? 40 + 19 : 40 + index;
+            if (QRCODE_PART_MAP_PART(entry) == QRCODE_PART_VERSION) tag = 60 + index;
+            buffer[offset] = (uint8_t)((tag << 1) | QrCodeBoardGet(board, x, y));
         }
-        else // Left-hand side
+    }
+    size_t codewordBits = QRCODE_TOTAL_CAPACITY((dimension - 17) / 4) & ~(size_t)7;
+    for (size_t i = 0; i < codewordBits; i++)
+    {
+        int x = layout->placement[i] % QRCODE_BOARD_STRIDE;
+        int y = layout->placement[i] / QRCODE_BOARD_STRIDE;
+        buffer[y * dimension + x] |= (((i / 8) & 1 ? 20 : 0) + (7 - (i & 7))) << 1;
+    }
+#else
+    (void)layout;
+    memset(buffer, 0, bufferSize);
+    size_t bitPosition = 0;
+    for (int y = 0; y < dimension; y++)
+    {
+        const uint64_t *row = board->rows + (size_t)y * QRCODE_BOARD_WORDS;
+        for (int x = 0; x < dimension; x += 8, bitPosition += 8)
         {
-            (*x)++;
-            // Upwards? (otherwise, downwards)
-            if (((*x - (*x > QRCODE_TIMING_OFFSET ? 1 : 0)) / 2) & 1)
-            {
-                if (*y <= 0) *x -= 2;
-                else (*y)--;
-            }
-            else
-            {
-                if (*y >= qrcode->dimension - 1) *x -= 2;
-                else (*y)++;
-            }
+            // Next 8 modules, reversed to most-significant first, then written across (up to) two bytes
+            uint8_t bits = (uint8_t)(row[x >> 6] >> (x & 63));
+            if (dimension - x < 8) bits &= (1 << (dimension - x)) - 1;
+            bits = (uint8_t)(((bits * 0x0802LU & 0x22110LU) | (bits * 0x8020LU & 0x88440LU)) * 0x10101LU >> 16);
+            unsigned int value = (unsigned int)bits << (8 - (bitPosition & 7));
+            buffer[bitPosition >> 3] |= (uint8_t)(value >> 8);
+            if ((bitPosition >> 3) + 1 < bufferSize) buffer[(bitPosition >> 3) + 1] |= (uint8_t)value;
+        }
+        bitPosition -= (8 - (dimension & 7)) & 7;   // Partial last group
+    }
+#endif
+}
+
+// Load the board from the code buffer
+static void QrCodeBoardLoad(qrcode_board_t *board, qrcode_t *qrcode)
+{
+    memset(board, 0, sizeof(*board));
+    board->dimension = qrcode->dimension;
+    for (int y = 0; y < qrcode->dimension; y++)
+    {
+        for (int x = 0; x < qrcode->dimension; x++)
+        {
+            QrCodeBoardSet(board, x, y, QrCodeModuleGet(qrcode, x, y) & 1);
         }
-        if (QrCodeIdentifyModule(qrcode, *x, *y, NULL) == QRCODE_PART_CONTENT) return true;
     }
-    return false;
 }
 
 // Total number of data bits from segments in the QR Code
@@ -621,32 +1729,58 @@ static size_t QrCodeBitsUsed(qrcode_t *qrcode)
     return sizeBits;
 }
 
+// Smallest version (up to maxVersion) that fits the segments at the error correction level, and the bits used (0=none fit): one pass over the segments, then a binary search of the capacities in the first band that fits
+static int QrCodeVersionFit(qrcode_t *qrcode, int maxVersion, size_t *sizeBits)
+{
+    size_t bandBits[QRCODE_VERSION_BANDS] = { 0 };
+    for (qrcode_segment_t* seg = qrcode->firstSegment; seg != NULL; seg = seg->next)
+    {
+        for (int band = 0; band < QRCODE_VERSION_BANDS; band++) bandBits[band] += QrCodeSegmentSize(seg, qrcodeVersionBandFirst[band]);
+    }
+    const uint16_t *dataCodewords = qrcode_data_codewords[qrcode->errorCorrectionLevel];
+    for (int band = 0; band < QRCODE_VERSION_BANDS && qrcodeVersionBandFirst[band] <= maxVersion; band++)
+    {
+        int low = qrcodeVersionBandFirst[band];
+        int high = qrcodeVersionBandFirst[band + 1] - 1;
+        if (high > maxVersion) high = maxVersion;
+        if ((size_t)dataCodewords[high] * 8 < bandBits[band]) continue;
+        // Capacity increases with version
+        while (low < high)
+        {
+            int middle = (low + high) / 2;
+            if ((size_t)dataCodewords[middle] * 8 >= bandBits[band]) high = middle; else low = middle + 1;
+        }
+        *sizeBits = bandBits[band];
+        return low;
+    }
+    return 0;
+}
+
 // Set version
 static bool QrCodePrepare(qrcode_t* qrcode)
 {
-    if (qrcode->prepared && qrcode->dimension <= 0) return false;   // does not fit
-    if (qrcode->prepared) return true;
-    int spareCapacity = -1;
+    if (qrcode->prepared) return qrcode->dimension > 0;
     qrcode->dimension = 0;
+    qrcode->bufferSize = 0;
+    qrcode->scratchBufferSize = 0;
     // Find the smallest version that will fit
     if (qrcode->version == QRCODE_VERSION_AUTO)
     {
-        for (qrcode->version = QRCODE_VERSION_MIN; qrcode->version <= qrcode->maxVersion; qrcode->version++)
-        {
-            qrcode->sizeBits = QrCodeBitsUsed(qrcode);
-            qrcode->dataCapacity = QrCodeDataCapacity(qrcode->version, qrcode->errorCorrectionLevel);
-            spareCapacity = (int)qrcode->dataCapacity - (int)qrcode->sizeBits;
-            if (spareCapacity >= 0) break;
-        }
-        if (spareCapacity < 0) return false;  // Chosen version / none fit
+        int maxVersion = qrcode->maxVersion < QRCODE_VERSION_MAX ? qrcode->maxVersion : QRCODE_VERSION_MAX;
+        size_t sizeBits = 0;
+        int version = QrCodeVersionFit(qrcode, maxVersion, &sizeBits);
+        if (version == 0) return false;  // None fit (the version stays automatic)
+        qrcode->version = version;
+        qrcode->sizeBits = sizeBits;
+        qrcode->dataCapacity = QrCodeDataCapacity(qrcode->version, qrcode->errorCorrectionLevel);
     }
     else
     {
         // Check the requested version
+        if (qrcode->version < QRCODE_VERSION_MIN || qrcode->version > QRCODE_VERSION_MAX) return false;
         qrcode->sizeBits = QrCodeBitsUsed(qrcode);
         qrcode->dataCapacity = QrCodeDataCapacity(qrcode->version, qrcode->errorCorrectionLevel);
-        spareCapacity = (int)qrcode->dataCapacity - (int)qrcode->sizeBits;
-        if (spareCapacity < 0) return false;  // Chosen version / none fit
+        if (qrcode->sizeBits > qrcode->dataCapacity) return false;  // Chosen version does not fit
     }
 
     // Cache dimension for the chosen version
@@ -659,6 +1793,9 @@ static bool QrCodePrepare(qrcode_t* qrcode)
 #endif
 
     // Allowed to try to find a better correction level
+#ifdef QRCODE_STATS
+    if (qrcode->stats) qrcode->stats->requestedErrorCorrectionLevel = qrcode->errorCorrectionLevel;
+#endif
     if (qrcode->optimizeEcc)
     {
         // Ranking of ECC levels to try
@@ -672,9 +1809,8 @@ static bool QrCodePrepare(qrcode_t* qrcode)
             {
                 // Try the better ECC
                 size_t dataCapacity = QrCodeDataCapacity(qrcode->version, ranking[i]);
-                spareCapacity = (int)dataCapacity - (int)qrcode->sizeBits;
                 // Does this better ECC level fit?
-                if (spareCapacity >= 0)
+                if (dataCapacity >= qrcode->sizeBits)
                 {
                     qrcode->dataCapacity = dataCapacity;
                     qrcode->errorCorrectionLevel = ranking[i];
@@ -683,6 +1819,10 @@ static bool QrCodePrepare(qrcode_t* qrcode)
         }
     }
 
+#ifdef QRCODE_STATS
+    if (qrcode->stats) qrcode->stats->eclUpgraded = (qrcode->errorCorrectionLevel != qrcode->stats->requestedErrorCorrectionLevel);
+#endif
+
     // Required size of scratch buffer
     qrcode->scratchBufferSize = QRCODE_SCRATCH_BUFFER_SIZE(qrcode->version);
 #ifdef QR_DEBUG_DUMP
@@ -702,17 +1842,67 @@ int QrCodeSize(qrcode_t* qrcode, size_t* bufferSize, size_t* scratchBufferSize)
 }
 
 // --- Reed-Solomon Error-Correction Code ---
+// GF(2^8/0x011D) antilog table (powers of 0x02; repeated so the sum of two logs needs no modulo)
+static const uint8_t qrcode_gf_exp[512] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+    0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+    0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+    0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+    0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+    0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+    0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+    0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+    0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+    0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+    0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+    0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+    0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+    0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+    0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+    0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+    0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+    0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+    0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+    0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+    0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+    0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+    0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+    0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+    0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+    0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+    0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+    0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+    0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+    0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+    0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+    0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02,
+};
+
+// GF(2^8/0x011D) log table (log of 0 is undefined)
+static const uint8_t qrcode_gf_log[256] = {
+    0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+    0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+    0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+    0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9, 0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+    0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd, 0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+    0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd, 0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+    0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e, 0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+    0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b, 0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+    0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d, 0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+    0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c, 0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+    0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd, 0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+    0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e, 0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+    0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76, 0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+    0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa, 0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+    0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+    0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
+};
+
 // Product modulo GF(2^8/0x011D)
-// These error-correction functions are from https://www.nayuki.io/page/qr-code-generator-library Copyright (c) Project Nayuki. (MIT License)
 static uint8_t QrCodeRSMultiply(uint8_t a, uint8_t b)
 {
-    uint8_t value = 0;
-    for (int i = 7; i >= 0; i--)
-    {
-        value = (uint8_t)((value << 1) ^ ((value >> 7) * 0x011D));
-        value ^= ((b >> i) & 1) * a;
-    }
-    return value;
+    if (a == 0 || b == 0) return 0;
+    return qrcode_gf_exp[qrcode_gf_log[a] + qrcode_gf_log[b]];
 }
 
 // Reed-Solomon ECC generator polynomial for given degree.
@@ -736,133 +1926,313 @@ void QrCodeRSDivisor(int degree, uint8_t result[])
     }
 }
 
-// Reed-Solomon ECC.
-// These error-correction functions are from https://www.nayuki.io/page/qr-code-generator-library Copyright (c) Project Nayuki. (MIT License)
-static void QrCodeRSRemainder(const uint8_t data[], size_t dataLen, const uint8_t generator[], int degree, uint8_t result[])
+// Cached generator polynomials for every degree, as logs of the coefficients (which are never zero)
+static uint8_t qrcodeRSGeneratorLogs[QRCODE_ECC_CODEWORDS_MAX + 1][QRCODE_ECC_CODEWORDS_MAX];
+static volatile long qrcodeRSGeneratorOnce;
+
+static const uint8_t *QrCodeRSGeneratorLog(int degree)
 {
-    memset(result, 0, (size_t)degree * sizeof(result[0]));
-    for (size_t i = 0; i < dataLen; i++)
+    if (QrCodeOnceBegin(&qrcodeRSGeneratorOnce))
     {
-        uint8_t factor = data[i] ^ result[0];
-        memmove(&result[0], &result[1], ((size_t)degree - 1) * sizeof(result[0]));
-        result[degree - 1] = 0;
-        for (int j = 0; j < degree; j++)
+        for (int d = 1; d <= QRCODE_ECC_CODEWORDS_MAX; d++)
         {
-            result[j] ^= QrCodeRSMultiply(generator[j], factor);
+            uint8_t divisor[QRCODE_ECC_CODEWORDS_MAX];
+            QrCodeRSDivisor(d, divisor);
+            for (int j = 0; j < d; j++) qrcodeRSGeneratorLogs[d][j] = qrcode_gf_log[divisor[j]];
         }
+        QrCodeOnceEnd(&qrcodeRSGeneratorOnce);
     }
+    return qrcodeRSGeneratorLogs[degree];
 }
 
-size_t QrCodeCursorWrite(qrcode_t *qrcode, int *cursorX, int *cursorY, uint8_t *buffer, size_t sourceBit, size_t countBits)
+// Reed-Solomon ECC remainder, as an LFSR over a circular register (no shifting of the register for each data byte)
+static void QrCodeRSRemainder(const uint8_t data[], size_t dataLen, const uint8_t generatorLog[], int degree, uint8_t result[])
 {
-    size_t index = sourceBit;
-    for (size_t countWritten = 0; countWritten < countBits; countWritten++)
+    uint8_t reg[QRCODE_ECC_CODEWORDS_MAX];
+    memset(reg, 0, (size_t)degree * sizeof(reg[0]));
+    int head = 0;   // reg[head] is the highest-order remainder coefficient
+    for (size_t i = 0; i < dataLen; i++)
     {
-        int bit = QrCodeBufferRead(buffer, index);
-#ifdef QR_DEBUG_DUMP
-        bit = (((qrWritingCodeword & 1 ? 20 : 0) + ((int)countBits - 1 - countWritten)) << 1) | bit; // for debug
-#endif
-        QrCodeModuleSet(qrcode, *cursorX, *cursorY, bit);
-        index++;
-        if (!QrCodeCursorAdvance(qrcode, cursorX, cursorY)) break;
+        uint8_t factor = data[i] ^ reg[head];
+        reg[head] = 0;
+        if (++head >= degree) head = 0;
+        if (factor == 0) continue;
+        const uint8_t *product = qrcode_gf_exp + qrcode_gf_log[factor];
+        // Coefficients from the head to the end of the register, then wrapped around to the start
+        int split = degree - head;
+        for (int j = 0; j < split; j++) reg[head + j] ^= product[generatorLog[j]];
+        for (int j = split; j < degree; j++) reg[j - split] ^= product[generatorLog[j]];
+    }
+    for (int j = 0; j < degree; j++)
+    {
+        result[j] = reg[head];
+        if (++head >= degree) head = 0;
     }
-    return index - sourceBit;
 }
 
-int QrCodeEvaluatePenalty(qrcode_t *qrcode)
+// Write a codeword to its modules (MSB first) from the placement table
+static void QrCodePlaceCodeword(qrcode_board_t *board, const uint16_t *placement, uint8_t codeword)
 {
-    // Note: Penalty calculated over entire code
-    const int scoreN1 = 3;
-    const int scoreN2 = 3;
-    const int scoreN3 = 40;
-    const int scoreN4 = 10;
-    int totalPenalty = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t bit = (codeword >> (7 - i)) & 1;
+        board->rows[placement[i] >> 6] |= bit << (placement[i] & 63);
+    }
+}
 
-    // Feature 1: Adjacent identical modules in row/column: (5 + i) count, penalty points: N1 + i
-    // Feature 3: 1:1:3:1:1 ratio patterns (either polarity) in row/column, penalty points: N3
-    for (int swapAxis = 0; swapAxis <= 1; swapAxis++)
+// Transpose a 64x64 bit block in place (bit j of a[i] swaps with bit i of a[j])
+static void QrCodeTranspose64(uint64_t a[64])
+{
+    uint64_t m = 0x00000000ffffffffull;
+    for (int j = 32; j != 0; j >>= 1, m ^= m << j)
     {
-        int runs[5];
-        int runsCount = 0;
-        for (int y = 0; y < qrcode->dimension; y++)
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j)
         {
-            int lastBit = -1;
-            int runLength = 0;
-            for (int x = 0; x < qrcode->dimension; x++)
-            {
-                int bit = QrCodeModuleGet(qrcode, swapAxis ? y : x, swapAxis ? x : y);
-                // Run extended
-                if (bit == lastBit) runLength++;
-                // End of run
-                if (bit != lastBit || x >= qrcode->dimension - 1)
-                {
-                    // If not start condition
-                    if (lastBit >= 0)
-                    {
-                        // Feature 1
-                        if (runLength >= 5) // or should this be strictly greater-than?
-                        {
-                            totalPenalty += scoreN1 + (runLength - 5);
-                        }
-
-                        // Feature 3
-                        runsCount++;
-                        runs[runsCount % 5] = runLength;
-                        // Once we have a history of 5 lengths, check proportion
-                        if (runsCount >= 5)
-                        {
-                            // Proportion:             1 : 1 : 3 : 1 : 1
-                            // Modulo relative index: +3, +4,  0, +1, +2
-                            // Check for proportions
-                            int v = runs[(runsCount + 1) % 5];
-                            if (runs[runsCount % 5] == 3 * v && v == runs[(runsCount + 2) % 5] && v == runs[(runsCount + 3) % 5] && v == runs[(runsCount + 4) % 5])
-                            {
-                                totalPenalty += scoreN3;
-                            }
-                        }
-                    }
-                    runLength = 1;
-                    lastBit = bit;
-                }
-            }
+            uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k] ^= t << j;
+            a[k | j] ^= t;
+        }
+    }
+}
+
+// Transposed copy of the board (rows become columns)
+static void QrCodeBoardTranspose(const qrcode_board_t *board, qrcode_board_t *transposed)
+{
+    int dimension = board->dimension;
+    int words = (dimension + 63) >> 6;
+    transposed->dimension = dimension;
+    memset(transposed->rows, 0, (size_t)dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+    for (int by = 0; by < words; by++)
+    {
+        for (int bx = 0; bx < words; bx++)
+        {
+            uint64_t block[64];
+            for (int i = 0; i < 64; i++) block[i] = (by * 64 + i < dimension) ? board->rows[(size_t)(by * 64 + i) * QRCODE_BOARD_WORDS + bx] : 0;
+            QrCodeTranspose64(block);
+            for (int i = 0; i < 64 && bx * 64 + i < dimension; i++) transposed->rows[(size_t)(bx * 64 + i) * QRCODE_BOARD_WORDS + by] = block[i];
         }
     }
+}
+
+#define QRCODE_PENALTY_N1 3     // Feature 1: Adjacent identical modules in row/column: (5 + i) count, penalty points: N1 + i
+#define QRCODE_PENALTY_N2 3     // Feature 2: Block of identical modules: m * n size, penalty points: N2 * (m-1) * (n-1)
+#define QRCODE_PENALTY_N3 40    // Feature 3: 1:1:3:1:1 ratio patterns (either polarity) in row/column, penalty points: N3
+#define QRCODE_PENALTY_N4 10    // Feature 4: Dark module percentage: 50 +|- (5*k) to 50 +|- (5*(k+1)), penalty points: N4 * k
+
+// History of the last five run lengths for feature 3, oldest first (continues from one row/column to the next)
+typedef struct
+{
+    int runs[5];
+} qrcode_run_history_t;
+
+static int QrCodeRunPenalty(qrcode_run_history_t *history, int runLength)
+{
+    int *runs = history->runs;
+    runs[0] = runs[1];
+    runs[1] = runs[2];
+    runs[2] = runs[3];
+    runs[3] = runs[4];
+    runs[4] = runLength;
+    // Proportion 1 : 1 : 3 : 1 : 1 -- as originally scored, matched as four equal runs followed by one three times as long
+    // (the initial zero lengths never match, as a run is at least one module)
+    if (runLength == 3 * runs[0] && runs[0] == runs[1] && runs[0] == runs[2] && runs[0] == runs[3])
+    {
+        return QRCODE_PENALTY_N3;
+    }
+    return 0;
+}
+
+// Features 1 and 3 for one row (or column, from the transposed board)
+static int QrCodeLinePenalty(const uint64_t *line, int dimension, qrcode_run_history_t *history)
+{
+    int words = (dimension + 63) >> 6;
+    int penalty = 0;
+
+    // Bit x: module x is the same as module x+1 (x < dimension - 1)
+    uint64_t same[QRCODE_BOARD_WORDS];
+    uint64_t change[QRCODE_BOARD_WORDS];
+    for (int w = 0; w < words; w++)
+    {
+        uint64_t next = QrCodeNextModules(line, w, words);
+        uint64_t valid = QrCodeLowBits(dimension - 1 - 64 * w);
+        same[w] = ~(line[w] ^ next) & valid;
+        change[w] = (line[w] ^ next) & valid;
+    }
 
-    // Feature 2: Block of identical modules: m * n size, penalty points: N2 * (m-1) * (n-1)
-    for (int y = 0; y < qrcode->dimension - 1; y++)
+    // Feature 1: bit x is set where modules x..x+4 are identical -- a run of length L sets (L-4) bits, and scores (L-4) + (N1-1)
+    uint64_t carry = 0;
+    for (int w = 0; w < words; w++)
     {
-        for (int x = 0; x < qrcode->dimension - 1; x++)
+        uint64_t run5 = same[w];
+        for (int k = 1; k <= 3; k++) run5 &= (same[w] >> k) | (w + 1 < words ? same[w + 1] << (64 - k) : 0);
+        uint64_t starts = run5 & ~((run5 << 1) | carry);
+        carry = run5 >> 63;
+        penalty += QrCodePopCount(run5) + (QRCODE_PENALTY_N1 - 1) * QrCodePopCount(starts);
+    }
+
+    // Feature 3: run lengths from the changes between modules
+    // (the final run is only counted if it is longer than one module)
+    int start = 0;
+    for (int w = 0; w < words; w++)
+    {
+        for (uint64_t bits = change[w]; bits != 0; bits &= bits - 1)
         {
-            int bits = QrCodeModuleGet(qrcode, x, y);
-            bits += QrCodeModuleGet(qrcode, x+1, y);
-            bits += QrCodeModuleGet(qrcode, x, y+1);
-            bits += QrCodeModuleGet(qrcode, x+1, y+1);
-            if (bits == 0 || bits == 4) totalPenalty += scoreN2;
+            int x = 64 * w + QrCodeTrailingZeros(bits);
+            penalty += QrCodeRunPenalty(history, x + 1 - start);
+            start = x + 1;
         }
     }
+    if (dimension - start > 1) penalty += QrCodeRunPenalty(history, dimension - start);
+
+    return penalty;
+}
+
+// Penalty calculated over entire code, word-parallel over the board rows (and the rows of the transposed board for columns).
+// With a layout, the uniform 2x2 blocks of fixed modules are taken from the layout.  Once the score reaches 'limit' (if >= 0), stops early and returns the partial score.
+// A 'fast' evaluation scores features 1 and 3 on the rows only.
+static int QrCodeBoardEvaluatePenalty(const qrcode_board_t *board, const qrcode_layout_t *layout, int limit, bool fast)
+{
+    int dimension = board->dimension;
+    int words = (dimension + 63) >> 6;
+    int totalPenalty = 0;
 
-    // Feature 4: Dark module percentage: 50 +|- (5*k) to 50 +|- (5*(k+1)), penalty points: N4 * k
+    // Feature 4: Dark module percentage
     {
         int32_t darkCount = 0;
-        for (int y = 0; y < qrcode->dimension; y++)
+        for (int i = 0; i < dimension * QRCODE_BOARD_WORDS; i++)
         {
-            for (int x = 0; x < qrcode->dimension; x++)
-            {
-                int bit = QrCodeModuleGet(qrcode, x, y);
-                if (bit == QRCODE_MODULE_DARK) darkCount++;
-            }
+            darkCount += QrCodePopCount(board->rows[i]);
         }
         // Deviation from 50%
-        int percentage = (int)((100 * darkCount + (qrcode->dimension * qrcode->dimension / 2)) / (qrcode->dimension * qrcode->dimension));
+        int percentage = (int)((100 * darkCount + (dimension * dimension / 2)) / (dimension * dimension));
         int deviation = abs(percentage - 50);
         int rating = deviation / 5;
-        int penalty = scoreN4 * rating;
+        int penalty = QRCODE_PENALTY_N4 * rating;
         totalPenalty += penalty;
     }
 
+    // Feature 2: Block of identical modules: all-dark (AND) or all-light (NOR) of each module with its right, lower and diagonal neighbours
+    {
+        int blocks = layout ? layout->fixedBlocks : 0;
+        for (int y = 0; y < dimension - 1; y++)
+        {
+            const uint64_t *a = board->rows + (size_t)y * QRCODE_BOARD_WORDS;
+            const uint64_t *b = a + QRCODE_BOARD_WORDS;
+            for (int w = 0; w < words; w++)
+            {
+                uint64_t valid = layout ? layout->blockBoard[(size_t)y * QRCODE_BOARD_WORDS + w] : QrCodeLowBits(dimension - 1 - 64 * w);
+                if (valid == 0) continue;
+                uint64_t a1 = QrCodeNextModules(a, w, words);
+                uint64_t b1 = QrCodeNextModules(b, w, words);
+                uint64_t dark = a[w] & b[w] & a1 & b1;
+                uint64_t light = ~(a[w] | b[w] | a1 | b1);
+                blocks += QrCodePopCount((dark | light) & valid);
+            }
+        }
+        totalPenalty += QRCODE_PENALTY_N2 * blocks;
+    }
+    if (limit >= 0 && totalPenalty >= limit) return totalPenalty;
+
+    // Feature 1: Adjacent identical modules in row/column
+    // Feature 3: 1:1:3:1:1 ratio patterns in row/column
+    qrcode_board_t transposed;
+    for (int swapAxis = 0; swapAxis <= (fast ? 0 : 1); swapAxis++)
+    {
+        if (swapAxis) QrCodeBoardTranspose(board, &transposed);
+        const qrcode_board_t *lines = swapAxis ? &transposed : board;
+        qrcode_run_history_t history = { { 0 } };
+        for (int y = 0; y < dimension; y++)
+        {
+            totalPenalty += QrCodeLinePenalty(lines->rows + (size_t)y * QRCODE_BOARD_WORDS, dimension, &history);
+            if (limit >= 0 && totalPenalty >= limit) return totalPenalty;
+        }
+    }
+
     return totalPenalty;
 }
 
+int QrCodeEvaluatePenalty(qrcode_t *qrcode)
+{
+    qrcode_board_t board;
+    QrCodeBoardLoad(&board, qrcode);
+    return QrCodeBoardEvaluatePenalty(&board, NULL, -1, false);
+}
+
+
+// Scores mask candidates (first, first + step, ...) on a private copy of the unmasked board
+typedef struct
+{
+    qrcode_t *qrcode;
+    const qrcode_board_t *board;
+    const qrcode_layout_t *layout;
+    bool fast;          // Heuristic scoring (QRCODE_MASK_FAST)
+    int first;
+    int step;
+    int *penalties;     // One entry per mask pattern (each written by only one worker)
+} qrcode_mask_job_t;
+
+static void QrCodeMaskJob(void *argument)
+{
+    qrcode_mask_job_t *job = (qrcode_mask_job_t *)argument;
+    qrcode_board_t board;
+    board.dimension = job->board->dimension;
+    memcpy(board.rows, job->board->rows, (size_t)board.dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
+    int lowestPenalty = -1;
+    for (int maskPattern = job->first; maskPattern <= QRCODE_MASK_111; maskPattern += job->step)
+    {
+        // XOR mask pattern
+        QrCodeApplyMask(&board, job->layout->contentBoard, maskPattern);
+        // Write format information
+        uint16_t formatInfo = QrCodeCalcFormatInfo(job->qrcode, job->qrcode->errorCorrectionLevel, maskPattern);
+        QrCodeDrawFormatInfo(&board, formatInfo);
+
+        // Find penalty score for this mask pattern -- abandoned (partial score) once it cannot beat this worker's best so far, an earlier pattern that would win a tie
+        int penalty = QrCodeBoardEvaluatePenalty(&board, job->layout, lowestPenalty, job->fast);
+        job->penalties[maskPattern] = penalty;
+        if (lowestPenalty < 0 || penalty < lowestPenalty) lowestPenalty = penalty;
+
+        // XOR same mask removes it
+        QrCodeApplyMask(&board, job->layout->contentBoard, maskPattern);
+    }
+}
+
+// Choose the mask pattern with the lowest penalty (lowest pattern number on a tie; QRCODE_MASK_FAST: lowest heuristic penalty), optionally scoring the candidates of large codes on several threads
+static qrcode_mask_pattern_t QrCodeSelectMask(qrcode_t *qrcode, const qrcode_board_t *board, const qrcode_layout_t *layout)
+{
+    int penalties[QRCODE_MASK_111 + 1];
+    int workers = 1;
+#ifndef QRCODE_NO_THREADS
+    if (qrcode->version >= QRCODE_MASK_THREADS_MIN_VERSION && qrcode->maskThreads > 1)
+    {
+        workers = qrcode->maskThreads < QRCODE_MASK_THREADS_MAX ? qrcode->maskThreads : QRCODE_MASK_THREADS_MAX;
+    }
+#endif
+
+    qrcode_mask_job_t jobs[QRCODE_MASK_THREADS_MAX];
+    for (int i = 0; i < workers; i++)
+    {
+        jobs[i].qrcode = qrcode;
+        jobs[i].board = board;
+        jobs[i].layout = layout;
+        jobs[i].fast = (qrcode->maskPattern == QRCODE_MASK_FAST);
+        jobs[i].first = i;
+        jobs[i].step = workers;
+        jobs[i].penalties = penalties;
+    }
+
+    QrCodeRunWorkers(QrCodeMaskJob, jobs, sizeof(jobs[0]), workers);
+
+    // Lowest penalty, earliest pattern wins a tie
+    qrcode_mask_pattern_t bestMask = QRCODE_MASK_000;
+    for (int maskPattern = QRCODE_MASK_000 + 1; maskPattern <= QRCODE_MASK_111; maskPattern++)
+    {
+        if (penalties[maskPattern] < penalties[bestMask]) bestMask = maskPattern;
+    }
+#ifdef QRCODE_STATS
+    if (qrcode->stats) memcpy(qrcode->stats->maskPenalty, penalties, sizeof(penalties));
+#endif
+    return bestMask;
+}
 
 #ifdef QR_DEBUG_DUMP
 void QrCodeDebugDump(qrcode_t* qrcode)
@@ -935,7 +2305,7 @@ void dump_scratch(uint8_t* scratchBuffer, size_t numBits, char* label)
             uint8_t byte = scratchBuffer[i >> 3];
             printf(" %02x=", byte);
         }
-        bool bit = QrCodeBufferRead(scratchBuffer, i);
+        bool bit = (scratchBuffer[i >> 3] & (1 << (7 - (i & 7)))) ? 1 : 0;
         printf("%d", (int)bit);
     }
     printf("\n");
@@ -943,182 +2313,224 @@ void dump_scratch(uint8_t* scratchBuffer, size_t numBits, char* label)
 */
 
 
-// Generate the code
-bool QrCodeGenerate(qrcode_t* qrcode, uint8_t* buffer, uint8_t* scratchBuffer)
+// ECC block structure of the prepared code: data codewords are split into blocks, the earlier ones short by one codeword
+typedef struct
 {
-    if (!QrCodePrepare(qrcode)) return false;
+    int eccCodewords;       // ECC codewords per block
+    int eccBlockCount;
+    int countShortBlocks;
+    size_t dataLenShort;
+    size_t dataLenLong;
+    size_t eccOffset;       // Byte offset of the ECC codewords (after all data codewords)
+} qrcode_blocks_t;
+
+static void QrCodeBlocks(const qrcode_t *qrcode, qrcode_blocks_t *blocks)
+{
+    // ECC settings for the level and versions
+    blocks->eccCodewords = qrcode_ecc_block_codewords[qrcode->errorCorrectionLevel][qrcode->version];
+    blocks->eccBlockCount = qrcode_ecc_block_count[qrcode->errorCorrectionLevel][qrcode->version];
+    size_t totalCapacity = QRCODE_TOTAL_CAPACITY(qrcode->version);
 
-    // --- Generate final codewords ---
-    qrcode->scratchBuffer = scratchBuffer;
-    memset(qrcode->scratchBuffer, 0, qrcode->scratchBufferSize);
+    // Position in buffer for ECC data
+    blocks->eccOffset = (totalCapacity - ((size_t)8 * blocks->eccCodewords * blocks->eccBlockCount)) / 8;
 
-    // Write data segments
-    size_t bitPosition = 0;
+    size_t dataCapacityBytes = qrcode->dataCapacity / 8;
+    blocks->dataLenShort = dataCapacityBytes / blocks->eccBlockCount;
+    blocks->countShortBlocks = (int)(blocks->eccBlockCount - (dataCapacityBytes - (blocks->dataLenShort * blocks->eccBlockCount)));
+    blocks->dataLenLong = blocks->dataLenShort + (blocks->countShortBlocks >= blocks->eccBlockCount ? 0 : 1);
+}
+
+// Stage: clear the scratch buffer and write the data segments, returns the bit position after them
+static size_t QrCodeWriteSegments(qrcode_t *qrcode)
+{
+    memset(qrcode->scratchBuffer, 0, qrcode->scratchBufferSize);
+    qrcode_bit_writer_t writer;
+    QrCodeBitWriterInit(&writer, qrcode->scratchBuffer, 0);
     for (qrcode_segment_t* seg = qrcode->firstSegment; seg != NULL; seg = seg->next)
     {
-        bitPosition += QrCodeSegmentWrite(seg, qrcode->version, qrcode->scratchBuffer, bitPosition);
+        QrCodeSegmentWrite(seg, qrcode->version, &writer);
     }
+    QrCodeBitWriterFlush(&writer);
+    return QrCodeBitWriterPosition(&writer);
+}
+
+// Stage: terminator, round up to a whole byte, and fill the rest of the data capacity with pad codewords
+static void QrCodeWritePadding(qrcode_t *qrcode, size_t bitPosition)
+{
+    qrcode_bit_writer_t writer;
+    QrCodeBitWriterInit(&writer, qrcode->scratchBuffer, bitPosition);
 
     // Add terminator 4-bit (0b0000)
     size_t remaining = qrcode->dataCapacity - bitPosition;
     if (remaining > 4) remaining = 4;
-    bitPosition += QrCodeBufferAppend(qrcode->scratchBuffer, bitPosition, QRCODE_MODE_INDICATOR_TERMINATOR, remaining);
+    QrCodeBitWrite(&writer, QRCODE_MODE_INDICATOR_TERMINATOR, (int)remaining);
+    bitPosition += remaining;
 
     // Round up to a whole byte
     size_t bits = (8 - (bitPosition & 7)) & 7;
     remaining = qrcode->dataCapacity - bitPosition;
     if (remaining > bits) remaining = bits;
-    bitPosition += QrCodeBufferAppend(qrcode->scratchBuffer, bitPosition, 0, remaining);
+    QrCodeBitWrite(&writer, 0, (int)remaining);
+    bitPosition += remaining;
 
     // Fill any remaining data space with padding
     while ((remaining = qrcode->dataCapacity - bitPosition) > 0)
     {
         if (remaining > 16) remaining = 16;
-        bitPosition += QrCodeBufferAppend(qrcode->scratchBuffer, bitPosition, QRCODE_PAD_CODEWORDS >> (16 - remaining), remaining);
+        QrCodeBitWrite(&writer, QRCODE_PAD_CODEWORDS >> (16 - remaining), (int)remaining);
+        bitPosition += remaining;
     }
+    QrCodeBitWriterFlush(&writer);
+}
 
-    // --- Calculate ECC at end of codewords ---
-    // ECC settings for the level and versions
-    int eccCodewords = qrcode_ecc_block_codewords[qrcode->errorCorrectionLevel][qrcode->version];
-    int eccBlockCount = qrcode_ecc_block_count[qrcode->errorCorrectionLevel][qrcode->version];
-    size_t totalCapacity = QRCODE_TOTAL_CAPACITY(qrcode->version);
-
-    // Position in buffer for ECC data
-    size_t eccOffset = (totalCapacity - ((size_t)8 * eccCodewords * eccBlockCount)) / 8;
-    //if ((bitPosition != 8 * eccOffset) || (bitPosition != qrcode->dataCapacity) || (qrcode->dataCapacity != 8 * eccOffset)) printf("ERROR: Expected current bit position (%d) to match ECC offset *8 (%d) and data capacity (%d).\n", (int)bitPosition, (int)eccOffset * 8, (int)qrcode->dataCapacity);
-
-        // Calculate Reed-Solomon divisor
-    uint8_t eccDivisor[QRCODE_ECC_CODEWORDS_MAX];
-    QrCodeRSDivisor(eccCodewords, eccDivisor);
+// Stage: calculate the ECC of each block -- written consecutively after the data (interleaved on placement)
+static void QrCodeWriteEcc(qrcode_t *qrcode, const qrcode_blocks_t *blocks)
+{
+    // Reed-Solomon divisor (cached)
+    const uint8_t *eccDivisorLog = QrCodeRSGeneratorLog(blocks->eccCodewords);
 
-    // Calculate ECC for each block -- write all consecutively after the data (will be interleaved later)
-    size_t dataCapacityBytes = qrcode->dataCapacity / 8;
-    size_t dataLenShort = dataCapacityBytes / eccBlockCount;
-    int countShortBlocks = (int)(eccBlockCount - (dataCapacityBytes - (dataLenShort * eccBlockCount)));
-    size_t dataLenLong = dataLenShort + (countShortBlocks >= eccBlockCount ? 0 : 1);
-    for (int block = 0; block < eccBlockCount; block++)
+    for (int block = 0; block < blocks->eccBlockCount; block++)
     {
         // Calculate offset and length (earlier consecutive blocks may be short by 1 codeword)
         size_t dataOffset;
-        if (block < countShortBlocks)
+        if (block < blocks->countShortBlocks)
         {
-            dataOffset = block * dataLenShort;
+            dataOffset = block * blocks->dataLenShort;
         }
         else
         {
-            dataOffset = block * dataLenShort + ((size_t)block - countShortBlocks);
+            dataOffset = block * blocks->dataLenShort + ((size_t)block - blocks->countShortBlocks);
         }
-        size_t dataLen = dataLenShort + (block < countShortBlocks ? 0 : 1);
+        size_t dataLen = blocks->dataLenShort + (block < blocks->countShortBlocks ? 0 : 1);
         // Calculate this block's ECC
-        uint8_t* eccDest = qrcode->scratchBuffer + eccOffset + (block * (size_t)eccCodewords);
-        QrCodeRSRemainder(qrcode->scratchBuffer + dataOffset, dataLen, eccDivisor, eccCodewords, eccDest);
-    }
-
-    // --- Generate pattern ---
-    qrcode->buffer = buffer;
-    memset(qrcode->buffer, 0, qrcode->bufferSize);
-    QrCodeDrawFinder(qrcode, QRCODE_FINDER_SIZE / 2, QRCODE_FINDER_SIZE / 2);
-    QrCodeDrawFinder(qrcode, qrcode->dimension - 1 - QRCODE_FINDER_SIZE / 2, QRCODE_FINDER_SIZE / 2);
-    QrCodeDrawFinder(qrcode, QRCODE_FINDER_SIZE / 2, qrcode->dimension - 1 - QRCODE_FINDER_SIZE / 2);
-    QrCodeDrawTiming(qrcode);
-    for (int hi = 0, h; (h = QrCodeAlignmentCoordinates(qrcode->version, hi)) > 0; hi++)
-    {
-        for (int vi = 0, v; (v = QrCodeAlignmentCoordinates(qrcode->version, vi)) > 0; vi++)
-        {
-            if (h <= QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;                           // Obscured by top-left finder
-            if (h >= qrcode->dimension - 1 - QRCODE_FINDER_SIZE && v <= QRCODE_FINDER_SIZE) continue;   // Obscured by top-right finder
-            if (h <= QRCODE_FINDER_SIZE && v >= qrcode->dimension - 1 - QRCODE_FINDER_SIZE) continue;   // Obscured by bottom-left finder
-            QrCodeDrawAlignment(qrcode, h, v);
-        }
+        uint8_t* eccDest = qrcode->scratchBuffer + blocks->eccOffset + (block * (size_t)blocks->eccCodewords);
+        QrCodeRSRemainder(qrcode->scratchBuffer + dataOffset, dataLen, eccDivisorLog, blocks->eccCodewords, eccDest);
     }
+}
 
+// Stage: start from the function pattern template, and write the codewords interleaved between blocks (scattered to modules from the cached placement table)
+static void QrCodePlaceCodewords(const qrcode_t *qrcode, const qrcode_blocks_t *blocks, const qrcode_layout_t *layout, qrcode_board_t *board)
+{
+    board->dimension = qrcode->dimension;
+    memcpy(board->rows, layout->templateBoard, (size_t)board->dimension * QRCODE_BOARD_WORDS * sizeof(uint64_t));
 
-    // Write the codewords interleaved between blocks
-    int cursorX, cursorY;
-    QrCodeCursorReset(qrcode, &cursorX, &cursorY);
     size_t totalWritten = 0;
 
     // Write data codewords interleaved across ecc blocks -- some early blocks may be short
-    for (size_t i = 0; i < dataLenLong; i++)
+    for (size_t i = 0; i < blocks->dataLenLong; i++)
     {
-        for (int block = 0; block < eccBlockCount; block++)
+        for (int block = 0; block < blocks->eccBlockCount; block++)
         {
             // Calculate offset and length (earlier consecutive blocks may be short by 1 codeword)
             // Skip codewords due to short block
-            if (i >= dataLenShort && block < countShortBlocks) continue;
-            size_t codeword = (block * dataLenShort) + (block > countShortBlocks ? block - countShortBlocks : 0) + i;
-            size_t sourceBit = codeword * 8;
-            size_t countBits = 8;
-#ifdef QR_DEBUG_DUMP
-            qrWritingCodeword = ((i * eccBlockCount) + block) & 1;
-#endif
-            totalWritten += QrCodeCursorWrite(qrcode, &cursorX, &cursorY, qrcode->scratchBuffer, sourceBit, countBits);
+            if (i >= blocks->dataLenShort && block < blocks->countShortBlocks) continue;
+            size_t codeword = (block * blocks->dataLenShort) + (block > blocks->countShortBlocks ? block - blocks->countShortBlocks : 0) + i;
+            QrCodePlaceCodeword(board, layout->placement + totalWritten, qrcode->scratchBuffer[codeword]);
+            totalWritten += 8;
         }
     }
 
     // Write ECC codewords interleaved across ecc blocks
-    for (int i = 0; i < eccCodewords; i++)
+    for (int i = 0; i < blocks->eccCodewords; i++)
     {
-        for (int block = 0; block < eccBlockCount; block++)
+        for (int block = 0; block < blocks->eccBlockCount; block++)
         {
-            size_t sourceBit = 8 * eccOffset + (block * (size_t)eccCodewords * 8) + ((size_t)i * 8);
-            size_t countBits = 8;
-#ifdef QR_DEBUG_DUMP
-            qrWritingCodeword = ((i * eccBlockCount) + block + (dataLenLong * eccBlockCount)) & 1;
-#endif
-            totalWritten += QrCodeCursorWrite(qrcode, &cursorX, &cursorY, qrcode->scratchBuffer, sourceBit, countBits);
+            size_t codeword = blocks->eccOffset + (block * (size_t)blocks->eccCodewords) + (size_t)i;
+            QrCodePlaceCodeword(board, layout->placement + totalWritten, qrcode->scratchBuffer[codeword]);
+            totalWritten += 8;
         }
     }
-    //printf("*** dataCapacity=%d capacity=%d totalWritten=%d remainder=%d, eccOffset(bytes)=%d, eccCodewords=%d, eccBlockCount=%d, eccSize=%d, eccEnd=%d\n", (int)qrcode->dataCapacity, (int)totalCapacity, (int)totalWritten, (int)(totalCapacity - totalWritten), (int)eccOffset, (int)eccCodewords, (int)eccBlockCount, (int)(8 * eccCodewords * eccBlockCount), (int)((eccOffset * 8) + 8 * eccCodewords * eccBlockCount));
 
-        // Add any remainder 0 bits (could be 0/3/4/7)
-    while (totalWritten < totalCapacity)
+    // Any remainder bits (could be 0/3/4/7) are left light from the template
+}
+
+#ifdef QRCODE_STATS
+// Clear the stats for a new code (keeping the ECL outcome of an earlier preparation)
+static void QrCodeStatsReset(qrcode_t *qrcode)
+{
+    qrcode_stats_t *stats = qrcode->stats;
+    qrcode_error_correction_level_t requestedErrorCorrectionLevel = qrcode->prepared ? stats->requestedErrorCorrectionLevel : qrcode->errorCorrectionLevel;
+    bool eclUpgraded = qrcode->prepared ? stats->eclUpgraded : false;
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < (int)(sizeof(stats->maskPenalty) / sizeof(stats->maskPenalty[0])); i++) stats->maskPenalty[i] = -1;
+    stats->requestedErrorCorrectionLevel = requestedErrorCorrectionLevel;
+    stats->eclUpgraded = eclUpgraded;
+}
+
+// Record the outcome of generation
+static void QrCodeStatsResult(qrcode_t *qrcode)
+{
+    qrcode->stats->version = qrcode->version;
+    qrcode->stats->maskPattern = qrcode->maskPattern;
+    qrcode->stats->errorCorrectionLevel = qrcode->errorCorrectionLevel;
+}
+#endif
+
+// Generate the code
+bool QrCodeGenerate(qrcode_t* qrcode, uint8_t* buffer, uint8_t* scratchBuffer)
+{
+#ifdef QRCODE_STATS
+    if (qrcode->stats) QrCodeStatsReset(qrcode);
+#endif
+    QRCODE_STATS_START(qrcode);
+    if (!QrCodePrepare(qrcode)) return false;
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_PREPARE);
+
+    // --- Generate final codewords ---
+    qrcode->scratchBuffer = scratchBuffer;
+    size_t bitPosition = QrCodeWriteSegments(qrcode);
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_SEGMENTS);
+    QrCodeWritePadding(qrcode, bitPosition);
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_PADDING);
+
+    // --- Calculate ECC at end of codewords ---
+    qrcode_blocks_t blocks;
+    QrCodeBlocks(qrcode, &blocks);
+    QrCodeWriteEcc(qrcode, &blocks);
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_ECC);
+
+    // --- Generate pattern ---
+    const qrcode_layout_t *layout = QrCodeLayout(qrcode->version);
+    qrcode_board_t board;
+    QrCodePlaceCodewords(qrcode, &blocks, layout, &board);
+#ifdef QRCODE_STATS
+    if (qrcode->stats)
     {
-        QrCodeModuleSet(qrcode, cursorX, cursorY, 0);
-        totalWritten++;
-        if (!QrCodeCursorAdvance(qrcode, &cursorX, &cursorY)) break;
+        qrcode->stats->cursorSteps = layout->cursorSteps;
+        qrcode->stats->placementSteps = (uint32_t)(8 * (qrcode->dataCapacity / 8 + (size_t)blocks.eccCodewords * blocks.eccBlockCount));
     }
+#endif
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_PLACEMENT);
 
     // --- Mask pattern ---
-    if (qrcode->maskPattern == QRCODE_MASK_AUTO)
+    if (qrcode->maskPattern == QRCODE_MASK_AUTO || qrcode->maskPattern == QRCODE_MASK_FAST)
     {
-        int lowestPenalty = -1;
-        for (int maskPattern = QRCODE_MASK_000; maskPattern <= QRCODE_MASK_111; maskPattern++)
-        {
-            // XOR mask pattern
-            QrCodeApplyMask(qrcode, maskPattern);
-            // Write format information
-            uint16_t formatInfo = QrCodeCalcFormatInfo(qrcode, qrcode->errorCorrectionLevel, maskPattern);
-            QrCodeDrawFormatInfo(qrcode, formatInfo);
-
-            // Find penalty score for this mask pattern
-            int penalty = QrCodeEvaluatePenalty(qrcode);
-
-            // XOR same mask removes it
-            QrCodeApplyMask(qrcode, maskPattern);
-
-            // See if this is the best so far
-            if (lowestPenalty < 0 || penalty < lowestPenalty)
-            {
-                lowestPenalty = penalty;
-                qrcode->maskPattern = maskPattern;
-            }
-        }
+        qrcode->maskPattern = QrCodeSelectMask(qrcode, &board, layout);
     }
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_MASK_SELECTION);
 
     // Use selected mask
-    QrCodeApplyMask(qrcode, qrcode->maskPattern);
+    QrCodeApplyMask(&board, layout->contentBoard, qrcode->maskPattern);
 
     // Version info (V7+) (additional 36 modules, total 67 for format+version)
     if (qrcode->version >= 7)
     {
         uint32_t versionInfo = QrCodeCalcVersionInfo(qrcode, qrcode->version);
-        QrCodeDrawVersionInfo(qrcode, versionInfo);
+        QrCodeDrawVersionInfo(&board, versionInfo);
     }
 
     // Write format information
     uint16_t formatInfo = QrCodeCalcFormatInfo(qrcode, qrcode->errorCorrectionLevel, qrcode->maskPattern);
-    QrCodeDrawFormatInfo(qrcode, formatInfo);
+    QrCodeDrawFormatInfo(&board, formatInfo);
+
+    // Pack the modules into the output buffer
+    qrcode->buffer = buffer;
+    QrCodeBoardPack(&board, layout, qrcode->buffer, qrcode->bufferSize);
+    QRCODE_STATS_STAGE(qrcode, QRCODE_STAGE_FINISH);
+    QRCODE_STATS_END(qrcode);
+#ifdef QRCODE_STATS
+    if (qrcode->stats) QrCodeStatsResult(qrcode);
+#endif
 
 #ifdef QR_DEBUG_DUMP
     QrCodeDebugDump(qrcode);
@@ -1126,3 +2538,469 @@ bool QrCodeGenerate(qrcode_t* qrcode, uint8_t* buffer, uint8_t* scratchBuffer)
 
     return true;
 }
+
+// --- Cache of generated codes ---
+// Entry: key hashes, LRU and bucket-chain links (-1=none), and the generated result
+typedef struct
+{
+    uint64_t hash[2];
+    int32_t prev;
+    int32_t next;
+    int32_t chain;
+    int8_t maskPattern;
+    size_t bufferSize;
+    uint8_t *modules;
+    size_t keyLength;
+    uint8_t *key;               // Compared in full on a hash match
+} qrcode_cache_entry_t;
+
+// Independently locked part of the cache
+typedef struct
+{
+    volatile long lock;
+    int32_t head;               // Most recently used
+    int32_t tail;               // Least recently used (evicted next when full)
+    int32_t used;
+    uint64_t hits;
+    uint64_t misses;
+    int32_t *buckets;
+    qrcode_cache_entry_t *entries;
+} qrcode_cache_shard_t;
+
+#define QRCODE_CACHE_ALIGN(_n) (((_n) + 7) & ~(size_t)7)
+
+// Key bytes for a code that fits in a version: segments take at least 12 bits for their 4 key bytes, digits 10/3 bits per byte, so at most one byte per 3 bits of capacity (and the 4 settings)
+#define QRCODE_CACHE_KEY_BYTES(_v) (4 + QRCODE_TOTAL_CAPACITY(_v) / 3)
+
+static void QrCodeLock(volatile long *lock)
+{
+    for (int spins = 0; !QrCodeOnceExchange(lock, 0, 1); spins++)
+    {
+#ifndef QRCODE_NO_THREADS
+        if (spins >= 64) QrCodeThreadYield();
+#endif
+    }
+}
+
+static void QrCodeUnlock(volatile long *lock)
+{
+    QrCodeOnceStore(lock, 0);
+}
+
+// Cache geometry for a number of entries
+static void QrCodeCacheGeometry(int entries, int maxVersion, int *shardCount, int *entriesPerShard, int *bucketsPerShard, size_t *moduleBytes, size_t *keyBytes)
+{
+    *shardCount = entries < QRCODE_CACHE_SHARDS ? (entries > 0 ? entries : 1) : QRCODE_CACHE_SHARDS;
+    *entriesPerShard = (entries + *shardCount - 1) / *shardCount;
+    if (*entriesPerShard < 1) *entriesPerShard = 1;
+    for (*bucketsPerShard = 1; *bucketsPerShard < *entriesPerShard; *bucketsPerShard <<= 1) { ; }
+    *moduleBytes = QRCODE_BUFFER_SIZE(maxVersion);
+#ifdef QR_DEBUG_DUMP
+    *moduleBytes *= 8;
+#endif
+    *keyBytes = QRCODE_CACHE_KEY_BYTES(maxVersion);
+}
+
+// Memory needed for a cache of the given number of entries, for codes up to maxVersion
+size_t QrCodeCacheMemorySize(int entries, int maxVersion)
+{
+    int shardCount, entriesPerShard, bucketsPerShard;
+    size_t moduleBytes, keyBytes;
+    QrCodeCacheGeometry(entries, maxVersion, &shardCount, &entriesPerShard, &bucketsPerShard, &moduleBytes, &keyBytes);
+    size_t shardSize = QRCODE_CACHE_ALIGN(bucketsPerShard * sizeof(int32_t)) + entriesPerShard * (sizeof(qrcode_cache_entry_t) + QRCODE_CACHE_ALIGN(moduleBytes) + QRCODE_CACHE_ALIGN(keyBytes));
+    return QRCODE_CACHE_ALIGN(shardCount * sizeof(qrcode_cache_shard_t)) + shardCount * shardSize;
+}
+
+// Initialize a cache in the caller's memory (at least QrCodeCacheMemorySize(), 8-byte aligned)
+bool QrCodeCacheInit(qrcode_cache_t *cache, void *memory, size_t memorySize, int entries, int maxVersion)
+{
+    memset(cache, 0, sizeof(qrcode_cache_t));
+    if (memory == NULL || entries <= 0 || maxVersion < QRCODE_VERSION_MIN || maxVersion > QRCODE_VERSION_MAX) return false;
+    if (memorySize < QrCodeCacheMemorySize(entries, maxVersion)) return false;
+    QrCodeCacheGeometry(entries, maxVersion, &cache->shardCount, &cache->entriesPerShard, &cache->bucketsPerShard, &cache->moduleBytes, &cache->keyBytes);
+    cache->maxVersion = maxVersion;
+
+    // Shards, then each shard's buckets, entries, and module and key storage
+    uint8_t *p = (uint8_t *)memory;
+    qrcode_cache_shard_t *shards = (qrcode_cache_shard_t *)p;
+    cache->shards = shards;
+    p += QRCODE_CACHE_ALIGN(cache->shardCount * sizeof(qrcode_cache_shard_t));
+    for (int s = 0; s < cache->shardCount; s++)
+    {
+        qrcode_cache_shard_t *shard = &shards[s];
+        memset(shard, 0, sizeof(qrcode_cache_shard_t));
+        shard->head = shard->tail = -1;
+        shard->buckets = (int32_t *)p;
+        for (int b = 0; b < cache->bucketsPerShard; b++) shard->buckets[b] = -1;
+        p += QRCODE_CACHE_ALIGN(cache->bucketsPerShard * sizeof(int32_t));
+        shard->entries = (qrcode_cache_entry_t *)p;
+        p += cache->entriesPerShard * sizeof(qrcode_cache_entry_t);
+        for (int e = 0; e < cache->entriesPerShard; e++)
+        {
+            shard->entries[e].modules = p;
+            p += QRCODE_CACHE_ALIGN(cache->moduleBytes);
+            shard->entries[e].key = p;
+            p += QRCODE_CACHE_ALIGN(cache->keyBytes);
+        }
+    }
+    return true;
+}
+
+// Hit and miss counts
+void QrCodeCacheStats(qrcode_cache_t *cache, uint64_t *hits, uint64_t *misses)
+{
+    uint64_t totalHits = 0, totalMisses = 0;
+    qrcode_cache_shard_t *shards = (qrcode_cache_shard_t *)cache->shards;
+    for (int s = 0; s < cache->shardCount; s++)
+    {
+        QrCodeLock(&shards[s].lock);
+        totalHits += shards[s].hits;
+        totalMisses += shards[s].misses;
+        QrCodeUnlock(&shards[s].lock);
+    }
+    if (hits != NULL) *hits = totalHits;
+    if (misses != NULL) *misses = totalMisses;
+}
+
+// Two independent 64-bit hashes (FNV-1a, and a multiply-xorshift) of data
+static void QrCodeCacheHash(uint64_t hash[2], const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash[0] = (hash[0] ^ bytes[i]) * 0x100000001b3ull;
+        hash[1] = (hash[1] ^ bytes[i]) * 0x9e3779b97f4a7c15ull;
+        hash[1] ^= hash[1] >> 29;
+    }
+}
+
+// Key: the segments (mode, 24-bit count and text) and the prepared version, ECL, requested mask and ECL optimization, with its hash; returns the key length (0 if longer than keySize)
+static size_t QrCodeCacheKey(const qrcode_t *qrcode, uint8_t *key, size_t keySize, uint64_t hash[2])
+{
+    size_t length = 0;
+    for (const qrcode_segment_t *seg = qrcode->firstSegment; seg != NULL; seg = seg->next)
+    {
+        size_t textLength = (seg->text != NULL) ? seg->charCount : 0;
+        if (seg->charCount > 0xffffff || length + 4 + textLength > keySize) return 0;
+        key[length++] = (uint8_t)seg->mode;
+        key[length++] = (uint8_t)seg->charCount;
+        key[length++] = (uint8_t)(seg->charCount >> 8);
+        key[length++] = (uint8_t)(seg->charCount >> 16);
+        if (textLength > 0) memcpy(key + length, seg->text, textLength);
+        length += textLength;
+    }
+    if (length + 4 > keySize) return 0;
+    key[length++] = (uint8_t)qrcode->version;
+    key[length++] = (uint8_t)qrcode->errorCorrectionLevel;
+    key[length++] = (uint8_t)qrcode->maskPattern;
+    key[length++] = qrcode->optimizeEcc ? 1 : 0;
+    hash[0] = 0xcbf29ce484222325ull;
+    hash[1] = 0x2545f4914f6cdd1dull;
+    QrCodeCacheHash(hash, key, length);
+    return length;
+}
+
+static int32_t QrCodeCacheFind(qrcode_cache_t *cache, qrcode_cache_shard_t *shard, const uint64_t hash[2], const uint8_t *key, size_t keyLength)
+{
+    for (int32_t i = shard->buckets[hash[0] & (uint64_t)(cache->bucketsPerShard - 1)]; i >= 0; i = shard->entries[i].chain)
+    {
+        const qrcode_cache_entry_t *entry = &shard->entries[i];
+        if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1] && entry->keyLength == keyLength && !memcmp(entry->key, key, keyLength)) return i;
+    }
+    return -1;
+}
+
+static void QrCodeCacheUnlink(qrcode_cache_shard_t *shard, int32_t index)
+{
+    qrcode_cache_entry_t *entry = &shard->entries[index];
+    if (entry->prev >= 0) shard->entries[entry->prev].next = entry->next; else shard->head = entry->next;
+    if (entry->next >= 0) shard->entries[entry->next].prev = entry->prev; else shard->tail = entry->prev;
+}
+
+static void QrCodeCacheLinkHead(qrcode_cache_shard_t *shard, int32_t index)
+{
+    qrcode_cache_entry_t *entry = &shard->entries[index];
+    entry->prev = -1;
+    entry->next = shard->head;
+    if (shard->head >= 0) shard->entries[shard->head].prev = index; else shard->tail = index;
+    shard->head = index;
+}
+
+// As QrCodeGenerate(), but reuses the modules of a previously generated identical code from the cache (NULL=no cache)
+bool QrCodeGenerateCached(qrcode_cache_t *cache, qrcode_t *qrcode, uint8_t *buffer, uint8_t *scratchBuffer)
+{
+    if (cache == NULL || cache->shards == NULL) return QrCodeGenerate(qrcode, buffer, scratchBuffer);
+    if (!QrCodePrepare(qrcode)) return false;
+
+    // A key too long to store (more data than maxVersion holds) bypasses the cache
+    uint8_t key[QRCODE_CACHE_KEY_BYTES(QRCODE_VERSION_MAX)];
+    uint64_t hash[2];
+    size_t keyLength = QrCodeCacheKey(qrcode, key, cache->keyBytes, hash);
+    if (keyLength == 0) return QrCodeGenerate(qrcode, buffer, scratchBuffer);
+    qrcode_cache_shard_t *shard = &((qrcode_cache_shard_t *)cache->shards)[hash[1] % (uint64_t)cache->shardCount];
+
+    // Hit: copy the stored modules and chosen mask
+    QrCodeLock(&shard->lock);
+    int32_t index = QrCodeCacheFind(cache, shard, hash, key, keyLength);
+    if (index >= 0)
+    {
+        qrcode_cache_entry_t *entry = &shard->entries[index];
+        shard->hits++;
+        QrCodeCacheUnlink(shard, index);
+        QrCodeCacheLinkHead(shard, index);
+        memcpy(buffer, entry->modules, entry->bufferSize);
+        qrcode->maskPattern = (qrcode_mask_pattern_t)entry->maskPattern;
+        qrcode->buffer = buffer;
+        QrCodeUnlock(&shard->lock);
+#ifdef QRCODE_STATS
+        if (qrcode->stats)
+        {
+            QrCodeStatsReset(qrcode);
+            QrCodeStatsResult(qrcode);
+            qrcode->stats->cached = true;
+        }
+#endif
+        return true;
+    }
+    shard->misses++;
+    QrCodeUnlock(&shard->lock);
+
+    // Miss: generate outside of the lock, then store (unless another thread already has)
+    if (!QrCodeGenerate(qrcode, buffer, scratchBuffer)) return false;
+    if (qrcode->bufferSize > cache->moduleBytes) return true;
+    QrCodeLock(&shard->lock);
+    if (QrCodeCacheFind(cache, shard, hash, key, keyLength) < 0)
+    {
+        if (shard->used < cache->entriesPerShard)
+        {
+            index = shard->used++;
+        }
+        else
+        {
+            // Evict the least recently used entry
+            index = shard->tail;
+            QrCodeCacheUnlink(shard, index);
+            int32_t *link = &shard->buckets[shard->entries[index].hash[0] & (uint64_t)(cache->bucketsPerShard - 1)];
+            while (*link != index) link = &shard->entries[*link].chain;
+            *link = shard->entries[index].chain;
+        }
+        qrcode_cache_entry_t *entry = &shard->entries[index];
+        entry->hash[0] = hash[0];
+        entry->hash[1] = hash[1];
+        entry->maskPattern = (int8_t)qrcode->maskPattern;
+        entry->bufferSize = qrcode->bufferSize;
+        memcpy(entry->modules, buffer, qrcode->bufferSize);
+        entry->keyLength = keyLength;
+        memcpy(entry->key, key, keyLength);
+        int32_t *bucket = &shard->buckets[hash[0] & (uint64_t)(cache->bucketsPerShard - 1)];
+        entry->chain = *bucket;
+        *bucket = index;
+        QrCodeCacheLinkHead(shard, index);
+    }
+    QrCodeUnlock(&shard->lock);
+    return true;
+}
+
+// Default batch options, as for QrCodeInit()
+void QrCodeBatchOptionsInit(qrcode_batch_options_t *options, int maxVersion, qrcode_error_correction_level_t errorCorrectionLevel)
+{
+    memset(options, 0, sizeof(qrcode_batch_options_t));
+    options->maxVersion = maxVersion;
+    options->errorCorrectionLevel = errorCorrectionLevel;
+    options->optimizeEcc = true;
+    options->maskPattern = QRCODE_MASK_AUTO;
+    options->maskThreads = 0;
+    options->mayUppercase = false;
+    options->eciUtf8 = false;
+    options->threads = 0;
+    options->cache = NULL;
+}
+
+// Estimated relative cost of generating an item: the modules of the smallest version that would hold it as 8-bit data (V40 is ~70x V1)
+static uint64_t QrCodeBatchCost(const qrcode_batch_item_t *item, const qrcode_batch_options_t *options)
+{
+    size_t length = (item->charCount == QRCODE_TEXT_LENGTH) ? strlen(item->text) : item->charCount;
+    size_t bits = QRCODE_SIZE_MODE_INDICATOR + 16 + 8 * length;
+    int version = QRCODE_VERSION_MIN;
+    while (version < options->maxVersion && QrCodeDataCapacity(version, options->errorCorrectionLevel) < bits) version++;
+    uint64_t dimension = QRCODE_VERSION_TO_DIMENSION(version);
+    return dimension * dimension;
+}
+
+typedef struct qrcode_batch_tag qrcode_batch_t;
+
+// Batch worker: takes items from the head of its own range, then steals from the tail of others'
+typedef struct
+{
+    qrcode_batch_t *batch;
+    uint8_t *scratchBuffer;
+    volatile int64_t range;     // Remaining items [head, tail) packed as (tail << 32) | head
+    size_t generated;
+} qrcode_batch_worker_t;
+
+struct qrcode_batch_tag
+{
+    qrcode_batch_item_t *items;
+    const qrcode_batch_options_t *options;
+    uint8_t *arena;
+    size_t arenaSize;
+    volatile int64_t arenaUsed;
+    int workerCount;
+    qrcode_batch_worker_t workers[QRCODE_BATCH_THREADS_MAX];
+};
+
+// Take an item from the head (owner) or tail (thief) of a worker's range
+static bool QrCodeBatchTake(qrcode_batch_worker_t *worker, bool steal, uint32_t *index)
+{
+    for (;;)
+    {
+        int64_t range = QrCodeAtomicLoad64(&worker->range);
+        uint32_t head = (uint32_t)range, tail = (uint32_t)((uint64_t)range >> 32);
+        if (head >= tail) return false;
+        if (steal) tail--; else head++;
+        if (QrCodeAtomicExchange64(&worker->range, range, (int64_t)(((uint64_t)tail << 32) | head)))
+        {
+            *index = steal ? tail : head - 1;
+            return true;
+        }
+    }
+}
+
+// Exactly-sized output buffer from the arena (NULL=exhausted)
+static uint8_t *QrCodeBatchArenaTake(qrcode_batch_t *batch, size_t size)
+{
+    for (;;)
+    {
+        int64_t used = QrCodeAtomicLoad64(&batch->arenaUsed);
+        if (batch->arena == NULL || size > batch->arenaSize - (size_t)used) return NULL;
+        if (QrCodeAtomicExchange64(&batch->arenaUsed, used, used + (int64_t)size)) return batch->arena + used;
+    }
+}
+
+static bool QrCodeBatchGenerateItem(qrcode_batch_t *batch, qrcode_batch_item_t *item, uint8_t *scratchBuffer)
+{
+    const qrcode_batch_options_t *options = batch->options;
+    qrcode_t *qrcode = &item->qrcode;
+    qrcode_segment_t segments[QRCODE_BATCH_SEGMENTS];
+
+    QrCodeInit(qrcode, options->maxVersion, options->errorCorrectionLevel);
+    qrcode->optimizeEcc = options->optimizeEcc;
+    qrcode->maskPattern = options->maskPattern;
+    qrcode->maskThreads = options->maskThreads;
+    QrCodeSegmentAppendOptimal(qrcode, segments, QRCODE_BATCH_SEGMENTS, item->text, item->charCount, options->mayUppercase, options->eciUtf8);
+
+    bool result = QrCodePrepare(qrcode);
+    uint8_t *buffer = item->buffer;
+    if (result && buffer == NULL)
+    {
+        buffer = QrCodeBatchArenaTake(batch, qrcode->bufferSize);
+        if (buffer == NULL) result = false;
+    }
+    if (result) result = QrCodeGenerateCached(options->cache, qrcode, buffer, scratchBuffer);
+
+    // The segments and scratch area do not outlive this item
+    qrcode->firstSegment = NULL;
+    qrcode->scratchBuffer = NULL;
+    if (!result)
+    {
+        qrcode->buffer = NULL;
+        qrcode->dimension = 0;
+    }
+    return result;
+}
+
+static void QrCodeBatchWorker(void *argument)
+{
+    qrcode_batch_worker_t *worker = (qrcode_batch_worker_t *)argument;
+    qrcode_batch_t *batch = worker->batch;
+    worker->generated = 0;
+    for (;;)
+    {
+        uint32_t index;
+        qrcode_batch_worker_t *victim = worker;
+        if (!QrCodeBatchTake(worker, false, &index))
+        {
+            // Steal from the worker with the most remaining items
+            uint32_t most = 0;
+            victim = NULL;
+            for (int i = 0; i < batch->workerCount; i++)
+            {
+                int64_t range = QrCodeAtomicLoad64(&batch->workers[i].range);
+                uint32_t head = (uint32_t)range, tail = (uint32_t)((uint64_t)range >> 32);
+                if (tail > head && tail - head > most) { most = tail - head; victim = &batch->workers[i]; }
+            }
+            if (victim == NULL) break;
+            if (!QrCodeBatchTake(victim, true, &index)) continue;
+        }
+        if (QrCodeBatchGenerateItem(batch, &batch->items[index], worker->scratchBuffer)) worker->generated++;
+    }
+}
+
+// Generate a code for each item, sharing one scratch area per thread and taking any missing output buffers from the arena
+size_t QrCodeGenerateBatch(qrcode_batch_item_t *items, size_t count, const qrcode_batch_options_t *options, uint8_t *arena, size_t arenaSize, uint8_t *scratchBuffer)
+{
+    qrcode_batch_t batch;
+    batch.options = options;
+    batch.arena = arena;
+    batch.arenaSize = arenaSize;
+    batch.arenaUsed = 0;
+
+    // Workers (each item is small work, so one range per thread)
+    int workerCount = options->threads;
+#if defined(QRCODE_NO_THREADS) || !defined(QRCODE_ATOMICS)
+    workerCount = 1;
+#endif
+    if (workerCount > QRCODE_BATCH_THREADS_MAX) workerCount = QRCODE_BATCH_THREADS_MAX;
+    if ((size_t)workerCount > count) workerCount = (int)count;
+    if (workerCount < 1) workerCount = 1;
+    batch.workerCount = workerCount;
+
+    // Scratch area per worker for the largest allowed version, from the arena if not given
+    size_t scratchBufferSize = QRCODE_SCRATCH_BUFFER_SIZE(options->maxVersion);
+#ifdef QR_DEBUG_DUMP
+    scratchBufferSize *= 8;
+#endif
+    if (scratchBuffer == NULL)
+    {
+        if (arena == NULL || scratchBufferSize * workerCount > arenaSize) return 0;
+        scratchBuffer = arena;
+        batch.arenaUsed = (int64_t)(scratchBufferSize * workerCount);
+    }
+    for (int i = 0; i < workerCount; i++)
+    {
+        batch.workers[i].batch = &batch;
+        batch.workers[i].scratchBuffer = scratchBuffer + i * scratchBufferSize;
+    }
+
+    // Ranges are indexed with 32 bits
+    size_t generated = 0;
+    for (size_t offset = 0; offset < count; offset += 0x7fffffff)
+    {
+        uint32_t part = (uint32_t)((count - offset) < 0x7fffffff ? (count - offset) : 0x7fffffff);
+        batch.items = items + offset;
+
+        // Contiguous ranges of about equal estimated cost
+        uint64_t total = 0, cost = 0;
+        for (uint32_t i = 0; i < part; i++) total += QrCodeBatchCost(&batch.items[i], options);
+        uint32_t head = 0;
+        int worker = 0;
+        for (uint32_t i = 0; i < part && worker < workerCount - 1; i++)
+        {
+            cost += QrCodeBatchCost(&batch.items[i], options);
+            if (cost * workerCount >= total * (worker + 1))
+            {
+                batch.workers[worker++].range = (int64_t)(((uint64_t)(i + 1) << 32) | head);
+                head = i + 1;
+            }
+        }
+        for (; worker < workerCount; worker++)
+        {
+            batch.workers[worker].range = (int64_t)(((uint64_t)part << 32) | head);
+            head = part;
+        }
+
+        QrCodeRunWorkers(QrCodeBatchWorker, batch.workers, sizeof(batch.workers[0]), workerCount);
+        for (int i = 0; i < workerCount; i++) generated += batch.workers[i].generated;
+    }
+    return generated;
+}
@@ -37,8 +37,15 @@ static size_t QrCodeTotalCapacity(int version)
 */
 
 
+#define QRCODE_MASK_THREADS_MIN_VERSION 25  // Smallest version for which mask candidates are scored on multiple threads
+#define QRCODE_MASK_THREADS_MAX 8           // One thread per mask candidate
+
 #define QRCODE_TEXT_LENGTH ((size_t)-1)
 
+// Thread safety: the functions are reentrant, they only share the per-version tables, which are built on first use.  Different qrcode_t objects (each with their own
+// segments and buffers) can be used concurrently from any threads, but one object must not be.  Compilers without atomics (other than MSVC, GCC and Clang) must first
+// generate a code of each version used (or QRCODE_VERSION_MAX) from a single thread.
+
 // Error correction level
 typedef enum
 {
@@ -51,6 +58,7 @@ typedef enum
 // Mask pattern reference (i=row, j=column; where true: invert)
 typedef enum
 {
+    QRCODE_MASK_FAST = -2,  // Automatically determine a good mask quickly (heuristic: features 1 and 3 of the penalty scored on rows only)
     QRCODE_MASK_AUTO = -1,  // Automatically determine best mask
     QRCODE_MASK_000 = 0x00, // 0b000 (i + j) mod 2 = 0
     QRCODE_MASK_001 = 0x01, // 0b001 i mod 2 = 0
@@ -69,7 +77,7 @@ typedef enum
     QRCODE_MODE_INDICATOR_NUMERIC = 0x01,           // 0b0001 Numeric (maximal groups of 3/2/1 digits encoded to 10/7/4-bit binary)
     QRCODE_MODE_INDICATOR_ALPHANUMERIC = 0x02,      // 0b0010 Alphanumeric ('0'-'9', 'A'-'Z', ' ', '$', '%', '*', '+', '-', '.', '/', ':') -> 0-44 index. Pairs combined (a*45+b) encoded as 11-bit; odd remainder encoded as 6-bit.
     QRCODE_MODE_INDICATOR_8_BIT = 0x04,             // 0b0100 8-bit byte
-    QRCODE_MODE_INDICATOR_KANJI = 0x08,             // 0b1000 Kanji
+    QRCODE_MODE_INDICATOR_KANJI = 0x08,             // 0b1000 Kanji (13-bit Shift JIS double-byte characters, from UTF-8 text with charCount in bytes)
     QRCODE_MODE_INDICATOR_STRUCTURED_APPEND = 0x03, // 0b0011 Structured Append
     QRCODE_MODE_INDICATOR_FNC1_FIRST = 0x05,        // 0b0101 FNC1 (First position)
     QRCODE_MODE_INDICATOR_FNC1_SECOND = 0x09,       // 0b1001 FNC1 (Second position)
@@ -88,6 +96,36 @@ typedef struct qrcode_segment_tag
     struct qrcode_segment_tag *next;    // Next segment
 } qrcode_segment_t;
 
+#ifdef QRCODE_STATS
+// Optional instrumentation (only when compiled with QRCODE_STATS defined, for both the library and its callers): set qrcode_t.stats before preparing/generating a code
+typedef enum
+{
+    QRCODE_STAGE_PREPARE = 0,       // Version selection and ECL upgrade (if not already prepared)
+    QRCODE_STAGE_SEGMENTS,          // Writing the data segments
+    QRCODE_STAGE_PADDING,           // Terminator and pad codewords
+    QRCODE_STAGE_ECC,               // Reed-Solomon ECC of each block
+    QRCODE_STAGE_PLACEMENT,         // Interleaved codewords onto the function pattern template
+    QRCODE_STAGE_MASK_SELECTION,    // Scoring the automatic mask candidates
+    QRCODE_STAGE_FINISH,            // Applying the mask, format/version information, and packing into the buffer
+    QRCODE_STAGE_COUNT
+} qrcode_stage_t;
+
+typedef struct
+{
+    uint64_t stageNs[QRCODE_STAGE_COUNT];   // Time spent in each stage (ns)
+    uint64_t totalNs;                       // Time spent generating (ns)
+    uint32_t cursorSteps;                   // Placement cursor steps to walk the version (taken once, when its cached layout is built)
+    uint32_t placementSteps;                // Codeword bits placed from the cached placement table
+    int maskPenalty[8];                     // Penalty of each mask candidate (-1=not scored; a candidate abandoned early has a partial score, already no better than the best)
+    int version;                            // Chosen version
+    qrcode_mask_pattern_t maskPattern;      // Chosen mask
+    qrcode_error_correction_level_t errorCorrectionLevel;           // Final error correction level
+    qrcode_error_correction_level_t requestedErrorCorrectionLevel;  // Error correction level before any upgrade
+    bool eclUpgraded;                       // Upgraded by optimizeEcc
+    bool cached;                            // Copied by QrCodeGenerateCached() (no stages run)
+} qrcode_stats_t;
+#endif
+
 // QR Code Object
 typedef struct
 {
@@ -95,6 +133,10 @@ typedef struct
     int maxVersion;             // Maximum allowed version
     qrcode_error_correction_level_t errorCorrectionLevel;
     bool optimizeEcc;           // Allow finding a better ECC for free within the same size
+    int maskThreads;            // Threads to score the automatic mask candidates of large codes (QRCODE_MASK_THREADS_MIN_VERSION+) concurrently (0/1=single-threaded)
+#ifdef QRCODE_STATS
+    qrcode_stats_t *stats;      // Filled on generation (NULL=none)
+#endif
 
     // Data payload
     qrcode_segment_t *firstSegment;
@@ -117,9 +159,22 @@ typedef struct
 // Initialize a QR Code object
 void QrCodeInit(qrcode_t *qrcode, int maxVersion, qrcode_error_correction_level_t errorCorrectionLevel);
 
-// Add a text segment to the QR Code object (mode=QRCODE_MODE_INDICATOR_AUTOMATIC, charCount=QRCODE_TEXT_LENGTH if null-terminated string)
+// Add a text segment to the QR Code object (mode=QRCODE_MODE_INDICATOR_AUTOMATIC, charCount=QRCODE_TEXT_LENGTH if null-terminated string; QRCODE_MODE_INDICATOR_KANJI text that is not entirely Kanji is added as 8-bit)
 void QrCodeSegmentAppend(qrcode_t *qrcode, qrcode_segment_t *segment, qrcode_mode_indicator_t mode, const char *text, size_t charCount, bool mayUppercase);
 
+// Add text as the shortest sequence of numeric, alphanumeric, Kanji and 8-bit segments (for the character count sizes of the smallest version band that fits), using up to maxSegments entries of segments[] (which must remain valid as the text does).
+// eciUtf8: first add an ECI segment for UTF-8 if the text contains non-ASCII.  Falls back to a single segment if more than maxSegments would be needed.  Returns the number of segments used.
+#define QRCODE_SEGMENT_OPTIMAL_MAX_CHARS 7089   // Longest text that can fit in any code (numeric capacity of V40-L)
+int QrCodeSegmentAppendOptimal(qrcode_t *qrcode, qrcode_segment_t *segments, int maxSegments, const char *text, size_t charCount, bool mayUppercase, bool eciUtf8);
+
+// Split text across the fewest Structured Append symbols (up to maxSymbols, at most QRCODE_STRUCTURED_APPEND_MAX) of the smallest common version (up to maxVersion), balancing the data between them.
+// Initializes each of qrcodes[] (all set to the common version), sharing up to maxSegments entries of segments[] (which must remain valid as the text does).  Returns the number of symbols (0=does not fit).
+#define QRCODE_STRUCTURED_APPEND_MAX 16
+int QrCodeStructuredAppend(qrcode_t *qrcodes, int maxSymbols, int maxVersion, qrcode_error_correction_level_t errorCorrectionLevel, qrcode_segment_t *segments, int maxSegments, const char *text, size_t charCount, bool mayUppercase);
+
+// Generate 'count' codes of the same version (e.g. from QrCodeStructuredAppend()) on up to 'threads' threads: buffer and scratchBuffer hold count consecutive buffers of the sizes from QrCodeSize()
+bool QrCodeStructuredAppendGenerate(qrcode_t *qrcodes, int count, uint8_t *buffer, uint8_t *scratchBuffer, int threads);
+
 // Get the dimension of the code (0=error), minimum buffer size for output, and scratch buffer size (will be less than the output buffer size)
 int QrCodeSize(qrcode_t *qrcode, size_t *bufferSize, size_t *scratchBufferSize);
 
@@ -129,6 +184,86 @@ bool QrCodeGenerate(qrcode_t *qrcode, uint8_t *buffer, uint8_t *scratchBuffer);
 // Get the module at the given coordinate (0=light, 1=dark)
 int QrCodeModuleGet(qrcode_t* qrcode, int x, int y);
 
+// Bytes for one packed row of modules, including the quiet margin on both sides
+#define QRCODE_ROW_BYTES(_dimension, _quiet) QRCODE_BUFFER_SIZE_BYTES((_dimension) + 2 * (_quiet))
+
+// Pack row y (may be within the quiet margin) into 'row' (QRCODE_ROW_BYTES()), one bit per module (1=dark), most-significant bit first, from x=-quiet to dimension+quiet-1, zero padded; returns the width in modules (0=error)
+int QrCodeRowPack(qrcode_t *qrcode, int y, int quiet, uint8_t *row);
+
+// A horizontal run of dark modules
+typedef struct
+{
+    int x;
+    int length;
+} qrcode_span_t;
+
+// Maximum number of spans in a row
+#define QRCODE_SPANS_MAX(_dimension) (((_dimension) + 1) / 2)
+
+// Get the runs of dark modules in row y, left to right (QRCODE_SPANS_MAX() entries; the quiet margin is always light); returns the number of spans
+int QrCodeRowSpans(qrcode_t *qrcode, int y, qrcode_span_t *spans);
+
+// Bounded LRU cache of generated codes (key: the segments, version, ECL, mask and optimizeEcc, found by hash and compared in full; value: the packed modules and chosen mask), safe to share between threads
+#define QRCODE_CACHE_SHARDS 16      // Independently locked parts
+typedef struct
+{
+    void *shards;               // (internal, in the caller's memory)
+    int shardCount;
+    int entriesPerShard;
+    int bucketsPerShard;
+    int maxVersion;
+    size_t moduleBytes;
+    size_t keyBytes;
+} qrcode_cache_t;
+
+// Memory needed for a cache of up to 'entries' codes of up to maxVersion
+size_t QrCodeCacheMemorySize(int entries, int maxVersion);
+
+// Initialize a cache in the caller's memory (8-byte aligned, at least QrCodeCacheMemorySize())
+bool QrCodeCacheInit(qrcode_cache_t *cache, void *memory, size_t memorySize, int entries, int maxVersion);
+
+// As QrCodeGenerate(), but an identical code generated before is copied from the cache (cache may be NULL)
+bool QrCodeGenerateCached(qrcode_cache_t *cache, qrcode_t *qrcode, uint8_t *buffer, uint8_t *scratchBuffer);
+
+// Cache hit and miss counts
+void QrCodeCacheStats(qrcode_cache_t *cache, uint64_t *hits, uint64_t *misses);
+
+// Options shared by every code of a batch
+typedef struct
+{
+    int maxVersion;             // Maximum allowed version
+    qrcode_error_correction_level_t errorCorrectionLevel;
+    bool optimizeEcc;           // Allow finding a better ECC for free within the same size
+    qrcode_mask_pattern_t maskPattern;
+    int maskThreads;            // As for qrcode_t
+    bool mayUppercase;          // Allow lowercase text to be uppercased for alphanumeric mode
+    bool eciUtf8;               // Add a UTF-8 ECI segment for non-ASCII text
+    int threads;                // Threads to generate the items on, sharing the work by estimated cost and stealing as they finish (0/1=single-threaded)
+    qrcode_cache_t *cache;      // Cache to reuse identical codes from (NULL=none)
+} qrcode_batch_options_t;
+
+// One code of a batch
+typedef struct
+{
+    const char *text;           // Payload
+    size_t charCount;           // Payload length (QRCODE_TEXT_LENGTH if null-terminated string)
+    uint8_t *buffer;            // Output buffer of at least QRCODE_BUFFER_SIZE(maxVersion) bytes, or NULL to take exactly what is needed from the arena
+    qrcode_t qrcode;            // Generated code for QrCodeModuleGet() etc. (dimension 0: does not fit, or the arena is exhausted)
+} qrcode_batch_item_t;
+
+#define QRCODE_BATCH_SEGMENTS 64    // Segments available to each payload (more falls back to a single segment)
+#define QRCODE_BATCH_THREADS_MAX 64
+
+// Arena size sufficient for the scratch areas of 'threads' threads and the output of 'count' items without their own buffer
+#define QRCODE_BATCH_ARENA_SIZE(_v, _count, _threads) ((size_t)((_threads) > 1 ? (_threads) : 1) * QRCODE_SCRATCH_BUFFER_SIZE(_v) + (size_t)(_count) * QRCODE_BUFFER_SIZE(_v))
+
+// Initialize batch options with the same defaults as QrCodeInit()
+void QrCodeBatchOptionsInit(qrcode_batch_options_t *options, int maxVersion, qrcode_error_correction_level_t errorCorrectionLevel);
+
+// Generate a code for each item without any heap allocation: each thread reuses one scratch area of QRCODE_SCRATCH_BUFFER_SIZE(maxVersion), consecutive in scratchBuffer (NULL: taken from the start of the arena),
+// and items without a buffer are given one from the arena (may be NULL if all items have buffers).  Returns the number of codes generated.
+size_t QrCodeGenerateBatch(qrcode_batch_item_t *items, size_t count, const qrcode_batch_options_t *options, uint8_t *arena, size_t arenaSize, uint8_t *scratchBuffer);
+
 
 
 typedef enum
@@ -149,6 +284,16 @@ typedef enum
 // Determines which part a given module coordinate belongs to.
 qrcode_part_t QrCodeIdentifyModule(qrcode_t* qrcode, int x, int y, int *index);
 
+// Part map entry decoding (part in the upper 3 bits, index+1 in the lower 5 bits)
+#define QRCODE_PART_MAP_PART(_e) ((qrcode_part_t)((int)((_e) >> 5) - 4))
+#define QRCODE_PART_MAP_INDEX(_e) ((int)((_e) & 0x1f) - 1)
+
+// Cached map of the part and index for every module of a version, one byte each at (y * dimension + x) (NULL if invalid version)
+const uint8_t *QrCodePartMap(int version);
+
+// Cached bitmask of the content (data/ECC) modules of a version, packed the same as the code buffer (NULL if invalid version)
+const uint8_t *QrCodeContentMap(int version);
+
 #ifdef __cplusplus
 }
 #endif
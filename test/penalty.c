@@ -0,0 +1,261 @@
+// QR Code Generator -- penalty test
+// Checks the word-parallel mask penalty scoring against the original scalar implementation for every version, error correction level and mask (see "make test").
+// The library is compiled into this program so that its internal scoring can be called directly.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../qrcode.c"
+
+// The original scalar penalty, module by module (with 'fast': features 1 and 3 on the rows only, as QRCODE_MASK_FAST)
+static int TestReferencePenalty(qrcode_t *qrcode, bool fast)
+{
+    // Note: Penalty calculated over entire code
+    const int scoreN1 = 3;
+    const int scoreN2 = 3;
+    const int scoreN3 = 40;
+    const int scoreN4 = 10;
+    int totalPenalty = 0;
+
+    // Feature 1: Adjacent identical modules in row/column: (5 + i) count, penalty points: N1 + i
+    // Feature 3: 1:1:3:1:1 ratio patterns (either polarity) in row/column, penalty points: N3
+    for (int swapAxis = 0; swapAxis <= (fast ? 0 : 1); swapAxis++)
+    {
+        int runs[5];
+        int runsCount = 0;
+        for (int y = 0; y < qrcode->dimension; y++)
+        {
+            int lastBit = -1;
+            int runLength = 0;
+            for (int x = 0; x < qrcode->dimension; x++)
+            {
+                int bit = QrCodeModuleGet(qrcode, swapAxis ? y : x, swapAxis ? x : y);
+                // Run extended
+                if (bit == lastBit) runLength++;
+                // End of run
+                if (bit != lastBit || x >= qrcode->dimension - 1)
+                {
+                    // If not start condition
+                    if (lastBit >= 0)
+                    {
+                        // Feature 1
+                        if (runLength >= 5)
+                        {
+                            totalPenalty += scoreN1 + (runLength - 5);
+                        }
+
+                        // Feature 3
+                        runsCount++;
+                        runs[runsCount % 5] = runLength;
+                        // Once we have a history of 5 lengths, check proportion
+                        if (runsCount >= 5)
+                        {
+                            // Proportion:             1 : 1 : 3 : 1 : 1
+                            // Modulo relative index: +3, +4,  0, +1, +2
+                            // Check for proportions
+                            int v = runs[(runsCount + 1) % 5];
+                            if (runs[runsCount % 5] == 3 * v && v == runs[(runsCount + 2) % 5] && v == runs[(runsCount + 3) % 5] && v == runs[(runsCount + 4) % 5])
+                            {
+                                totalPenalty += scoreN3;
+                            }
+                        }
+                    }
+                    runLength = 1;
+                    lastBit = bit;
+                }
+            }
+        }
+    }
+
+    // Feature 2: Block of identical modules: m * n size, penalty points: N2 * (m-1) * (n-1)
+    for (int y = 0; y < qrcode->dimension - 1; y++)
+    {
+        for (int x = 0; x < qrcode->dimension - 1; x++)
+        {
+            int bits = QrCodeModuleGet(qrcode, x, y);
+            bits += QrCodeModuleGet(qrcode, x+1, y);
+            bits += QrCodeModuleGet(qrcode, x, y+1);
+            bits += QrCodeModuleGet(qrcode, x+1, y+1);
+            if (bits == 0 || bits == 4) totalPenalty += scoreN2;
+        }
+    }
+
+    // Feature 4: Dark module percentage: 50 +|- (5*k) to 50 +|- (5*(k+1)), penalty points: N4 * k
+    {
+        int32_t darkCount = 0;
+        for (int y = 0; y < qrcode->dimension; y++)
+        {
+            for (int x = 0; x < qrcode->dimension; x++)
+            {
+                int bit = QrCodeModuleGet(qrcode, x, y);
+                if (bit == QRCODE_MODULE_DARK) darkCount++;
+            }
+        }
+        // Deviation from 50%
+        int percentage = (int)((100 * darkCount + (qrcode->dimension * qrcode->dimension / 2)) / (qrcode->dimension * qrcode->dimension));
+        int deviation = abs(percentage - 50);
+        int rating = deviation / 5;
+        int penalty = scoreN4 * rating;
+        totalPenalty += penalty;
+    }
+
+    return totalPenalty;
+}
+
+// Deterministic pseudo-random numbers (xorshift), the same on every platform
+static uint32_t testSeed = 2463534242u;
+static uint32_t TestRandom(uint32_t range)
+{
+    testSeed ^= testSeed << 13;
+    testSeed ^= testSeed >> 17;
+    testSeed ^= testSeed << 5;
+    return testSeed % range;
+}
+
+// Set a module in the code's buffer (the layout read by QrCodeModuleGet)
+static void TestModuleSet(qrcode_t *qrcode, int x, int y, int bit)
+{
+    size_t offset = (size_t)y * qrcode->dimension + x;
+#ifdef QR_DEBUG_DUMP
+    qrcode->buffer[offset] = (uint8_t)bit;
+#else
+    if (bit) qrcode->buffer[offset >> 3] |= (uint8_t)(0x80 >> (offset & 7));
+    else qrcode->buffer[offset >> 3] &= (uint8_t)~(0x80 >> (offset & 7));
+#endif
+}
+
+static long testChecks = 0;
+static long testFailures = 0;
+
+static void TestExpect(int actual, int expected, const char *what, int version, int level, int mask)
+{
+    testChecks++;
+    if (actual == expected) return;
+    testFailures++;
+    printf("MISMATCH: %s V%d level %d mask %d: %d, expected %d\n", what, version, level, mask, actual, expected);
+}
+
+// Compare every scoring path for the modules currently in the code's buffer ('layout' only for a generated code, whose fixed modules it describes)
+static void TestPenalty(qrcode_t *qrcode, const qrcode_layout_t *layout, const char *what, int level, int mask)
+{
+    int expected = TestReferencePenalty(qrcode, false);
+    TestExpect(QrCodeEvaluatePenalty(qrcode), expected, what, qrcode->version, level, mask);
+
+    qrcode_board_t board;
+    QrCodeBoardLoad(&board, qrcode);
+    TestExpect(QrCodeBoardEvaluatePenalty(&board, NULL, -1, true), TestReferencePenalty(qrcode, true), what, qrcode->version, level, mask);
+    if (layout != NULL)
+    {
+        TestExpect(QrCodeBoardEvaluatePenalty(&board, layout, -1, false), expected, what, qrcode->version, level, mask);
+        TestExpect(QrCodeBoardEvaluatePenalty(&board, layout, -1, true), TestReferencePenalty(qrcode, true), what, qrcode->version, level, mask);
+    }
+
+    // An early stop returns a partial score of at least the limit, only when the full score reaches it
+    for (int i = 0; i < 3; i++)
+    {
+        int limit = (i == 0) ? expected : (int)TestRandom((uint32_t)expected * 2 + 1);
+        int partial = QrCodeBoardEvaluatePenalty(&board, layout, limit, false);
+        testChecks++;
+        if ((expected >= limit) != (partial >= limit) || (partial < limit && partial != expected))
+        {
+            testFailures++;
+            printf("MISMATCH: %s V%d level %d mask %d: limit %d gave %d, full score %d\n", what, qrcode->version, level, mask, limit, partial, expected);
+        }
+    }
+}
+
+int main(void)
+{
+    static const qrcode_error_correction_level_t levels[] = { QRCODE_ECL_L, QRCODE_ECL_M, QRCODE_ECL_Q, QRCODE_ECL_H };
+    static uint8_t buffer[QRCODE_BUFFER_SIZE(QRCODE_VERSION_MAX)];
+    static uint8_t scratchBuffer[QRCODE_SCRATCH_BUFFER_SIZE(QRCODE_VERSION_MAX)];
+    static char text[8192];
+
+    for (int version = QRCODE_VERSION_MIN; version <= QRCODE_VERSION_MAX; version++)
+    {
+        const qrcode_layout_t *layout = QrCodeLayout(version);
+
+        // Generated codes: every level and mask, with 8-bit data of varying length
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        {
+            size_t maxLength = (QrCodeDataCapacity(version, levels[l]) - QRCODE_SIZE_MODE_INDICATOR - 16) / 8;
+            for (int mask = QRCODE_MASK_000; mask <= QRCODE_MASK_111; mask++)
+            {
+                size_t length = 1 + TestRandom((uint32_t)maxLength);
+                for (size_t i = 0; i < length; i++) text[i] = (char)(1 + TestRandom(255));
+                qrcode_t qrcode;
+                qrcode_segment_t segment;
+                QrCodeInit(&qrcode, version, levels[l]);
+                qrcode.version = version;
+                qrcode.maskPattern = (qrcode_mask_pattern_t)mask;
+                qrcode.optimizeEcc = false;
+                QrCodeSegmentAppend(&qrcode, &segment, QRCODE_MODE_INDICATOR_8_BIT, text, length, false);
+                testChecks++;
+                if (!QrCodeGenerate(&qrcode, buffer, scratchBuffer) || qrcode.version != version || qrcode.maskPattern != mask)
+                {
+                    testFailures++;
+                    printf("FAILED: generating V%d level %d mask %d\n", version, levels[l], mask);
+                    continue;
+                }
+                TestPenalty(&qrcode, NULL, "generated", levels[l], mask);
+
+                // Masks are scored before the version information is drawn (as originally): the layout's fixed blocks count those modules light
+                for (int y = 0; y < qrcode.dimension; y++)
+                {
+                    for (int x = 0; x < qrcode.dimension; x++)
+                    {
+                        if (QrCodeIdentifyModule(&qrcode, x, y, NULL) == QRCODE_PART_VERSION) TestModuleSet(&qrcode, x, y, 0);
+                    }
+                }
+                TestPenalty(&qrcode, layout, "unversioned", levels[l], mask);
+            }
+        }
+
+        // Random boards of varying density, then structured boards (uniform, stripes, 1:1:3:1:1 runs, checkerboards) through the same code
+        qrcode_t qrcode;
+        qrcode_segment_t segment;
+        QrCodeInit(&qrcode, version, QRCODE_ECL_L);
+        qrcode.version = version;
+        QrCodeSegmentAppend(&qrcode, &segment, QRCODE_MODE_INDICATOR_8_BIT, "0", 1, false);
+        if (!QrCodeGenerate(&qrcode, buffer, scratchBuffer)) { testFailures++; continue; }
+        int dimension = qrcode.dimension;
+        for (int density = 0; density <= 100; density += 5)
+        {
+            for (int y = 0; y < dimension; y++)
+            {
+                for (int x = 0; x < dimension; x++) TestModuleSet(&qrcode, x, y, TestRandom(100) < (uint32_t)density);
+            }
+            TestPenalty(&qrcode, NULL, "random", -1, density);
+        }
+        static const uint8_t runPattern[] = { 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 };   // 1:1:3:1:1 with a 4-module light margin
+        for (int pattern = 0; pattern < 8; pattern++)
+        {
+            for (int y = 0; y < dimension; y++)
+            {
+                for (int x = 0; x < dimension; x++)
+                {
+                    int bit;
+                    switch (pattern)
+                    {
+                        case 0: bit = 0; break;
+                        case 1: bit = 1; break;
+                        case 2: bit = (x + y) & 1; break;
+                        case 3: bit = ((x / 2) + (y / 3)) & 1; break;
+                        case 4: bit = runPattern[x % sizeof(runPattern)]; break;
+                        case 5: bit = runPattern[(x + y) % sizeof(runPattern)] ^ (y & 1); break;
+                        case 6: bit = (x % 7) < 5; break;
+                        default: bit = x < dimension / 2; break;
+                    }
+                    TestModuleSet(&qrcode, x, y, bit);
+                }
+            }
+            TestPenalty(&qrcode, NULL, "structured", -1, pattern);
+        }
+    }
+
+    printf("%ld checks, %ld failures\n", testChecks, testFailures);
+    return testFailures != 0;
+}
@@ -0,0 +1,91 @@
+// QR Code Generator -- segment test
+// Checks that explicit segment modes are sized and written consistently, so generation never writes past its buffers (see "make test").
+// The library is compiled into this program so that the chosen segment modes can be checked directly.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../qrcode.c"
+
+#define TEST_GUARD 64       // Bytes after each buffer that must stay untouched
+#define TEST_GUARD_BYTE 0xa5
+
+static long testChecks = 0;
+static long testFailures = 0;
+
+static void TestCheck(bool ok, const char *what, const char *text, int version, int level)
+{
+    testChecks++;
+    if (ok) return;
+    testFailures++;
+    printf("FAILED: %s for \"%s\" V%d level %d\n", what, text, version, level);
+}
+
+static bool TestGuardIntact(const uint8_t *guard)
+{
+    for (int i = 0; i < TEST_GUARD; i++) if (guard[i] != TEST_GUARD_BYTE) return false;
+    return true;
+}
+
+// Generate text as a single explicit Kanji segment: it must stay Kanji only if every character has a Shift JIS code, and never overrun the buffers
+static void TestKanji(const char *text, bool allKanji, int version, qrcode_error_correction_level_t level)
+{
+    static uint8_t buffer[QRCODE_BUFFER_SIZE(QRCODE_VERSION_MAX) + TEST_GUARD];
+    static uint8_t scratchBuffer[QRCODE_SCRATCH_BUFFER_SIZE(QRCODE_VERSION_MAX) + TEST_GUARD];
+    int maxVersion = (version > 0) ? version : QRCODE_VERSION_MAX;
+
+    qrcode_t qrcode;
+    qrcode_segment_t segment;
+    QrCodeInit(&qrcode, maxVersion, level);
+    if (version > 0) qrcode.version = version;
+    QrCodeSegmentAppend(&qrcode, &segment, QRCODE_MODE_INDICATOR_KANJI, text, QRCODE_TEXT_LENGTH, false);
+#ifndef QRCODE_NO_KANJI
+    TestCheck(segment.mode == (allKanji ? QRCODE_MODE_INDICATOR_KANJI : QRCODE_MODE_INDICATOR_8_BIT), "segment mode", text, version, level);
+#else
+    (void)allKanji;
+    TestCheck(segment.mode == QRCODE_MODE_INDICATOR_8_BIT, "segment mode", text, version, level);
+#endif
+
+    // Buffers of exactly the size needed, followed by guard bytes
+    size_t bufferSize = 0, scratchBufferSize = 0;
+    if (QrCodeSize(&qrcode, &bufferSize, &scratchBufferSize) <= 0)
+    {
+        TestCheck(version > 0, "fitting", text, version, level);
+        return;
+    }
+    memset(buffer + bufferSize, TEST_GUARD_BYTE, TEST_GUARD);
+    memset(scratchBuffer + scratchBufferSize, TEST_GUARD_BYTE, TEST_GUARD);
+    bool generated = QrCodeGenerate(&qrcode, buffer, scratchBuffer);
+    TestCheck(generated, "generating", text, version, level);
+    TestCheck(TestGuardIntact(buffer + bufferSize), "buffer overrun", text, version, level);
+    TestCheck(TestGuardIntact(scratchBuffer + scratchBufferSize), "scratch buffer overrun", text, version, level);
+}
+
+int main(void)
+{
+    static const qrcode_error_correction_level_t levels[] = { QRCODE_ECL_L, QRCODE_ECL_M, QRCODE_ECL_Q, QRCODE_ECL_H };
+    static const struct { const char *text; bool allKanji; } texts[] = {
+        { "漢字", true },
+        { "漢字漢字漢字漢字漢字", true },
+        { "漢字漢字漢字漢字漢字A", false },     // Kanji then ASCII
+        { "A漢字漢字漢字漢字漢字", false },     // ASCII then Kanji
+        { "漢字 漢字", false },
+        { "漢字\xe6", false },                  // Incomplete UTF-8
+        { "abc", false },
+    };
+
+    for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); t++)
+    {
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        {
+            TestKanji(texts[t].text, texts[t].allKanji, 0, levels[l]);     // Smallest version that fits
+            for (int version = QRCODE_VERSION_MIN; version <= QRCODE_VERSION_MAX; version++) TestKanji(texts[t].text, texts[t].allKanji, version, levels[l]);
+        }
+    }
+
+    printf("%ld checks, %ld failures\n", testChecks, testFailures);
+    return testFailures != 0;
+}